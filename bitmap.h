@@ -8,8 +8,45 @@
 #define _OUICHEFS_BITMAP_H
 
 #include <linux/bitmap.h>
+#include <linux/spinlock.h>
 #include "ouichefs.h"
 
+/*
+ * bitmap_set() and bitmap_clear() take 32-bit bit numbers: start from the word
+ * holding bit start, so that they also work on the bfree bitmap of 64-bit
+ * partitions.
+ */
+static inline void ouichefs_bitmap_set(unsigned long *map, unsigned long start,
+				       unsigned int len)
+{
+	bitmap_set(map + BIT_WORD(start), start % BITS_PER_LONG, len);
+}
+
+static inline void ouichefs_bitmap_clear(unsigned long *map,
+					 unsigned long start, unsigned int len)
+{
+	bitmap_clear(map + BIT_WORD(start), start % BITS_PER_LONG, len);
+}
+
+/*
+ * Number of bits set among the first nbits of map, counted in chunks for the
+ * same reason.
+ */
+static inline unsigned long ouichefs_bitmap_weight(const unsigned long *map,
+						   unsigned long nbits)
+{
+	unsigned long weight = 0, n;
+
+	while (nbits) {
+		n = min(nbits, 1UL << 31);
+		weight += bitmap_weight(map, n);
+		map += BIT_WORD(n);
+		nbits -= n;
+	}
+
+	return weight;
+}
+
 /*
  * Return the first free bit (set to 1) in a given in-memory bitmap spanning
  * over multiple blocks and clear it.
@@ -17,18 +54,18 @@
  * because of the superblock and the root inode, thus allowing us to use 0 as an
  * error value).
  */
-static inline uint32_t get_first_free_bit(unsigned long *freemap,
-					  unsigned long size)
+static inline unsigned long get_first_free_bit(unsigned long *freemap,
+					       unsigned long size)
 {
-	uint32_t ino;
+	unsigned long bit;
 
-	ino = find_first_bit(freemap, size);
-	if (ino == size)
+	bit = find_first_bit(freemap, size);
+	if (bit == size)
 		return 0;
 
-	bitmap_clear(freemap, ino, 1);
+	__clear_bit(bit, freemap);
 
-	return ino;
+	return bit;
 }
 
 /*
@@ -39,29 +76,114 @@ static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi)
 {
 	uint32_t ret;
 
+	spin_lock(&sbi->bitmap_lock);
 	ret = get_first_free_bit(sbi->ifree_bitmap, sbi->nr_inodes);
-	if (ret) {
+	if (ret)
 		sbi->nr_free_inodes--;
+	spin_unlock(&sbi->bitmap_lock);
+	if (ret)
 		pr_debug("%s:%d: allocated inode %u\n", __func__, __LINE__,
 			 ret);
-	}
 	return ret;
 }
 
 /*
- * Return an unused block number and mark it used.
+ * Free blocks that are not reserved for the writeback of dirty clusters of
+ * compressed files, i.e. that writes allocating blocks right away can use.
+ */
+static inline uint64_t ouichefs_avail_blocks(struct ouichefs_sb_info *sbi)
+{
+	uint64_t free = READ_ONCE(sbi->free_blocks_count);
+	uint64_t reserved = READ_ONCE(sbi->reserved_blocks);
+
+	return free > reserved ? free - reserved : 0;
+}
+
+/*
+ * Return an unused block for metadata (directory or index block) and mark it
+ * used. Blocks below the metadata zone are never free, so the lowest free
+ * block is in the zone unless it is full. A zone on a metadata device, or in
+ * front of the data zones of a zoned device, cannot spill over. Metadata block
+ * numbers are 32-bit, even on 64-bit partitions.
  * Return 0 if no free block was found.
  */
 static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi)
 {
+	unsigned long end = min_t(uint64_t, sbi->blocks_count, U32_MAX);
 	uint32_t ret;
 
-	ret = get_first_free_bit(sbi->bfree_bitmap, sbi->nr_blocks);
-	if (ret) {
-		sbi->nr_free_blocks--;
+	if (sbi->meta_bdev || ouichefs_is_zoned(sbi))
+		end = ouichefs_meta_end(sbi);
+
+	spin_lock(&sbi->bitmap_lock);
+	ret = get_first_free_bit(sbi->bfree_bitmap, end);
+	if (ret)
+		sbi->free_blocks_count--;
+	spin_unlock(&sbi->bitmap_lock);
+	if (ret)
 		pr_debug("%s:%d: allocated block %u\n", __func__, __LINE__,
 			 ret);
+	return ret;
+}
+
+/*
+ * Return an unused block for file data written with lifetime hint, and mark
+ * it used. Short-lived data is allocated from the last quarter of the
+ * partition and long-lived data from the quarter before it, so that blocks
+ * freed together sit together; other data is allocated from the end of the
+ * metadata zone. Searches wrap around once their region is full, to the end
+ * of the metadata zone, then try the blocks after their region, and only
+ * fall back to the metadata zone itself once every data block is used (never
+ * if it is on a metadata device).
+ * Return 0 if no free block was found.
+ */
+static inline uint64_t get_free_data_block(struct ouichefs_sb_info *sbi,
+					   enum rw_hint hint)
+{
+	unsigned long meta_end = ouichefs_meta_end(sbi), start = meta_end, ret;
+	unsigned long nr_blocks = sbi->blocks_count, end = nr_blocks;
+
+	switch (hint) {
+	case WRITE_LIFE_SHORT:
+		start = max(start, nr_blocks / 4 * 3);
+		break;
+	case WRITE_LIFE_LONG:
+	case WRITE_LIFE_EXTREME:
+		start = max(start, nr_blocks / 2);
+		end = max(start, nr_blocks / 4 * 3);
+		break;
+	default:
+		break;
+	}
+
+	spin_lock(&sbi->bitmap_lock);
+	ret = find_next_bit(sbi->bfree_bitmap, end, start);
+	if (ret == end)
+		ret = nr_blocks;
+	/* Data blocks before start next, then after end */
+	if (ret == nr_blocks) {
+		ret = find_next_bit(sbi->bfree_bitmap, start, meta_end);
+		if (ret == start)
+			ret = nr_blocks;
+	}
+	if (ret == nr_blocks)
+		ret = find_next_bit(sbi->bfree_bitmap, nr_blocks, end);
+	/* The metadata zone only when every data block is used */
+	if (ret == nr_blocks && !sbi->meta_bdev) {
+		ret = find_next_bit(sbi->bfree_bitmap, meta_end, 0);
+		if (ret == meta_end)
+			ret = nr_blocks;
 	}
+	if (ret == nr_blocks) {
+		ret = 0;
+	} else {
+		__clear_bit(ret, sbi->bfree_bitmap);
+		sbi->free_blocks_count--;
+	}
+	spin_unlock(&sbi->bitmap_lock);
+	if (ret)
+		pr_debug("%s:%d: allocated block %lu (hint %d)\n", __func__,
+			 __LINE__, ret, hint);
 	return ret;
 }
 
@@ -69,39 +191,131 @@ static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi)
  * Mark the i-th bit in freemap as free (i.e. 1)
  */
 static inline int put_free_bit(unsigned long *freemap, unsigned long size,
-			       uint32_t i)
+			       unsigned long i)
 {
 	/* i is greater than freemap size */
 	if (i > size)
 		return -1;
 
-	bitmap_set(freemap, i, 1);
+	__set_bit(i, freemap);
 
 	return 0;
 }
 
+/*
+ * Mark block bno used if it is free, e.g. to extend a contiguous run of
+ * blocks. Return true on success.
+ */
+static inline bool get_block_at(struct ouichefs_sb_info *sbi, uint64_t bno)
+{
+	bool ret = false;
+
+	spin_lock(&sbi->bitmap_lock);
+	if (bno < sbi->blocks_count && test_bit(bno, sbi->bfree_bitmap)) {
+		__clear_bit(bno, sbi->bfree_bitmap);
+		sbi->free_blocks_count--;
+		ret = true;
+	}
+	spin_unlock(&sbi->bitmap_lock);
+
+	return ret;
+}
+
 /*
  * Mark an inode as unused.
  */
 static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
 {
-	if (put_free_bit(sbi->ifree_bitmap, sbi->nr_inodes, ino))
+	spin_lock(&sbi->bitmap_lock);
+	if (put_free_bit(sbi->ifree_bitmap, sbi->nr_inodes, ino)) {
+		spin_unlock(&sbi->bitmap_lock);
 		return;
-
+	}
 	sbi->nr_free_inodes++;
+	spin_unlock(&sbi->bitmap_lock);
+
 	pr_debug("%s:%d: freed inode %u\n", __func__, __LINE__, ino);
 }
 
 /*
  * Mark a block as unused.
  */
-static inline void put_block(struct ouichefs_sb_info *sbi, uint32_t bno)
+static inline void put_block(struct ouichefs_sb_info *sbi, uint64_t bno)
 {
-	if (put_free_bit(sbi->bfree_bitmap, sbi->nr_blocks, bno))
+	spin_lock(&sbi->bitmap_lock);
+	if (put_free_bit(sbi->bfree_bitmap, sbi->blocks_count, bno)) {
+		spin_unlock(&sbi->bitmap_lock);
 		return;
+	}
+	sbi->free_blocks_count++;
+	spin_unlock(&sbi->bitmap_lock);
 
-	sbi->nr_free_blocks++;
-	pr_debug("%s:%d: freed block %u\n", __func__, __LINE__, bno);
+	pr_debug("%s:%d: freed block %llu\n", __func__, __LINE__, bno);
+}
+
+/*
+ * Find the first run of free blocks starting at or after block start, cut at
+ * block end. Return its length and store its first block in *first, or
+ * return 0 if there is no free block left in [start, end). The run is not
+ * reserved: it may shrink as soon as the lock is dropped.
+ */
+static inline uint64_t free_block_run(struct ouichefs_sb_info *sbi,
+				      uint64_t start, uint64_t end,
+				      uint64_t *first)
+{
+	unsigned long bit, next;
+	uint64_t len = 0;
+
+	spin_lock(&sbi->bitmap_lock);
+	bit = find_next_bit(sbi->bfree_bitmap, end, start);
+	if (bit < end) {
+		next = find_next_zero_bit(sbi->bfree_bitmap, end, bit);
+		len = next - bit;
+		*first = bit;
+	}
+	spin_unlock(&sbi->bitmap_lock);
+
+	return len;
+}
+
+/*
+ * Find the first run of free blocks starting at or after block start and
+ * ending before block end, and mark at most max_len of them used so that
+ * they cannot be allocated until they are given back with put_block_range().
+ * Return the length of the reserved run and store its first block in *first,
+ * or return 0 if there is no free block left in [start, end).
+ */
+static inline uint32_t reserve_block_range(struct ouichefs_sb_info *sbi,
+					   uint64_t start, uint64_t end,
+					   uint32_t max_len, uint64_t *first)
+{
+	unsigned long bit, next;
+	uint32_t len = 0;
+
+	spin_lock(&sbi->bitmap_lock);
+	bit = find_next_bit(sbi->bfree_bitmap, end, start);
+	if (bit < end) {
+		next = find_next_zero_bit(sbi->bfree_bitmap, end, bit);
+		len = min_t(unsigned long, next - bit, max_len);
+		ouichefs_bitmap_clear(sbi->bfree_bitmap, bit, len);
+		sbi->free_blocks_count -= len;
+		*first = bit;
+	}
+	spin_unlock(&sbi->bitmap_lock);
+
+	return len;
+}
+
+/*
+ * Mark len blocks starting at block first as unused.
+ */
+static inline void put_block_range(struct ouichefs_sb_info *sbi,
+				   uint64_t first, uint32_t len)
+{
+	spin_lock(&sbi->bitmap_lock);
+	ouichefs_bitmap_set(sbi->bfree_bitmap, first, len);
+	sbi->free_blocks_count += len;
+	spin_unlock(&sbi->bitmap_lock);
 }
 
 #endif /* _OUICHEFS_BITMAP_H */
@@ -0,0 +1,801 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/pagemap.h>
+#include <linux/pagevec.h>
+#include <linux/writeback.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/lz4.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * Compressed files
+ *
+ * The data of a regular file with OUICHEFS_INODE_COMPRESS set (chattr +c) is
+ * compressed with LZ4 by writeback, one cluster of OUICHEFS_CLUSTER_BLOCKS
+ * blocks at a time. A cluster that saves at least one block this way is
+ * stored in the first entries of its slot in the index block, the others
+ * being 0, and its bit is set in ci->cmap; its first block starts with the
+ * length of the compressed data. Other clusters are stored raw, one index
+ * entry per block as in other files. Compressed files have no extent.
+ *
+ * Blocks are only allocated at writeback, and a cluster is always written to
+ * new blocks, which are on disk before the index block points to them: the
+ * blocks it replaces are then released as those of a truncated file. So that
+ * writeback does not run out of blocks for data that write() accepted, the
+ * first page dirtied in a cluster reserves OUICHEFS_CLUSTER_BLOCKS blocks,
+ * and the cluster's bit is set in ci->rmap. Writeback takes the reservation
+ * over before looking up the pages of the cluster: pages dirtied later
+ * reserve again. Reads decompress the whole cluster, so readahead fills all
+ * its pages at once.
+ *
+ * In zoned mode, all regular files are written back this way so that their
+ * data is always written out of place, but only those with
+ * OUICHEFS_INODE_COMPRESS are compressed: the clusters of the others are
+ * stored raw, and they have no bitmap.
+ */
+
+/* Length of the compressed data, at the start of a compressed cluster */
+#define CLUSTER_HEADER sizeof(__le32)
+
+/* Buffers used to write clusters back */
+struct cluster_buf {
+	void *data; /* Uncompressed cluster */
+	void *cdata; /* Compressed cluster */
+	void *wrkmem; /* LZ4 state */
+};
+
+/*
+ * Only the clusters of compressed files need the LZ4 buffers
+ */
+static int cluster_buf_alloc(struct super_block *sb, struct cluster_buf *cb,
+			     bool compress)
+{
+	cb->data = kmalloc(OUICHEFS_CLUSTER_SIZE(sb), GFP_NOFS);
+	cb->cdata = NULL;
+	cb->wrkmem = NULL;
+	if (compress) {
+		cb->cdata = kmalloc(OUICHEFS_CLUSTER_SIZE(sb), GFP_NOFS);
+		cb->wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_NOFS);
+	}
+	if (!cb->data || (compress && (!cb->cdata || !cb->wrkmem)))
+		return -ENOMEM;
+	return 0;
+}
+
+static void cluster_buf_free(struct cluster_buf *cb)
+{
+	kvfree(cb->wrkmem);
+	kfree(cb->cdata);
+	kfree(cb->data);
+}
+
+/*
+ * Copy block bno to buf, or zero buf if bno is 0.
+ */
+static int read_block(struct super_block *sb, uint64_t bno, void *buf)
+{
+	struct buffer_head *bh;
+
+	if (!bno) {
+		memset(buf, 0, sb->s_blocksize);
+		return 0;
+	}
+	bh = ouichefs_bread(sb, bno);
+	if (!bh)
+		return -EIO;
+	memcpy(buf, bh->b_data, sb->s_blocksize);
+	brelse(bh);
+
+	return 0;
+}
+
+/*
+ * Fill buf with the OUICHEFS_CLUSTER_SIZE bytes of cluster c of inode, as
+ * stored on disk. Called with one of the pages of the cluster locked, so that
+ * it cannot be written back meanwhile.
+ */
+static int read_cluster(struct inode *inode, uint32_t c, void *buf)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	uint64_t blocks[OUICHEFS_CLUSTER_BLOCKS];
+	struct buffer_head *bh;
+	void *cdata;
+	uint32_t len;
+	bool compressed;
+	int i, n, ret;
+
+	mutex_lock(&ci->map_lock);
+	bh = ouichefs_bread(sb, ci->index_block);
+	if (!bh) {
+		mutex_unlock(&ci->map_lock);
+		return -EIO;
+	}
+	index = (struct ouichefs_file_index_block *)bh->b_data;
+	for (i = 0; i < OUICHEFS_CLUSTER_BLOCKS; i++)
+		blocks[i] = ouichefs_index_get(
+			sb, index, (c << OUICHEFS_CLUSTER_SHIFT) + i);
+	brelse(bh);
+	compressed = ouichefs_is_compressed(inode) && test_bit(c, ci->cmap);
+	mutex_unlock(&ci->map_lock);
+
+	if (!compressed) {
+		for (i = 0; i < OUICHEFS_CLUSTER_BLOCKS; i++) {
+			ret = read_block(sb, blocks[i],
+					 buf + i * sb->s_blocksize);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	cdata = kmalloc(OUICHEFS_CLUSTER_SIZE(sb), GFP_NOFS);
+	if (!cdata)
+		return -ENOMEM;
+	for (n = 0; n < OUICHEFS_CLUSTER_BLOCKS && blocks[n]; n++) {
+		ret = read_block(sb, blocks[n], cdata + n * sb->s_blocksize);
+		if (ret)
+			goto free;
+	}
+
+	ret = -EUCLEAN;
+	if (!n)
+		goto corrupted;
+	len = le32_to_cpu(*(__le32 *)cdata);
+	if (len > n * sb->s_blocksize - CLUSTER_HEADER)
+		goto corrupted;
+	ret = LZ4_decompress_safe(cdata + CLUSTER_HEADER, buf, len,
+				  OUICHEFS_CLUSTER_SIZE(sb));
+	if (ret < 0) {
+		ret = -EUCLEAN;
+		goto corrupted;
+	}
+	memset(buf + ret, 0, OUICHEFS_CLUSTER_SIZE(sb) - ret);
+	ret = 0;
+	goto free;
+
+corrupted:
+	pr_err("corrupted cluster %u of inode %lu\n", c, inode->i_ino);
+free:
+	kfree(cdata);
+
+	return ret;
+}
+
+/*
+ * Cluster holding byte pos of a file. Clusters are at least as large as pages
+ * (see fill_super), so that a page belongs to a single cluster.
+ */
+static inline uint32_t cluster_of(struct super_block *sb, loff_t pos)
+{
+	return pos >> (sb->s_blocksize_bits + OUICHEFS_CLUSTER_SHIFT);
+}
+
+/* Pages of a cluster */
+static inline int cluster_pages(struct super_block *sb)
+{
+	return OUICHEFS_CLUSTER_SIZE(sb) >> PAGE_SHIFT;
+}
+
+/*
+ * Offset of page in the buffer of its cluster
+ */
+static inline size_t cluster_offset(struct super_block *sb, struct page *page)
+{
+	return page_offset(page) & (OUICHEFS_CLUSTER_SIZE(sb) - 1);
+}
+
+/*
+ * Read the locked page from its cluster, or zero it if it is past the end of
+ * file, and mark it uptodate.
+ */
+static int read_page(struct inode *inode, struct page *page)
+{
+	struct super_block *sb = inode->i_sb;
+	void *buf;
+	int ret;
+
+	if ((loff_t)page->index << PAGE_SHIFT >= i_size_read(inode)) {
+		zero_user_segment(page, 0, PAGE_SIZE);
+		SetPageUptodate(page);
+		return 0;
+	}
+
+	buf = kmalloc(OUICHEFS_CLUSTER_SIZE(sb), GFP_NOFS);
+	if (!buf)
+		return -ENOMEM;
+	ret = read_cluster(inode, cluster_of(sb, page_offset(page)), buf);
+	if (!ret) {
+		memcpy_to_page(page, 0, buf + cluster_offset(sb, page),
+			       PAGE_SIZE);
+		SetPageUptodate(page);
+	}
+	kfree(buf);
+
+	return ret;
+}
+
+int ouichefs_compress_read_folio(struct folio *folio)
+{
+	int ret = read_page(folio->mapping->host, &folio->page);
+
+	folio_unlock(folio);
+
+	return ret;
+}
+
+/*
+ * Each cluster is decompressed once for all its pages in the readahead
+ * window. Pages left over on error are read again by read_folio.
+ */
+void ouichefs_compress_readahead(struct readahead_control *rac)
+{
+	struct inode *inode = rac->mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct folio *folio;
+	uint32_t c, cur = U32_MAX;
+	void *buf;
+	int ret = 0;
+
+	buf = kmalloc(OUICHEFS_CLUSTER_SIZE(sb), GFP_NOFS);
+	if (!buf)
+		return;
+
+	while ((folio = readahead_folio(rac))) {
+		c = cluster_of(sb, folio_pos(folio));
+		if (c != cur) {
+			ret = read_cluster(inode, c, buf);
+			cur = c;
+		}
+		if (!ret) {
+			memcpy_to_page(&folio->page, 0,
+				       buf + cluster_offset(sb, &folio->page),
+				       PAGE_SIZE);
+			folio_mark_uptodate(folio);
+		}
+		folio_unlock(folio);
+	}
+
+	kfree(buf);
+}
+
+/*
+ * Reserve blocks for the writeback of cluster c of inode, unless it already
+ * holds a reservation. Called with a page of the cluster locked, before it
+ * is dirtied.
+ */
+static int reserve_cluster(struct inode *inode, uint32_t c)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	int ret = 0;
+
+	spin_lock(&sbi->bitmap_lock);
+	if (!test_bit(c, ci->rmap)) {
+		if (sbi->free_blocks_count <
+		    sbi->reserved_blocks + OUICHEFS_CLUSTER_BLOCKS) {
+			ret = -ENOSPC;
+		} else {
+			sbi->reserved_blocks += OUICHEFS_CLUSTER_BLOCKS;
+			__set_bit(c, ci->rmap);
+		}
+	}
+	spin_unlock(&sbi->bitmap_lock);
+
+	return ret;
+}
+
+/*
+ * Hand the reservation of cluster c over to its writeback. Return whether
+ * the cluster held one.
+ */
+static bool take_reservation(struct inode *inode, uint32_t c)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	bool ret;
+
+	spin_lock(&sbi->bitmap_lock);
+	ret = __test_and_clear_bit(c, OUICHEFS_INODE(inode)->rmap);
+	spin_unlock(&sbi->bitmap_lock);
+
+	return ret;
+}
+
+/*
+ * Drop the reservation taken by the writeback of cluster c, or give it back
+ * to the cluster if keep is true and it has not reserved again meanwhile.
+ */
+static void put_reservation(struct inode *inode, uint32_t c, bool taken,
+			    bool keep)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+
+	if (!taken)
+		return;
+	spin_lock(&sbi->bitmap_lock);
+	if (!keep || __test_and_set_bit(c, OUICHEFS_INODE(inode)->rmap))
+		sbi->reserved_blocks -= OUICHEFS_CLUSTER_BLOCKS;
+	spin_unlock(&sbi->bitmap_lock);
+}
+
+/*
+ * Drop the reservations of the clusters of inode past size bytes, whose
+ * pages were just truncated.
+ */
+void ouichefs_compress_unreserve(struct inode *inode, loff_t size)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	unsigned long c = DIV_ROUND_UP(size, OUICHEFS_CLUSTER_SIZE(inode->i_sb));
+
+	if (!ci->rmap)
+		return;
+	spin_lock(&sbi->bitmap_lock);
+	for_each_set_bit_from(c, ci->rmap, OUICHEFS_NR_CLUSTERS(inode->i_sb)) {
+		__clear_bit(c, ci->rmap);
+		sbi->reserved_blocks -= OUICHEFS_CLUSTER_BLOCKS;
+	}
+	spin_unlock(&sbi->bitmap_lock);
+}
+
+/*
+ * Lock the page written to. It is only read if the write does not cover it.
+ */
+int ouichefs_compress_write_begin(struct address_space *mapping, loff_t pos,
+				  unsigned int len, struct page **pagep)
+{
+	struct page *page;
+	int ret;
+
+	page = grab_cache_page_write_begin(mapping, pos >> PAGE_SHIFT);
+	if (!page)
+		return -ENOMEM;
+
+	ret = reserve_cluster(mapping->host,
+			      cluster_of(mapping->host->i_sb, pos));
+	if (!ret && !PageUptodate(page) && len < PAGE_SIZE)
+		ret = read_page(mapping->host, page);
+	if (ret) {
+		unlock_page(page);
+		put_page(page);
+		return ret;
+	}
+	*pagep = page;
+
+	return 0;
+}
+
+/*
+ * Dirty the page of a shared writable mapping about to be written to, once
+ * its cluster holds a reservation.
+ */
+vm_fault_t ouichefs_compress_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	struct folio *folio = page_folio(vmf->page);
+	vm_fault_t ret = VM_FAULT_LOCKED;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+	folio_lock(folio);
+	if (folio->mapping != inode->i_mapping) {
+		folio_unlock(folio);
+		ret = VM_FAULT_NOPAGE;
+		goto out;
+	}
+	if (reserve_cluster(inode, cluster_of(inode->i_sb, folio_pos(folio)))) {
+		folio_unlock(folio);
+		ret = VM_FAULT_SIGBUS;
+		goto out;
+	}
+	folio_mark_dirty(folio);
+	folio_wait_stable(folio);
+out:
+	sb_end_pagefault(inode->i_sb);
+
+	return ret;
+}
+
+/*
+ * Dirty the page written to: blocks are allocated when it is written back.
+ */
+int ouichefs_compress_write_end(struct inode *inode, loff_t pos,
+				unsigned int len, unsigned int copied,
+				struct page *page)
+{
+	bool extended = false;
+
+	if (!PageUptodate(page)) {
+		/* write_begin did not read the page, the copy must cover it */
+		if (copied < len) {
+			copied = 0;
+			goto unlock;
+		}
+		SetPageUptodate(page);
+	}
+	set_page_dirty(page);
+
+	if (pos + copied > inode->i_size) {
+		i_size_write(inode, pos + copied);
+		inode->i_blocks = (inode->i_size >> inode->i_blkbits) + 2;
+		extended = true;
+	}
+unlock:
+	unlock_page(page);
+	put_page(page);
+
+	/* Not under the page lock, since this starts a handle */
+	if (extended)
+		mark_inode_dirty(inode);
+
+	return copied;
+}
+
+/*
+ * Write the n blocks of data to the new blocks listed in blocks, and wait for
+ * them.
+ */
+static int write_cluster_blocks(struct super_block *sb, uint64_t *blocks,
+				const void *data, int n)
+{
+	struct buffer_head *bhs[OUICHEFS_CLUSTER_BLOCKS];
+	int i, nr, ret = 0;
+
+	for (nr = 0; nr < n; nr++) {
+		bhs[nr] = ouichefs_getblk(sb, blocks[nr]);
+		if (!bhs[nr]) {
+			ret = -ENOMEM;
+			break;
+		}
+		lock_buffer(bhs[nr]);
+		memcpy(bhs[nr]->b_data, data + nr * sb->s_blocksize,
+		       sb->s_blocksize);
+		set_buffer_uptodate(bhs[nr]);
+		unlock_buffer(bhs[nr]);
+		mark_buffer_dirty(bhs[nr]);
+		write_dirty_buffer(bhs[nr], 0);
+	}
+
+	for (i = 0; i < nr; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!ret && !buffer_uptodate(bhs[i]))
+			ret = -EIO;
+		brelse(bhs[i]);
+	}
+
+	return ret;
+}
+
+/*
+ * Point the slot of cluster c in the index block of inode to the n blocks
+ * in blocks, and store the blocks it pointed to in old. Return the number
+ * of blocks stored in old, or a negative error code.
+ */
+static int set_cluster(handle_t *handle, struct inode *inode, uint32_t c,
+		       uint64_t *blocks, int n, bool compressed, uint64_t *old)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index;
+	uint32_t slot = c << OUICHEFS_CLUSTER_SHIFT;
+	uint64_t bno;
+	bool was_compressed;
+	int i, nr_old = 0, ret;
+
+	mutex_lock(&ci->map_lock);
+	bh_index = ouichefs_bread(sb, ci->index_block);
+	if (!bh_index) {
+		ret = -EIO;
+		goto unlock;
+	}
+	ret = ouichefs_journal_get_write_access(handle, bh_index);
+	if (ret)
+		goto brelse;
+
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	for (i = 0; i < OUICHEFS_CLUSTER_BLOCKS; i++) {
+		bno = ouichefs_index_get(sb, index, slot + i);
+		if (bno)
+			old[nr_old++] = bno;
+		ouichefs_index_set(sb, index, slot + i, i < n ? blocks[i] : 0);
+	}
+	/* Raw files of zoned partitions have no bitmap */
+	was_compressed = compressed;
+	if (ouichefs_is_compressed(inode)) {
+		was_compressed = test_bit(c, ci->cmap);
+		__assign_bit(c, ci->cmap, compressed);
+	}
+	ret = ouichefs_journal_dirty(handle, bh_index);
+brelse:
+	brelse(bh_index);
+unlock:
+	mutex_unlock(&ci->map_lock);
+
+	if (ret)
+		return ret;
+	/* The bitmap is part of the inode record */
+	if (compressed != was_compressed)
+		mark_inode_dirty(inode);
+
+	return nr_old;
+}
+
+static void unlock_cluster(struct page **pages)
+{
+	int i;
+
+	for (i = 0; i < OUICHEFS_CLUSTER_BLOCKS; i++) {
+		if (pages[i]) {
+			unlock_page(pages[i]);
+			put_page(pages[i]);
+		}
+	}
+}
+
+/*
+ * Lock the pages of cluster c of inode in pages, in index order as writers
+ * may lock several: all those below the end of file, and those past it that
+ * a writer may be extending the file to. The size is stable once they are
+ * locked: return the number of bytes of the cluster below the end of file.
+ */
+static loff_t lock_cluster(struct inode *inode, uint32_t c,
+			   struct page **pages)
+{
+	struct address_space *mapping = inode->i_mapping;
+	loff_t start = (loff_t)c * OUICHEFS_CLUSTER_SIZE(inode->i_sb), size;
+	pgoff_t first = start >> PAGE_SHIFT;
+	int i, nr_pages;
+
+again:
+	memset(pages, 0, OUICHEFS_CLUSTER_BLOCKS * sizeof(*pages));
+	size = clamp_t(loff_t, i_size_read(inode) - start, 0,
+		       OUICHEFS_CLUSTER_SIZE(inode->i_sb));
+	nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+	for (i = 0; i < cluster_pages(inode->i_sb); i++) {
+		if (i >= nr_pages) {
+			pages[i] = find_lock_page(mapping, first + i);
+			continue;
+		}
+		pages[i] = find_or_create_page(
+			mapping, first + i,
+			mapping_gfp_constraint(mapping, GFP_NOFS));
+		if (!pages[i]) {
+			unlock_cluster(pages);
+			return -ENOMEM;
+		}
+	}
+
+	/* A page the file grew to was created meanwhile: start over */
+	size = clamp_t(loff_t, i_size_read(inode) - start, 0,
+		       OUICHEFS_CLUSTER_SIZE(inode->i_sb));
+	for (i = nr_pages; i < DIV_ROUND_UP(size, PAGE_SIZE); i++) {
+		if (!pages[i]) {
+			unlock_cluster(pages);
+			goto again;
+		}
+	}
+
+	return size;
+}
+
+/*
+ * Write cluster c of inode back, in a handle of its own: lock its pages,
+ * reading those below the end of file that are not uptodate, compress their
+ * content and write it to new blocks.
+ */
+static int write_cluster(struct inode *inode, uint32_t c,
+			 struct cluster_buf *cb, struct writeback_control *wbc)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	bool zoned = ouichefs_is_zoned(sbi);
+	/* A page holds at least a block */
+	struct page *pages[OUICHEFS_CLUSTER_BLOCKS];
+	bool dirty[OUICHEFS_CLUSTER_BLOCKS] = {};
+	uint64_t blocks[OUICHEFS_CLUSTER_BLOCKS], old[OUICHEFS_CLUSTER_BLOCKS];
+	loff_t size;
+	bool uptodate = true, compressed, reserved, lost = false;
+	handle_t *handle;
+	const void *data;
+	int i, n, nr_pages, nr_blocks, len = 0, ret = 0;
+
+	handle = ouichefs_journal_start(sb, OUICHEFS_CLUSTER_CREDITS, 0);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	/* Before the pages are looked up, see the comment at the top */
+	reserved = take_reservation(inode, c);
+	size = lock_cluster(inode, c, pages);
+	if (size < 0) {
+		ret = size;
+		goto stop;
+	}
+	nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+	if (!nr_pages)
+		goto unlock;
+	for (i = 0; i < nr_pages; i++) {
+		if (!PageUptodate(pages[i]))
+			uptodate = false;
+	}
+
+	if (!uptodate) {
+		ret = read_cluster(inode, c, cb->data);
+		if (ret)
+			goto unlock;
+		for (i = 0; i < nr_pages; i++) {
+			if (PageUptodate(pages[i]))
+				continue;
+			memcpy_to_page(pages[i], 0,
+				       cb->data + (i << PAGE_SHIFT), PAGE_SIZE);
+			SetPageUptodate(pages[i]);
+		}
+	}
+
+	/* The data past the end of file is zeroed on disk */
+	for (i = 0; i < nr_pages; i++)
+		memcpy_from_page(cb->data + (i << PAGE_SHIFT), pages[i], 0,
+				 PAGE_SIZE);
+	memset(cb->data + size, 0, OUICHEFS_CLUSTER_SIZE(sb) - size);
+
+	for (i = 0; i < nr_pages; i++) {
+		dirty[i] = clear_page_dirty_for_io(pages[i]);
+		if (dirty[i]) {
+			set_page_writeback(pages[i]);
+			wbc->nr_to_write--;
+		}
+	}
+
+	/* Keep the cluster raw unless compression saves a block */
+	nr_blocks = DIV_ROUND_UP(size, sb->s_blocksize);
+	if (nr_blocks > 1 && ouichefs_is_compressed(inode))
+		len = LZ4_compress_default(cb->data,
+					   cb->cdata + CLUSTER_HEADER, size,
+					   (nr_blocks - 1) * sb->s_blocksize -
+						   CLUSTER_HEADER,
+					   cb->wrkmem);
+	compressed = len > 0;
+	if (compressed) {
+		*(__le32 *)cb->cdata = cpu_to_le32(len);
+		n = DIV_ROUND_UP(CLUSTER_HEADER + len, sb->s_blocksize);
+		memset(cb->cdata + CLUSTER_HEADER + len, 0,
+		       n * sb->s_blocksize - CLUSTER_HEADER - len);
+		data = cb->cdata;
+	} else {
+		n = nr_blocks;
+		data = cb->data;
+	}
+
+	/* Zoned devices must receive the writes in allocation order */
+	if (zoned)
+		mutex_lock(&sbi->zone_lock);
+	ret = ouichefs_alloc_blocks(handle, inode, blocks, n);
+	if (!ret) {
+		ret = write_cluster_blocks(sb, blocks, data, n);
+		if (ret) {
+			if (zoned)
+				ouichefs_zone_close(sb);
+			ouichefs_release_blocks(handle, sb, blocks, n);
+		}
+	}
+	if (zoned)
+		mutex_unlock(&sbi->zone_lock);
+	if (ret)
+		goto end_writeback;
+	/* With a metadata device, the commit must flush these blocks */
+	ret = ouichefs_journal_data(handle, inode,
+				    (loff_t)c * OUICHEFS_CLUSTER_SIZE(sb),
+				    OUICHEFS_CLUSTER_SIZE(sb));
+	if (ret) {
+		ouichefs_release_blocks(handle, sb, blocks, n);
+		goto end_writeback;
+	}
+	ret = set_cluster(handle, inode, c, blocks, n, compressed, old);
+	if (ret < 0) {
+		ouichefs_release_blocks(handle, sb, blocks, n);
+		goto end_writeback;
+	}
+	if (ret)
+		ouichefs_release_blocks(handle, sb, old, ret);
+	ouichefs_journal_update_tid(handle, inode, true);
+	ret = 0;
+
+end_writeback:
+	/*
+	 * Out of space, keep the data dirty for a later writeback: on a zoned
+	 * device, open_zone() woke the collector up to make room. Other
+	 * errors lose it.
+	 */
+	if (ret && ret != -ENOSPC) {
+		mapping_set_error(mapping, ret);
+		lost = true;
+	}
+	for (i = 0; i < nr_pages; i++) {
+		if (!dirty[i])
+			continue;
+		if (ret && !lost)
+			folio_redirty_for_writepage(wbc, page_folio(pages[i]));
+		end_page_writeback(pages[i]);
+	}
+unlock:
+	unlock_cluster(pages);
+stop:
+	/* Pages left dirty on error are written again later */
+	put_reservation(inode, c, reserved, ret && !lost);
+	ret = ouichefs_journal_stop(handle) ?: ret;
+
+	return ret;
+}
+
+/*
+ * Write back the clusters of the file of mapping holding dirty pages in the
+ * range of wbc.
+ */
+int ouichefs_compress_writepages(struct address_space *mapping,
+				 struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct super_block *sb = inode->i_sb;
+	journal_t *journal = OUICHEFS_SB(sb)->journal;
+	struct folio_batch fbatch;
+	struct cluster_buf cb;
+	pgoff_t index = 0, end = ULONG_MAX;
+	uint32_t c, cur = U32_MAX;
+	int i, nr, ret = 0;
+
+	/*
+	 * Each cluster needs a handle: leave the pages to the flusher if a
+	 * commit flushes them, or if a handle is already held.
+	 */
+	if (journal && (current == journal->j_task ||
+			ouichefs_journal_current(sb)))
+		return 0;
+
+	if (!wbc->range_cyclic) {
+		index = wbc->range_start >> PAGE_SHIFT;
+		end = wbc->range_end >> PAGE_SHIFT;
+	}
+
+	ret = cluster_buf_alloc(sb, &cb, ouichefs_is_compressed(inode));
+	if (ret)
+		goto free;
+
+	folio_batch_init(&fbatch);
+	while (!ret && index <= end) {
+		nr = filemap_get_folios_tag(mapping, &index, end,
+					    PAGECACHE_TAG_DIRTY, &fbatch);
+		if (!nr)
+			break;
+		for (i = 0; i < nr && !ret; i++) {
+			c = cluster_of(sb, folio_pos(fbatch.folios[i]));
+			if (c == cur)
+				continue;
+			cur = c;
+			ret = write_cluster(inode, c, &cb, wbc);
+		}
+		folio_batch_release(&fbatch);
+		cond_resched();
+
+		if (wbc->nr_to_write <= 0 && wbc->sync_mode == WB_SYNC_NONE)
+			break;
+	}
+
+free:
+	cluster_buf_free(&cb);
+
+	return ret;
+}
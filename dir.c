@@ -36,7 +36,7 @@ static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
 	 * Check that ctx->pos is not bigger than what we can handle (including
 	 * . and ..)
 	 */
-	if (ctx->pos > OUICHEFS_MAX_SUBFILES + 2)
+	if (ctx->pos > OUICHEFS_MAX_SUBFILES(sb) + 2)
 		return 0;
 
 	/* Commit . and .. to ctx */
@@ -44,13 +44,13 @@ static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
 		return 0;
 
 	/* Read the directory index block on disk */
-	bh = sb_bread(sb, ci->index_block);
+	bh = ouichefs_bread(sb, ci->index_block);
 	if (!bh)
 		return -EIO;
 	dblock = (struct ouichefs_dir_block *)bh->b_data;
 
 	/* Iterate over the index block and commit subfiles */
-	for (i = ctx->pos - 2; i < OUICHEFS_MAX_SUBFILES; i++) {
+	for (i = ctx->pos - 2; i < OUICHEFS_MAX_SUBFILES(sb); i++) {
 		f = &dblock->files[i];
 		if (!f->inode)
 			break;
@@ -68,4 +68,7 @@ static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
 const struct file_operations ouichefs_dir_ops = {
 	.owner = THIS_MODULE,
 	.iterate_shared = ouichefs_iterate,
+	.fsync = ouichefs_fsync,
+	.unlocked_ioctl = ouichefs_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
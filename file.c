@@ -12,10 +12,274 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/mpage.h>
+#include <linux/blkdev.h>
+#include <linux/sort.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/writeback.h>
+#include <linux/uio.h>
 
 #include "ouichefs.h"
 #include "bitmap.h"
 
+static int cmp_block(const void *a, const void *b)
+{
+	uint64_t ba = *(const uint64_t *)a, bb = *(const uint64_t *)b;
+
+	if (ba < bb)
+		return -1;
+	return ba > bb;
+}
+
+static int cmp_block32(const void *a, const void *b)
+{
+	uint32_t ba = *(const uint32_t *)a, bb = *(const uint32_t *)b;
+
+	if (ba < bb)
+		return -1;
+	return ba > bb;
+}
+
+/*
+ * Discard, or zero if zero is set, len blocks starting at block first. The
+ * range is split between the metadata and the main device if needed, and
+ * the part on a device that does not support discard is skipped.
+ */
+int ouichefs_issue_discard(struct super_block *sb, uint64_t first,
+			   uint64_t len, bool zero)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	unsigned int shift = sb->s_blocksize_bits - SECTOR_SHIFT;
+	uint32_t meta_end = ouichefs_meta_end(sbi);
+	uint64_t n;
+	struct block_device *bdev;
+	int ret = 0;
+
+	while (len && !ret) {
+		n = len;
+		if (sbi->meta_bdev && first < meta_end)
+			n = min_t(uint64_t, len, meta_end - first);
+		bdev = ouichefs_block_bdev(sb, first);
+		if (zero)
+			ret = blkdev_issue_zeroout(bdev, (sector_t)first << shift,
+						   (sector_t)n << shift,
+						   GFP_NOFS, 0);
+		else if (bdev_max_discard_sectors(bdev))
+			ret = blkdev_issue_discard(bdev,
+						   (sector_t)first << shift,
+						   (sector_t)n << shift,
+						   GFP_NOFS);
+		first += n;
+		len -= n;
+	}
+
+	return ret;
+}
+
+/*
+ * Discard or zero len blocks starting at block first, depending on the mount
+ * options. Called on blocks that are no longer referenced, before they are
+ * returned to the free bitmap.
+ */
+void ouichefs_discard_blocks(struct super_block *sb, uint64_t first,
+			     uint32_t len)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	int ret = 0;
+
+	if (sbi->mount_opts & OUICHEFS_MOUNT_SCRUB)
+		ret = ouichefs_issue_discard(sb, first, len, true);
+	else if (sbi->mount_opts & OUICHEFS_MOUNT_DISCARD)
+		ret = ouichefs_issue_discard(sb, first, len, false);
+	if (ret)
+		pr_warn("failed to release blocks %llu-%llu (%d)\n", first,
+			first + len - 1, ret);
+}
+
+/*
+ * Free len blocks starting at block first. Without a journal, they are
+ * discarded and returned to the free bitmap right away. Otherwise, the
+ * release is journaled in handle, and the blocks are only discarded and
+ * reused once it has committed.
+ */
+static void free_block_range(handle_t *handle, struct super_block *sb,
+			     uint64_t first, uint32_t len)
+{
+	int ret;
+
+	if (!handle) {
+		ouichefs_discard_blocks(sb, first, len);
+		put_block_range(OUICHEFS_SB(sb), first, len);
+		return;
+	}
+
+	ret = ouichefs_journal_bfree(handle, sb, first, len, true);
+	if (ret)
+		pr_err("failed to release blocks %llu-%llu (%d)\n", first,
+		       first + len - 1, ret);
+	else
+		ouichefs_journal_defer_free(handle, sb, first, len);
+}
+
+/*
+ * Drop a reference to each of the len blocks starting at block first, and
+ * free those that are no longer referenced. A block whose reference count
+ * cannot be read is kept, i.e. lost.
+ */
+void ouichefs_release_block_range(handle_t *handle, struct super_block *sb,
+				  uint64_t first, uint32_t len)
+{
+	uint64_t bno, start = first;
+	int ret;
+
+	if (!ouichefs_has_reflink(OUICHEFS_SB(sb))) {
+		free_block_range(handle, sb, first, len);
+		return;
+	}
+
+	for (bno = first; bno < first + len; bno++) {
+		ret = ouichefs_refcount_put(handle, sb, bno);
+		if (!ret)
+			continue;
+		if (ret < 0)
+			pr_err("failed to release block %llu (%d)\n", bno, ret);
+
+		/* bno is still referenced: free the run before it */
+		if (bno > start)
+			free_block_range(handle, sb, start, bno - start);
+		start = bno + 1;
+	}
+	if (start < first + len)
+		free_block_range(handle, sb, start, first + len - start);
+}
+
+/*
+ * Release nr blocks, one contiguous run at a time. blocks is sorted in place
+ * and must not contain 0.
+ */
+void ouichefs_release_blocks(handle_t *handle, struct super_block *sb,
+			     uint64_t *blocks, int nr)
+{
+	int i, start = 0;
+
+	sort(blocks, nr, sizeof(*blocks), cmp_block, NULL);
+
+	for (i = 1; i <= nr; i++) {
+		if (i < nr && blocks[i] == blocks[i - 1] + 1)
+			continue;
+
+		/* blocks[start..i-1] is a contiguous run */
+		ouichefs_release_block_range(handle, sb, blocks[start],
+					     i - start);
+		start = i;
+	}
+}
+
+/*
+ * Release the blocks mapped by the count entries of index starting at entry
+ * from, one contiguous run at a time. These entries are compacted and sorted
+ * in place: the caller clears them afterwards.
+ */
+void ouichefs_release_index(handle_t *handle, struct super_block *sb,
+			    struct ouichefs_file_index_block *index,
+			    uint32_t from, uint32_t count)
+{
+	bool wide = ouichefs_has_64bit(OUICHEFS_SB(sb));
+	uint64_t bno, first = 0;
+	uint32_t i, nr, len = 0;
+
+	for (i = 0, nr = 0; i < count; i++) {
+		bno = ouichefs_index_get(sb, index, from + i);
+		if (bno)
+			ouichefs_index_set(sb, index, from + nr++, bno);
+	}
+	if (wide)
+		sort(index->blocks64 + from, nr, sizeof(uint64_t), cmp_block,
+		     NULL);
+	else
+		sort(index->blocks + from, nr, sizeof(uint32_t), cmp_block32,
+		     NULL);
+
+	for (i = 0; i < nr; i++) {
+		bno = ouichefs_index_get(sb, index, from + i);
+		if (len && bno == first + len) {
+			len++;
+			continue;
+		}
+		if (len)
+			ouichefs_release_block_range(handle, sb, first, len);
+		first = bno;
+		len = 1;
+	}
+	if (len)
+		ouichefs_release_block_range(handle, sb, first, len);
+}
+
+/*
+ * Release the blocks mapped by the last OUICHEFS_RELEASE_BATCH used entries of
+ * index from entry from onward, and clear these entries. Releasing the last
+ * ones first never leaves a hole below mapped blocks. Return true if some
+ * entries are left for another handle.
+ */
+bool ouichefs_release_index_batch(handle_t *handle, struct super_block *sb,
+				  struct ouichefs_file_index_block *index,
+				  uint32_t from)
+{
+	uint32_t i, start, end = OUICHEFS_INDEX_ENTRIES(sb), nr = 0;
+
+	for (start = end; start > from && nr < OUICHEFS_RELEASE_BATCH;
+	     start--) {
+		if (ouichefs_index_get(sb, index, start - 1))
+			nr++;
+	}
+	if (nr)
+		ouichefs_release_index(handle, sb, index, start, end - start);
+	for (i = start; i < end; i++)
+		ouichefs_index_set(sb, index, i, 0);
+
+	return start > from;
+}
+
+/*
+ * Allocate n data blocks for inode in handle, contiguous if possible, and
+ * store them in blocks. On failure, none of them is left allocated.
+ */
+int ouichefs_alloc_blocks(handle_t *handle, struct inode *inode,
+			  uint64_t *blocks, int n)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	int i, ret;
+
+	if (ouichefs_is_zoned(sbi))
+		return ouichefs_zone_alloc(handle, sb, blocks, n);
+
+	for (i = 0; i < n; i++) {
+		blocks[i] = 0;
+		if (i && get_block_at(sbi, blocks[i - 1] + 1))
+			blocks[i] = blocks[i - 1] + 1;
+		if (!blocks[i])
+			blocks[i] = get_free_data_block(sbi,
+							inode->i_write_hint);
+		if (!blocks[i]) {
+			ret = -ENOSPC;
+			goto release;
+		}
+		ret = ouichefs_journal_bfree(handle, sb, blocks[i], 1, false);
+		if (ret) {
+			put_block(sbi, blocks[i]);
+			goto release;
+		}
+	}
+
+	return 0;
+
+release:
+	if (i)
+		ouichefs_release_blocks(handle, sb, blocks, i);
+	return ret;
+}
+
 /*
  * Map the buffer_head passed in argument with the iblock-th block of the file
  * represented by inode. If the requested block is not allocated and create is
@@ -28,43 +292,465 @@ static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index;
-	int ret = 0, bno;
+	struct buffer_head *bh_index = NULL;
+	handle_t *handle;
+	uint64_t bno;
+	bool extend;
+	int ret = 0;
 
 	/* If block number exceeds filesize, fail */
-	if (iblock >= OUICHEFS_BLOCK_SIZE >> 2)
+	if (iblock >= OUICHEFS_INDEX_ENTRIES(sb))
 		return -EFBIG;
+	/*
+	 * The index block of an inline file holds data, not block numbers,
+	 * and blocks of clustered files are only allocated by writeback.
+	 */
+	if ((ci->flags & OUICHEFS_INODE_INLINE) || ouichefs_is_clustered(inode))
+		return -EIO;
+
+	mutex_lock(&ci->map_lock);
+
+	/* Blocks of the extent are mapped without reading the index block */
+	if (iblock < ci->ext_len) {
+		bno = ci->ext_start + iblock;
+		goto map;
+	}
 
 	/* Read index block from disk */
-	bh_index = sb_bread(sb, ci->index_block);
-	if (!bh_index)
-		return -EIO;
+	bh_index = ouichefs_bread(sb, ci->index_block);
+	if (!bh_index) {
+		ret = -EIO;
+		goto unlock;
+	}
 	index = (struct ouichefs_file_index_block *)bh_index->b_data;
 
 	/*
 	 * Check if iblock is already allocated. If not and create is true,
 	 * allocate it. Else, get the physical block number.
 	 */
-	if (index->blocks[iblock] == 0) {
+	bno = ouichefs_index_get(sb, index, iblock);
+	if (bno == 0) {
 		if (!create) {
 			ret = 0;
 			goto brelse_index;
 		}
-		bno = get_free_block(sbi);
+
+		/* Joins the handle of write_begin */
+		handle = ouichefs_journal_start(sb,
+						OUICHEFS_ALLOC_CREDITS(sb), 0);
+		if (IS_ERR(handle)) {
+			ret = PTR_ERR(handle);
+			goto brelse_index;
+		}
+
+		/*
+		 * Grow the extent if the block following it is free, so that
+		 * files written sequentially need no index lookup.
+		 */
+		bno = 0;
+		if (iblock == ci->ext_len) {
+			if (!ci->ext_len)
+				bno = get_free_data_block(sbi,
+							  inode->i_write_hint);
+			else if (get_block_at(sbi, ci->ext_start + ci->ext_len))
+				bno = ci->ext_start + ci->ext_len;
+		}
+		extend = bno != 0;
+		if (!extend) {
+			ret = ouichefs_journal_get_write_access(handle,
+								bh_index);
+			if (ret)
+				goto stop;
+			bno = get_free_data_block(sbi, inode->i_write_hint);
+		}
 		if (!bno) {
 			ret = -ENOSPC;
-			goto brelse_index;
+			goto stop;
 		}
-		index->blocks[iblock] = bno;
-	} else {
-		bno = index->blocks[iblock];
+		ret = ouichefs_journal_bfree(handle, sb, bno, 1, false);
+		if (!ret)
+			ret = ouichefs_journal_data(
+				handle, inode,
+				(loff_t)iblock << sb->s_blocksize_bits,
+				sb->s_blocksize);
+		if (ret) {
+			put_block(sbi, bno);
+			goto stop;
+		}
+		if (extend) {
+			if (!ci->ext_len)
+				ci->ext_start = bno;
+			ci->ext_len++;
+			mark_inode_dirty(inode);
+		} else {
+			ouichefs_index_set(sb, index, iblock, bno);
+			ret = ouichefs_journal_dirty(handle, bh_index);
+		}
+		ouichefs_journal_update_tid(handle, inode, true);
+		/*
+		 * Freed blocks are no longer scrubbed by default: let the
+		 * caller zero what it does not overwrite instead of reading
+		 * stale data.
+		 */
+		set_buffer_new(bh_result);
+stop:
+		ret = ouichefs_journal_stop(handle) ?: ret;
+		if (ret)
+			goto brelse_index;
 	}
 
+map:
 	/* Map the physical block to the given buffer_head */
 	map_bh(bh_result, sb, bno);
 
 brelse_index:
 	brelse(bh_index);
+unlock:
+	mutex_unlock(&ci->map_lock);
+
+	return ret;
+}
+
+/*
+ * Release the data blocks of inode from its from-th block onward, whether
+ * they belong to its extent or are mapped by its index block bh_index. A
+ * compressed file keeps the cluster holding block from - 1.
+ * Called with a handle allowed to modify bh_index, which only covers a batch
+ * of index entries: return true if the caller must call again with a new one.
+ */
+static bool release_file_blocks(handle_t *handle, struct inode *inode,
+				struct buffer_head *bh_index, uint32_t from)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	bool more;
+
+	mutex_lock(&ci->map_lock);
+
+	if (ci->flags & OUICHEFS_INODE_COMPRESS) {
+		from = round_up(from, OUICHEFS_CLUSTER_BLOCKS);
+		bitmap_clear(ci->cmap, from >> OUICHEFS_CLUSTER_SHIFT,
+			     OUICHEFS_MAX_CLUSTERS -
+				     (from >> OUICHEFS_CLUSTER_SHIFT));
+		mark_inode_dirty(inode);
+	}
+	if (ci->ext_len > from) {
+		ouichefs_release_block_range(handle, sb, ci->ext_start + from,
+					     ci->ext_len - from);
+		ci->ext_len = from;
+		if (!from)
+			ci->ext_start = 0;
+		mark_inode_dirty(inode);
+	}
+
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	more = ouichefs_release_index_batch(handle, sb, index, from);
+	ouichefs_journal_dirty(handle, bh_index);
+
+	mutex_unlock(&ci->map_lock);
+
+	return more;
+}
+
+/*
+ * Store in *bno the block mapped at the iblock-th block of inode, or 0 if
+ * there is none.
+ */
+static int lookup_block(struct inode *inode, uint32_t iblock, uint64_t *bno)
+{
+	struct buffer_head tmp = {};
+	int ret;
+
+	ret = ouichefs_file_get_block(inode, iblock, &tmp, 0);
+	*bno = buffer_mapped(&tmp) ? tmp.b_blocknr : 0;
+
+	return ret;
+}
+
+/*
+ * Same as lookup_block(), without sleeping: -EAGAIN is returned if map_lock
+ * is taken or the index block is not cached.
+ */
+static int lookup_block_nowait(struct inode *inode, uint32_t iblock,
+			       uint64_t *bno)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh;
+	int ret = 0;
+
+	if (iblock >= OUICHEFS_INDEX_ENTRIES(inode->i_sb))
+		return -EFBIG;
+	if (!mutex_trylock(&ci->map_lock))
+		return -EAGAIN;
+
+	if (iblock < ci->ext_len) {
+		*bno = ci->ext_start + iblock;
+		goto unlock;
+	}
+	bh = ouichefs_find_get_block(inode->i_sb, ci->index_block);
+	if (!bh || !buffer_uptodate(bh)) {
+		ret = -EAGAIN;
+		goto brelse;
+	}
+	index = (struct ouichefs_file_index_block *)bh->b_data;
+	*bno = ouichefs_index_get(inode->i_sb, index, iblock);
+brelse:
+	brelse(bh);
+unlock:
+	mutex_unlock(&ci->map_lock);
+
+	return ret;
+}
+
+/*
+ * Map the nr blocks of inode from iblock to the blocks of bno (0 for a hole),
+ * and store the blocks they replace in old. If they belong to the extent, the
+ * extent is cut before iblock and its following blocks are moved to the index
+ * block. All the entries are switched under a single write access to the
+ * index block, so that they are published together or not at all.
+ * Called with a handle started and map_lock held.
+ */
+static int set_blocks(handle_t *handle, struct inode *inode, uint32_t iblock,
+		      const uint64_t *bno, int nr, uint64_t *old)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index;
+	uint32_t i;
+	int ret;
+
+	bh_index = ouichefs_bread(sb, ci->index_block);
+	if (!bh_index)
+		return -EIO;
+	ret = ouichefs_journal_get_write_access(handle, bh_index);
+	if (ret)
+		goto brelse;
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	if (iblock < ci->ext_len) {
+		for (i = iblock; i < ci->ext_len; i++)
+			ouichefs_index_set(sb, index, i, ci->ext_start + i);
+		ci->ext_len = iblock;
+		if (!iblock)
+			ci->ext_start = 0;
+		mark_inode_dirty(inode);
+	}
+	for (i = 0; i < nr; i++) {
+		old[i] = ouichefs_index_get(sb, index, iblock + i);
+		ouichefs_index_set(sb, index, iblock + i, bno[i]);
+	}
+	ret = ouichefs_journal_dirty(handle, bh_index);
+brelse:
+	brelse(bh_index);
+
+	return ret;
+}
+
+static int set_block(handle_t *handle, struct inode *inode, uint32_t iblock,
+		     uint64_t bno, uint64_t *old)
+{
+	return set_blocks(handle, inode, iblock, &bno, 1, old);
+}
+
+/*
+ * Give inode its own copy of its iblock-th block, backing buffer bh of a
+ * locked page, if it is shared with other files: the buffer read from the
+ * shared block is moved to a new block and dirtied, so that writeback copies
+ * it there.
+ */
+static int unshare_buffer(handle_t *handle, struct inode *inode,
+			  struct buffer_head *bh, uint32_t iblock)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint64_t bno, new, old;
+	int ret;
+
+	ret = lookup_block(inode, iblock, &bno);
+	if (ret || !bno)
+		return ret;
+	ret = ouichefs_block_shared(sb, bno, false);
+	if (ret <= 0)
+		return ret;
+
+	new = get_free_data_block(sbi, inode->i_write_hint);
+	if (!new)
+		return -ENOSPC;
+	ret = ouichefs_journal_bfree(handle, sb, new, 1, false);
+	if (!ret)
+		ret = ouichefs_journal_data(handle, inode,
+					    (loff_t)iblock << inode->i_blkbits,
+					    sb->s_blocksize);
+	if (!ret) {
+		mutex_lock(&ci->map_lock);
+		ret = set_block(handle, inode, iblock, new, &old);
+		mutex_unlock(&ci->map_lock);
+	}
+	if (ret) {
+		put_block(sbi, new);
+		return ret;
+	}
+	ouichefs_release_block_range(handle, sb, old, 1);
+	ouichefs_journal_update_tid(handle, inode, true);
+
+	map_bh(bh, sb, new);
+	set_buffer_uptodate(bh);
+	mark_buffer_dirty(bh);
+
+	return 0;
+}
+
+/*
+ * If some blocks of inode backing [pos, pos + len), within a single page, are
+ * shared with other files, give inode its own copy of them before the page is
+ * modified: the page is read from the shared blocks, then each of them is
+ * unshared by unshare_buffer(). A page may cover several blocks. Called with
+ * a handle started, before the page is locked by block_write_begin() or
+ * block_page_mkwrite().
+ */
+static int unshare_blocks(handle_t *handle, struct inode *inode, loff_t pos,
+			  unsigned int len)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned int bits = inode->i_blkbits;
+	uint32_t iblock, first = pos >> bits, last = (pos + len - 1) >> bits;
+	pgoff_t index = pos >> PAGE_SHIFT;
+	struct buffer_head *bh, *head;
+	struct page *page;
+	uint64_t bno;
+	int ret = 0;
+
+	if (!ouichefs_has_reflink(OUICHEFS_SB(sb)))
+		return 0;
+	/* Only read the page if one of these blocks is shared */
+	for (iblock = first; iblock <= last && !ret; iblock++) {
+		ret = lookup_block(inode, iblock, &bno);
+		if (!ret && bno)
+			ret = ouichefs_block_shared(sb, bno, false);
+	}
+	if (ret <= 0)
+		return ret;
+
+	page = read_mapping_page(inode->i_mapping, index, NULL);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	lock_page(page);
+	/* The page may have been truncated, or unshared by someone else */
+	ret = 0;
+	if (page->mapping != inode->i_mapping)
+		goto unlock;
+
+	if (!page_has_buffers(page))
+		create_empty_buffers(page, sb->s_blocksize, 0);
+	head = page_buffers(page);
+	bh = head;
+	iblock = (loff_t)index << (PAGE_SHIFT - bits);
+	do {
+		if (iblock >= first && iblock <= last)
+			ret = unshare_buffer(handle, inode, bh, iblock);
+		iblock++;
+		bh = bh->b_this_page;
+	} while (!ret && bh != head);
+unlock:
+	unlock_page(page);
+	put_page(page);
+
+	return ret;
+}
+
+/*
+ * Inline data
+ *
+ * Regular files no larger than OUICHEFS_INLINE_MAX bytes keep their data in
+ * their index block instead of a separate data block: they only cost one
+ * block, and one read once their inode is known. Inline data is metadata: it
+ * is written (and journaled) along with the index block, by write_end. The
+ * first write going beyond OUICHEFS_INLINE_MAX moves the data to a data block
+ * and turns the index block back into an index.
+ */
+static inline bool ouichefs_is_inline(struct inode *inode)
+{
+	return OUICHEFS_INODE(inode)->flags & OUICHEFS_INODE_INLINE;
+}
+
+/*
+ * Fill page with the inline data of inode and zero the rest of it.
+ */
+static int read_inline_page(struct inode *inode, struct page *page)
+{
+	struct buffer_head *bh;
+	size_t size = 0;
+
+	if (page->index == 0) {
+		bh = ouichefs_bread(inode->i_sb,
+				    OUICHEFS_INODE(inode)->index_block);
+		if (!bh)
+			return -EIO;
+		size = min_t(loff_t, i_size_read(inode), PAGE_SIZE);
+		memcpy_to_page(page, 0, bh->b_data, size);
+		brelse(bh);
+	}
+	zero_user_segment(page, size, PAGE_SIZE);
+	SetPageUptodate(page);
+
+	return 0;
+}
+
+/*
+ * Move the inline data of inode to a data block, through page 0 which is
+ * dirtied, and clear its index block. Called with a handle started.
+ */
+static int convert_inline(handle_t *handle, struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh;
+	struct page *page;
+	int ret;
+
+	page = grab_cache_page_write_begin(inode->i_mapping, 0);
+	if (!page)
+		return -ENOMEM;
+	/* The flag only changes under the lock of page 0 */
+	ret = 0;
+	if (!ouichefs_is_inline(inode))
+		goto unlock;
+	if (!PageUptodate(page)) {
+		ret = read_inline_page(inode, page);
+		if (ret)
+			goto unlock;
+	}
+
+	bh = ouichefs_bread(inode->i_sb, ci->index_block);
+	if (!bh) {
+		ret = -EIO;
+		goto unlock;
+	}
+	ret = ouichefs_journal_get_write_access(handle, bh);
+	if (ret)
+		goto brelse;
+	memset(bh->b_data, 0, bh->b_size);
+	ci->flags &= ~OUICHEFS_INODE_INLINE;
+
+	/* The data is written from page 0 to its new block by writeback */
+	if (inode->i_size)
+		ret = __block_write_begin(page, 0, inode->i_size,
+					  ouichefs_file_get_block);
+	if (ret) {
+		/* No block was allocated, put the data back */
+		memcpy_from_page(bh->b_data, page, 0, inode->i_size);
+		ci->flags |= OUICHEFS_INODE_INLINE;
+	}
+	ouichefs_journal_dirty(handle, bh);
+	mark_inode_dirty(inode);
+brelse:
+	brelse(bh);
+unlock:
+	unlock_page(page);
+	put_page(page);
 
 	return ret;
 }
@@ -73,9 +759,31 @@ brelse_index:
  * Called by the page cache to read a page from the physical disk and map it in
  * memory.
  */
+static int ouichefs_read_folio(struct file *file, struct folio *folio)
+{
+	struct inode *inode = folio->mapping->host;
+	int ret;
+
+	if (ouichefs_is_clustered(inode))
+		return ouichefs_compress_read_folio(folio);
+	if (!ouichefs_is_inline(inode))
+		return mpage_read_folio(folio, ouichefs_file_get_block);
+
+	ret = read_inline_page(inode, &folio->page);
+	folio_unlock(folio);
+
+	return ret;
+}
+
 static void ouichefs_readahead(struct readahead_control *rac)
 {
-	mpage_readahead(rac, ouichefs_file_get_block);
+	/* Inline pages are filled by read_folio */
+	if (ouichefs_is_inline(rac->mapping->host))
+		return;
+	if (ouichefs_is_clustered(rac->mapping->host))
+		ouichefs_compress_readahead(rac);
+	else
+		mpage_readahead(rac, ouichefs_file_get_block);
 }
 
 /*
@@ -84,9 +792,37 @@ static void ouichefs_readahead(struct readahead_control *rac)
  */
 static int ouichefs_writepage(struct page *page, struct writeback_control *wbc)
 {
+	/* Inline data was already copied to the index block by write_end */
+	if (ouichefs_is_inline(page->mapping->host)) {
+		unlock_page(page);
+		return 0;
+	}
+	/* Clustered pages are written a cluster at a time, by writepages */
+	if (ouichefs_is_clustered(page->mapping->host)) {
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return 0;
+	}
 	return block_write_full_page(page, ouichefs_file_get_block, wbc);
 }
 
+static int ouichefs_writepage_cb(struct folio *folio,
+				 struct writeback_control *wbc, void *data)
+{
+	int ret = ouichefs_writepage(&folio->page, wbc);
+
+	mapping_set_error(folio->mapping, ret);
+	return ret;
+}
+
+static int ouichefs_writepages(struct address_space *mapping,
+			       struct writeback_control *wbc)
+{
+	if (ouichefs_is_clustered(mapping->host))
+		return ouichefs_compress_writepages(mapping, wbc);
+	return write_cache_pages(mapping, wbc, ouichefs_writepage_cb, NULL);
+}
+
 /*
  * Called by the VFS when a write() syscall occurs on file before writing the
  * data in the page cache. This functions checks if the write will be able to
@@ -97,21 +833,72 @@ static int ouichefs_write_begin(struct file *file,
 				unsigned int len, struct page **pagep,
 				void **fsdata)
 {
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(file->f_inode->i_sb);
+	struct inode *inode = file->f_inode;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct page *page;
+	handle_t *handle;
 	int err;
 	uint32_t nr_allocs = 0;
 
 	/* Check if the write can be completed (enough space?) */
-	if (pos + len > OUICHEFS_MAX_FILESIZE)
+	if (pos + len > OUICHEFS_MAX_FILESIZE(inode->i_sb))
 		return -ENOSPC;
-	nr_allocs = max(pos + len, file->f_inode->i_size) / OUICHEFS_BLOCK_SIZE;
+	nr_allocs = max(pos + len, file->f_inode->i_size) >> inode->i_blkbits;
 	if (nr_allocs > file->f_inode->i_blocks - 1)
 		nr_allocs -= file->f_inode->i_blocks - 1;
 	else
 		nr_allocs = 0;
-	if (nr_allocs > sbi->nr_free_blocks)
+	if (nr_allocs > ouichefs_avail_blocks(sbi))
 		return -ENOSPC;
 
+	/* Blocks of clustered files are allocated by writeback */
+	if (ouichefs_is_clustered(inode))
+		return ouichefs_compress_write_begin(mapping, pos, len, pagep);
+
+	/*
+	 * Allocations are journaled in a handle started before the page is
+	 * locked, and stopped by write_end: a commit may have to lock this
+	 * page to write it out.
+	 */
+	handle = ouichefs_journal_start(inode->i_sb,
+					OUICHEFS_ALLOC_CREDITS(inode->i_sb), 0);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	if (ouichefs_is_inline(inode) &&
+	    pos + len <= OUICHEFS_INLINE_MAX(inode->i_sb)) {
+		/* Only page 0 is used, write_end copies it back */
+		page = grab_cache_page_write_begin(mapping, 0);
+		if (!page) {
+			err = -ENOMEM;
+			goto stop;
+		}
+		/* Unless page_mkwrite converted the file meanwhile */
+		if (!ouichefs_is_inline(inode)) {
+			unlock_page(page);
+			put_page(page);
+		} else {
+			err = 0;
+			if (!PageUptodate(page))
+				err = read_inline_page(inode, page);
+			if (err) {
+				unlock_page(page);
+				put_page(page);
+				goto stop;
+			}
+			*pagep = page;
+			return 0;
+		}
+	}
+	if (ouichefs_is_inline(inode)) {
+		err = convert_inline(handle, inode);
+		if (err)
+			goto stop;
+	}
+	err = unshare_blocks(handle, inode, pos, len);
+	if (err)
+		goto stop;
+
 	/* prepare the write */
 	err = block_write_begin(mapping, pos, len, pagep,
 				ouichefs_file_get_block);
@@ -119,8 +906,55 @@ static int ouichefs_write_begin(struct file *file,
 	if (err < 0) {
 		pr_err("%s:%d: newly allocated blocks reclaim not implemented yet\n",
 		       __func__, __LINE__);
+		goto stop;
 	}
 	return err;
+
+stop:
+	ouichefs_journal_stop(handle);
+	return err;
+}
+
+/*
+ * Copy the first bytes of page, up to the end of the file, to the index block
+ * of the inline file inode.
+ */
+static int write_inline_end(handle_t *handle, struct inode *inode, loff_t pos,
+			    unsigned int copied, struct page *page)
+{
+	struct buffer_head *bh;
+	loff_t size = max_t(loff_t, inode->i_size, pos + copied);
+	int ret;
+
+	if (!PageUptodate(page))
+		copied = 0;
+
+	bh = ouichefs_bread(inode->i_sb, OUICHEFS_INODE(inode)->index_block);
+	if (!bh) {
+		ret = -EIO;
+		goto unlock;
+	}
+	ret = ouichefs_journal_get_write_access(handle, bh);
+	if (!ret) {
+		memcpy_from_page(bh->b_data, page, 0, size);
+		ret = ouichefs_journal_dirty(handle, bh);
+	}
+	brelse(bh);
+	if (ret)
+		goto unlock;
+
+	if (pos + copied > inode->i_size) {
+		i_size_write(inode, pos + copied);
+		mark_inode_dirty(inode);
+	} else {
+		ouichefs_journal_update_tid(handle, inode, true);
+	}
+	ret = copied;
+unlock:
+	unlock_page(page);
+	put_page(page);
+
+	return ret;
 }
 
 /*
@@ -136,96 +970,798 @@ static int ouichefs_write_end(struct file *file, struct address_space *mapping,
 	struct inode *inode = file->f_inode;
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct super_block *sb = inode->i_sb;
+	handle_t *handle = ouichefs_journal_current(sb);
+	uint32_t nr_blocks_old = inode->i_blocks;
+	struct buffer_head *bh_index;
+	bool more;
+
+	if (ouichefs_is_clustered(inode))
+		return ouichefs_compress_write_end(inode, pos, len, copied,
+						   page);
+	if (ouichefs_is_inline(inode)) {
+		ret = write_inline_end(handle, inode, pos, copied, page);
+		ouichefs_journal_stop(handle);
+		return ret;
+	}
 
 	/* Complete the write() */
 	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
 	if (ret < len) {
 		pr_err("%s:%d: wrote less than asked... what do I do? nothing for now...\n",
 		       __func__, __LINE__);
-	} else {
-		uint32_t nr_blocks_old = inode->i_blocks;
-
-		/* Update inode metadata */
-		inode->i_blocks = inode->i_size / OUICHEFS_BLOCK_SIZE + 2;
-		inode->i_mtime = inode->i_ctime = current_time(inode);
+	} else if (inode->i_blocks != (inode->i_size >> inode->i_blkbits) + 2) {
+		/*
+		 * Update inode metadata. Timestamps were updated before the
+		 * write and the size by generic_write_end(): only dirty the
+		 * inode again if its block count changed, so that fdatasync
+		 * does not have to write it for a plain overwrite.
+		 */
+		inode->i_blocks = (inode->i_size >> inode->i_blkbits) + 2;
 		mark_inode_dirty(inode);
+	}
+	ouichefs_journal_stop(handle);
 
-		/* If file is smaller than before, free unused blocks */
-		if (nr_blocks_old > inode->i_blocks) {
-			int i;
-			struct buffer_head *bh_index;
-			struct ouichefs_file_index_block *index;
-
-			/* Free unused blocks from page cache */
-			truncate_pagecache(inode, inode->i_size);
-
-			/* Read index block to remove unused blocks */
-			bh_index = sb_bread(sb, ci->index_block);
-			if (!bh_index) {
-				pr_err("failed truncating '%s'. we just lost %llu blocks\n",
-				       file->f_path.dentry->d_name.name,
-				       nr_blocks_old - inode->i_blocks);
-				goto end;
-			}
-			index = (struct ouichefs_file_index_block *)
-					bh_index->b_data;
+	/* If file is smaller than before, free unused blocks */
+	if (ret >= len && nr_blocks_old > inode->i_blocks) {
+		/* Free unused blocks from page cache */
+		truncate_pagecache(inode, inode->i_size);
 
-			for (i = inode->i_blocks - 1; i < nr_blocks_old - 1;
-			     i++) {
-				put_block(OUICHEFS_SB(sb), index->blocks[i]);
-				index->blocks[i] = 0;
-			}
-			mark_buffer_dirty(bh_index);
-			brelse(bh_index);
-		}
+		/* Read index block to remove unused blocks */
+		bh_index = ouichefs_bread(sb, ci->index_block);
+		if (!bh_index)
+			goto lost;
+
+		/* One handle per batch of released blocks */
+		do {
+			handle = ouichefs_journal_start(
+				sb, OUICHEFS_RELEASE_CREDITS(OUICHEFS_SB(sb)),
+				0);
+			if (IS_ERR(handle))
+				goto brelse;
+			if (ouichefs_journal_get_write_access(handle,
+							      bh_index))
+				goto stop;
+			more = release_file_blocks(handle, inode, bh_index,
+						   inode->i_blocks - 1);
+			ouichefs_journal_update_tid(handle, inode, true);
+			ouichefs_journal_stop(handle);
+		} while (more);
+		brelse(bh_index);
 	}
-end:
+
+	return ret;
+
+stop:
+	ouichefs_journal_stop(handle);
+brelse:
+	brelse(bh_index);
+lost:
+	pr_err("failed truncating '%s'. we just lost %llu blocks\n",
+	       file->f_path.dentry->d_name.name,
+	       nr_blocks_old - inode->i_blocks);
 	return ret;
 }
 
 const struct address_space_operations ouichefs_aops = {
+	.dirty_folio = block_dirty_folio,
+	.invalidate_folio = block_invalidate_folio,
+	.read_folio = ouichefs_read_folio,
 	.readahead = ouichefs_readahead,
 	.writepage = ouichefs_writepage,
+	.writepages = ouichefs_writepages,
 	.write_begin = ouichefs_write_begin,
 	.write_end = ouichefs_write_end
 };
 
+/*
+ * Truncate the regular file inode to 0, releasing all its data blocks.
+ */
+int ouichefs_truncate(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh_index;
+	handle_t *handle;
+	bool more;
+	int ret;
+
+	/* Pages, possibly mapped, must not be written to freed blocks */
+	truncate_pagecache(inode, 0);
+	ouichefs_compress_unreserve(inode, 0);
+
+	/* Read index block from disk */
+	bh_index = ouichefs_bread(sb, ci->index_block);
+	if (!bh_index)
+		return -EIO;
+
+	/*
+	 * Blocks are released one batch per handle, the last ones first: the
+	 * size only drops in the last handle, so that a crash in between
+	 * leaves holes at the end of the file rather than blocks past its end.
+	 */
+	do {
+		handle = ouichefs_journal_start(
+			sb, OUICHEFS_RELEASE_CREDITS(OUICHEFS_SB(sb)), 0);
+		if (IS_ERR(handle)) {
+			ret = PTR_ERR(handle);
+			goto brelse;
+		}
+		ret = ouichefs_journal_get_write_access(handle, bh_index);
+		if (ret) {
+			ouichefs_journal_stop(handle);
+			goto brelse;
+		}
+
+		more = false;
+		if (ouichefs_is_inline(inode)) {
+			memset(bh_index->b_data, 0, sb->s_blocksize);
+			ouichefs_journal_dirty(handle, bh_index);
+		} else {
+			more = release_file_blocks(handle, inode, bh_index, 0);
+		}
+		ouichefs_journal_update_tid(handle, inode, true);
+		if (!more) {
+			inode->i_size = 0;
+			inode->i_blocks = ouichefs_is_inline(inode) ? 1 : 0;
+			mark_inode_dirty(inode);
+		}
+		ret = ouichefs_journal_stop(handle);
+	} while (more && !ret);
+
+brelse:
+	brelse(bh_index);
+	return ret;
+}
+
 static int ouichefs_open(struct inode *inode, struct file *file) {
 	bool wronly = (file->f_flags & O_WRONLY) != 0;
 	bool rdwr = (file->f_flags & O_RDWR) != 0;
 	bool trunc = (file->f_flags & O_TRUNC) != 0;
 
-	if ((wronly || rdwr) && trunc && (inode->i_size != 0)) {
-		struct super_block *sb = inode->i_sb;
-		struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-		struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-		struct ouichefs_file_index_block *index;
-		struct buffer_head *bh_index;
-		sector_t iblock;
+	/* Pages larger than a cluster cannot be written back (see super.c) */
+	if (ouichefs_is_compressed(inode) &&
+	    !ouichefs_clusters_fit(inode->i_sb))
+		return -EOPNOTSUPP;
 
-		/* Read index block from disk */
-		bh_index = sb_bread(sb, ci->index_block);
-		if (!bh_index)
-			return -EIO;
+	/* Cached reads and overwrites can be done without sleeping */
+	file->f_mode |= FMODE_NOWAIT | FMODE_BUF_RASYNC | FMODE_BUF_WASYNC;
+
+	if ((wronly || rdwr) && trunc && (inode->i_size != 0))
+		return ouichefs_truncate(inode);
+	
+	return 0;
+}
+
+/*
+ * Return 0 if the blocks backing folio up to the end of file, which are all
+ * written back once it is dirtied, are allocated and not shared, -EAGAIN if
+ * they are not or if that cannot be known without sleeping. A folio covers
+ * several blocks when they are smaller than a page.
+ */
+static int folio_blocks_nowait(struct inode *inode, struct folio *folio)
+{
+	unsigned int bits = inode->i_blkbits;
+	loff_t end = min_t(loff_t, folio_pos(folio) + folio_size(folio),
+			   i_size_read(inode));
+	uint32_t iblock;
+	uint64_t bno;
+	int ret;
+
+	for (iblock = folio_pos(folio) >> bits; (loff_t)iblock << bits < end;
+	     iblock++) {
+		ret = lookup_block_nowait(inode, iblock, &bno);
+		if (!ret)
+			ret = bno ? ouichefs_block_shared(inode->i_sb, bno,
+							 true) :
+				    -EAGAIN;
+		if (ret)
+			return ret > 0 ? -EAGAIN : ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Write with IOCB_NOWAIT (io_uring, RWF_NOWAIT). Only overwrites of cached,
+ * uptodate pages whose blocks are allocated and not shared need neither a
+ * handle nor a read: they are done in place, and anything else fails with
+ * -EAGAIN, for the caller to retry from a context that can block. A write
+ * stopped on the way returns the number of bytes written so far.
+ */
+static ssize_t write_nowait(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct address_space *mapping = inode->i_mapping;
+	size_t offset, bytes, copied;
+	ssize_t written = 0, ret;
+	struct folio *folio;
+
+	/* Syncing the data would block */
+	if (iocb->ki_flags & IOCB_DSYNC)
+		return -EAGAIN;
+	if (!inode_trylock(inode))
+		return -EAGAIN;
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto unlock;
+	/* Growing the file, inline and clustered data need a handle */
+	ret = -EAGAIN;
+	if (iocb->ki_pos + iov_iter_count(from) > i_size_read(inode) ||
+	    ouichefs_is_inline(inode) || ouichefs_is_clustered(inode))
+		goto unlock;
+	/* Fails with -EAGAIN if timestamps must be updated */
+	ret = kiocb_modified(iocb);
+	if (ret)
+		goto unlock;
+
+	while (iov_iter_count(from)) {
+		offset = offset_in_page(iocb->ki_pos);
+		bytes = min_t(size_t, PAGE_SIZE - offset, iov_iter_count(from));
+
+		folio = __filemap_get_folio(mapping, iocb->ki_pos >> PAGE_SHIFT,
+					    FGP_LOCK | FGP_NOWAIT, 0);
+		if (IS_ERR(folio)) {
+			ret = -EAGAIN;
+			break;
+		}
+		ret = -EAGAIN;
+		if (folio_test_uptodate(folio) && !folio_test_writeback(folio))
+			ret = folio_blocks_nowait(inode, folio);
+		if (ret) {
+			folio_unlock(folio);
+			folio_put(folio);
+			break;
+		}
+
+		/* User pages are not faulted in, which could block */
+		copied = copy_page_from_iter_atomic(&folio->page, offset, bytes,
+						    from);
+		flush_dcache_folio(folio);
+		if (copied)
+			folio_mark_dirty(folio);
+		folio_unlock(folio);
+		folio_put(folio);
+		if (!copied) {
+			ret = -EAGAIN;
+			break;
+		}
+		iocb->ki_pos += copied;
+		written += copied;
+
+		ret = balance_dirty_pages_ratelimited_flags(mapping, BDP_ASYNC);
+		if (ret)
+			break;
+	}
+
+unlock:
+	inode_unlock(inode);
+
+	return written ? written : ret;
+}
+
+static ssize_t ouichefs_file_write_iter(struct kiocb *iocb,
+					struct iov_iter *from)
+{
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return write_nowait(iocb, from);
+	return generic_file_write_iter(iocb, from);
+}
+
+/*
+ * Without a journal, the on-disk free bitmap is only written by sync_fs.
+ * Write the bitmap blocks covering the blocks of inode, which may hold its
+ * allocations, and its index block, then wait for them.
+ */
+static int sync_file_blocks(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	unsigned int shift = sb->s_blocksize_bits + 3; /* bits per block */
+	uint32_t bfree_start = 1 + sbi->nr_istore_blocks + sbi->nr_ifree_blocks;
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index, *bh;
+	unsigned long *touched;
+	uint64_t bno;
+	uint32_t i;
+	int ret = 0;
+
+	touched = bitmap_zalloc(sbi->nr_bfree_blocks, GFP_NOFS);
+	if (!touched)
+		return -ENOMEM;
+
+	bh_index = ouichefs_bread(sb, ci->index_block);
+	if (!bh_index) {
+		ret = -EIO;
+		goto free;
+	}
+	__set_bit(bh_index->b_blocknr >> shift, touched);
+	if (ci->ext_len) {
+		for (i = ci->ext_start >> shift;
+		     i <= (ci->ext_start + ci->ext_len - 1) >> shift; i++)
+			__set_bit(i, touched);
+	}
+	if (S_ISREG(inode->i_mode) && !ouichefs_is_inline(inode)) {
 		index = (struct ouichefs_file_index_block *)bh_index->b_data;
+		for (i = 0; i < OUICHEFS_INDEX_ENTRIES(sb); i++) {
+			bno = ouichefs_index_get(sb, index, i);
+			if (bno)
+				__set_bit(bno >> shift, touched);
+		}
+	}
+	if (buffer_dirty(bh_index))
+		write_dirty_buffer(bh_index, 0);
 
-		for (iblock = 0; index->blocks[iblock] != 0; iblock++) {
-			put_block(sbi, index->blocks[iblock]);
-			index->blocks[iblock] = 0;
+	for_each_set_bit(i, touched, sbi->nr_bfree_blocks) {
+		bh = ouichefs_getblk(sb, bfree_start + i);
+		if (!bh) {
+			ret = -ENOMEM;
+			break;
 		}
-		inode->i_size = 0;
-		inode->i_blocks = 0;
+		lock_buffer(bh);
+		spin_lock(&sbi->bitmap_lock);
+		memcpy(bh->b_data,
+		       (void *)sbi->bfree_bitmap + i * sb->s_blocksize,
+		       sb->s_blocksize);
+		spin_unlock(&sbi->bitmap_lock);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		ret = sync_dirty_buffer(bh);
+		brelse(bh);
+		if (ret)
+			break;
+	}
 
-		brelse(bh_index);
+	wait_on_buffer(bh_index);
+	if (!ret && !buffer_uptodate(bh_index))
+		ret = -EIO;
+	brelse(bh_index);
+free:
+	bitmap_free(touched);
+
+	return ret;
+}
+
+/*
+ * Write the dirty pages of file in [start, end] and the metadata needed to
+ * read them back, then flush the device cache once.
+ *
+ * With a journal, the metadata is committed by the transaction that last
+ * modified the inode, or the last one that changed more than its timestamps
+ * for fdatasync; the commit flushes the cache after the data written here.
+ * Otherwise, only the index block, the bitmap blocks covering the file and
+ * its inode-store block (unless fdatasync and only timestamps changed) are
+ * written. With a metadata device, the commit only flushes that device, so
+ * the main one is always flushed here.
+ */
+int ouichefs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct inode *inode = file->f_mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	journal_t *journal = sbi->journal;
+	bool needs_flush = true;
+	tid_t tid;
+	int ret;
+
+	ret = file_write_and_wait_range(file, start, end);
+	if (ret)
+		return ret;
+
+	if (journal) {
+		tid = datasync ? READ_ONCE(ci->i_datasync_tid) :
+				 READ_ONCE(ci->i_sync_tid);
+		if (!sbi->meta_bdev &&
+		    jbd2_trans_will_send_data_barrier(journal, tid))
+			needs_flush = false;
+		ret = jbd2_complete_transaction(journal, tid);
+	} else {
+		ret = sync_file_blocks(inode);
+		if (!ret && (inode->i_state & I_DIRTY_ALL) &&
+		    (!datasync || (inode->i_state & I_DIRTY_DATASYNC)))
+			ret = sync_inode_metadata(inode, 1);
 	}
-	
+
+	if (!ret && needs_flush)
+		ret = blkdev_issue_flush(sb->s_bdev);
+	if (!ret && !journal && sbi->meta_bdev)
+		ret = blkdev_issue_flush(sbi->meta_bdev);
+
+	return ret;
+}
+
+/*
+ * Called when a shared mapping is about to dirty a page. Blocks are allocated
+ * at this point, so that writeback does not have to.
+ */
+static vm_fault_t ouichefs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	struct super_block *sb = inode->i_sb;
+	handle_t *handle;
+	vm_fault_t ret;
+	int err = 0;
+
+	/* Blocks of clustered files are allocated by writeback */
+	if (ouichefs_is_clustered(inode))
+		return ouichefs_compress_page_mkwrite(vmf);
+
+	sb_start_pagefault(sb);
+	file_update_time(vmf->vma->vm_file);
+	/* Keeps clones from sharing the block while the page is dirtied */
+	filemap_invalidate_lock_shared(inode->i_mapping);
+
+	/* As in write_begin, the handle is started before the page is locked */
+	handle = ouichefs_journal_start(sb, OUICHEFS_ALLOC_CREDITS(sb),
+					0);
+	if (IS_ERR(handle)) {
+		ret = VM_FAULT_SIGBUS;
+		goto out;
+	}
+
+	/* Pages of inline files are never written back */
+	if (ouichefs_is_inline(inode))
+		err = convert_inline(handle, inode);
+	if (!err)
+		err = unshare_blocks(handle, inode, page_offset(vmf->page),
+				     PAGE_SIZE);
+	if (!err)
+		err = block_page_mkwrite(vmf->vma, vmf,
+					 ouichefs_file_get_block);
+	ret = block_page_mkwrite_return(err);
+	ouichefs_journal_stop(handle);
+out:
+	filemap_invalidate_unlock_shared(inode->i_mapping);
+	sb_end_pagefault(sb);
+
+	return ret;
+}
+
+static const struct vm_operations_struct ouichefs_file_vm_ops = {
+	.fault = filemap_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = ouichefs_page_mkwrite,
+};
+
+static int ouichefs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &ouichefs_file_vm_ops;
+
 	return 0;
 }
 
+/*
+ * Clone len bytes of file_in at pos_in to file_out at pos_out by sharing
+ * their blocks: used by FICLONE, FICLONERANGE and copy_file_range(), which
+ * falls back to a copy if the source is inline or either file compressed.
+ * Each block is shared in a handle of its own, so a failed clone may leave a
+ * part of the range cloned.
+ */
+static loff_t ouichefs_remap_file_range(struct file *file_in, loff_t pos_in,
+					struct file *file_out, loff_t pos_out,
+					loff_t len, unsigned int remap_flags)
+{
+	struct inode *src = file_inode(file_in), *dst = file_inode(file_out);
+	struct super_block *sb = dst->i_sb;
+	uint32_t first_in, first_out, nr, i;
+	uint64_t bno, old;
+	unsigned char bits = sb->s_blocksize_bits;
+	handle_t *handle;
+	loff_t ret, end;
+
+	if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_CAN_SHORTEN))
+		return -EINVAL;
+	if (!ouichefs_has_reflink(OUICHEFS_SB(sb)) ||
+	    (remap_flags & REMAP_FILE_DEDUP))
+		return -EOPNOTSUPP;
+
+	lock_two_nondirectories(src, dst);
+	/* No page of either range can be faulted in or dirtied meanwhile */
+	filemap_invalidate_lock_two(src->i_mapping, dst->i_mapping);
+
+	/* Checks the ranges and writes their dirty pages */
+	ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out,
+					    &len, remap_flags);
+	if (ret < 0 || !len)
+		goto unlock;
+	/* A partial last block can only be cloned at the end of file_out */
+	if (!IS_ALIGNED(len, sb->s_blocksize) &&
+	    pos_out + len < i_size_read(dst)) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+	/* Inline data has no block to share, clusters are written as a whole */
+	if (ouichefs_is_inline(src) || ouichefs_is_clustered(src) ||
+	    ouichefs_is_clustered(dst)) {
+		ret = -EOPNOTSUPP;
+		goto unlock;
+	}
+	if (ouichefs_is_inline(dst)) {
+		handle = ouichefs_journal_start(sb,
+						OUICHEFS_ALLOC_CREDITS(sb), 0);
+		if (IS_ERR(handle)) {
+			ret = PTR_ERR(handle);
+			goto unlock;
+		}
+		ret = convert_inline(handle, dst);
+		ret = ouichefs_journal_stop(handle) ?: ret;
+		if (ret)
+			goto unlock;
+	}
+
+	/* Pages of file_out must not be written to the blocks they replace */
+	truncate_inode_pages_range(dst->i_mapping, pos_out,
+				   round_up(pos_out + len, PAGE_SIZE) - 1);
+
+	first_in = pos_in >> bits;
+	first_out = pos_out >> bits;
+	nr = DIV_ROUND_UP(len, sb->s_blocksize);
+	for (i = 0; i < nr; i++) {
+		ret = lookup_block(src, first_in + i, &bno);
+		if (ret)
+			break;
+
+		handle = ouichefs_journal_start(sb, OUICHEFS_CLONE_CREDITS, 0);
+		if (IS_ERR(handle)) {
+			ret = PTR_ERR(handle);
+			break;
+		}
+		if (bno)
+			ret = ouichefs_refcount_get(handle, sb, bno);
+		if (!ret) {
+			mutex_lock(&OUICHEFS_INODE(dst)->map_lock);
+			ret = set_block(handle, dst, first_out + i, bno, &old);
+			mutex_unlock(&OUICHEFS_INODE(dst)->map_lock);
+			if (ret && bno)
+				ouichefs_refcount_put(handle, sb, bno);
+		}
+		if (!ret) {
+			if (old)
+				ouichefs_release_block_range(handle, sb, old,
+							     1);
+			end = min(pos_out + ((loff_t)(i + 1) << bits),
+				  pos_out + len);
+			if (end > i_size_read(dst)) {
+				i_size_write(dst, end);
+				dst->i_blocks = (end >> bits) + 2;
+				mark_inode_dirty(dst);
+			}
+			ouichefs_journal_update_tid(handle, dst, true);
+		}
+		ret = ouichefs_journal_stop(handle) ?: ret;
+		if (ret)
+			break;
+
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+	if (!ret)
+		ret = len;
+
+unlock:
+	filemap_invalidate_unlock_two(src->i_mapping, dst->i_mapping);
+	unlock_two_nondirectories(src, dst);
+
+	return ret;
+}
+
+/*
+ * Write len bytes of buf at pos of file so that a crash leaves either all of
+ * them or none on disk (OUICHEFS_IOC_ATOMIC_WRITE). The pages of the range
+ * are filled and the blocks it touches are moved to new blocks, and the index
+ * block is switched to these blocks by a single handle, which makes the
+ * transaction write them before it commits: blocks are never overwritten in
+ * place. The blocks they replace are released once the transaction has
+ * committed. Blocks may be smaller than pages, so a page may hold blocks out
+ * of the range, which keep their own.
+ */
+ssize_t ouichefs_atomic_write(struct file *file, loff_t pos,
+			      const void __user *buf, size_t len)
+{
+	struct inode *inode = file_inode(file);
+	struct address_space *mapping = inode->i_mapping;
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct page *pages[OUICHEFS_ATOMIC_WRITE_MAX / PAGE_SIZE + 1] = {};
+	uint64_t blocks[OUICHEFS_ATOMIC_BLOCKS], old[OUICHEFS_ATOMIC_BLOCKS];
+	unsigned int bits = inode->i_blkbits;
+	pgoff_t first = pos >> PAGE_SHIFT;
+	uint32_t first_block = pos >> bits, iblock;
+	int i, nr, nr_blocks, nr_old = 0, locked = 0;
+	unsigned int from, to;
+	struct buffer_head *bh, *head;
+	handle_t *handle;
+	void *data;
+	ssize_t ret;
+
+	/* Only the journal can switch all the blocks at once */
+	if (!OUICHEFS_SB(sb)->journal)
+		return -EOPNOTSUPP;
+	if (pos < 0 || len > OUICHEFS_ATOMIC_WRITE_MAX)
+		return -EINVAL;
+	if (!len)
+		return 0;
+	if (pos + len > OUICHEFS_MAX_FILESIZE(sb))
+		return -EFBIG;
+	nr = ((pos + len - 1) >> PAGE_SHIFT) - first + 1;
+	nr_blocks = ((pos + len - 1) >> bits) - first_block + 1;
+
+	/* Copied first: a fault on a page of file would need its locks */
+	data = kvmalloc(len, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+	if (copy_from_user(data, buf, len)) {
+		ret = -EFAULT;
+		goto free;
+	}
+
+	file_start_write(file);
+	inode_lock(inode);
+	ret = -EPERM;
+	if (IS_IMMUTABLE(inode) || IS_APPEND(inode))
+		goto unlock_inode;
+	/* Clusters are already rewritten to new blocks as a whole */
+	ret = -EOPNOTSUPP;
+	if (ouichefs_is_clustered(inode))
+		goto unlock_inode;
+	ret = file_remove_privs(file);
+	if (!ret)
+		ret = file_update_time(file);
+	if (ret)
+		goto unlock_inode;
+	/* No page of the range can be faulted in meanwhile */
+	filemap_invalidate_lock(mapping);
+
+	if (ouichefs_is_inline(inode)) {
+		handle = ouichefs_journal_start(sb,
+						OUICHEFS_ALLOC_CREDITS(sb), 0);
+		if (IS_ERR(handle)) {
+			ret = PTR_ERR(handle);
+			goto unlock_mapping;
+		}
+		ret = convert_inline(handle, inode);
+		ret = ouichefs_journal_stop(handle) ?: ret;
+		if (ret)
+			goto unlock_mapping;
+	}
+
+	/* Pages only partly written keep the rest of their content */
+	if (offset_in_page(pos))
+		pages[0] = read_mapping_page(mapping, first, file);
+	if (!IS_ERR(pages[0]) && offset_in_page(pos + len) &&
+	    (nr > 1 || !pages[0]))
+		pages[nr - 1] = read_mapping_page(mapping, first + nr - 1,
+						  file);
+	for (i = 0; i < nr; i++) {
+		if (IS_ERR(pages[i])) {
+			ret = PTR_ERR(pages[i]);
+			pages[i] = NULL;
+			goto put;
+		}
+	}
+
+	/* As in write_begin, the handle is started before pages are locked */
+	handle = ouichefs_journal_start(sb, OUICHEFS_ATOMIC_CREDITS, 0);
+	if (IS_ERR(handle)) {
+		ret = PTR_ERR(handle);
+		goto put;
+	}
+	for (locked = 0; locked < nr; locked++) {
+		if (!pages[locked]) {
+			pages[locked] = find_or_create_page(
+				mapping, first + locked,
+				mapping_gfp_constraint(mapping, GFP_NOFS));
+			if (!pages[locked]) {
+				ret = -ENOMEM;
+				goto unlock;
+			}
+		} else {
+			lock_page(pages[locked]);
+			if (pages[locked]->mapping != mapping) {
+				unlock_page(pages[locked]);
+				ret = -EAGAIN;
+				goto unlock;
+			}
+		}
+		/* Nothing may still be on its way to the old block */
+		wait_on_page_writeback(pages[locked]);
+	}
+
+	ret = ouichefs_alloc_blocks(handle, inode, blocks, nr_blocks);
+	if (ret)
+		goto unlock;
+	ret = ouichefs_journal_data(handle, inode, (loff_t)first_block << bits,
+				    (loff_t)nr_blocks << bits);
+	if (ret) {
+		ouichefs_release_blocks(handle, sb, blocks, nr_blocks);
+		goto unlock;
+	}
+	mutex_lock(&ci->map_lock);
+	ret = set_blocks(handle, inode, first_block, blocks, nr_blocks, old);
+	mutex_unlock(&ci->map_lock);
+	if (ret) {
+		ouichefs_release_blocks(handle, sb, blocks, nr_blocks);
+		goto unlock;
+	}
+	/* Holes had no block to release */
+	for (i = 0; i < nr_blocks; i++) {
+		if (old[i])
+			old[nr_old++] = old[i];
+	}
+	if (nr_old)
+		ouichefs_release_blocks(handle, sb, old, nr_old);
+
+	/* Writeback, or the commit, writes the pages to their new blocks */
+	for (i = 0; i < nr; i++) {
+		from = i ? 0 : offset_in_page(pos);
+		to = i < nr - 1 ? PAGE_SIZE : offset_in_page(pos + len - 1) + 1;
+		memcpy_to_page(pages[i], from,
+			       data + ((loff_t)(first + i) << PAGE_SHIFT) +
+				       from - pos,
+			       to - from);
+		if (!page_has_buffers(pages[i]))
+			create_empty_buffers(pages[i], sb->s_blocksize, 0);
+		head = page_buffers(pages[i]);
+		bh = head;
+		iblock = (loff_t)(first + i) << (PAGE_SHIFT - bits);
+		do {
+			if (iblock >= first_block &&
+			    iblock < first_block + nr_blocks) {
+				map_bh(bh, sb, blocks[iblock - first_block]);
+				set_buffer_uptodate(bh);
+				mark_buffer_dirty(bh);
+			}
+			iblock++;
+			bh = bh->b_this_page;
+		} while (bh != head);
+		SetPageUptodate(pages[i]);
+	}
+
+	if (pos + len > inode->i_size) {
+		i_size_write(inode, pos + len);
+		inode->i_blocks = (inode->i_size >> inode->i_blkbits) + 2;
+	}
+	mark_inode_dirty(inode);
+	ouichefs_journal_update_tid(handle, inode, true);
+	ret = len;
+
+unlock:
+	for (i = 0; i < locked; i++)
+		unlock_page(pages[i]);
+	ret = ouichefs_journal_stop(handle) ?: ret;
+put:
+	for (i = 0; i < nr; i++) {
+		if (pages[i])
+			put_page(pages[i]);
+	}
+unlock_mapping:
+	filemap_invalidate_unlock(mapping);
+unlock_inode:
+	inode_unlock(inode);
+	file_end_write(file);
+free:
+	kvfree(data);
+
+	return ret;
+}
+
 const struct file_operations ouichefs_file_ops = {
 	.owner = THIS_MODULE,
 	.open = ouichefs_open,
+	.unlocked_ioctl = ouichefs_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 	.llseek = generic_file_llseek,
+	.mmap = ouichefs_file_mmap,
+	.fsync = ouichefs_fsync,
 	.read_iter = generic_file_read_iter,
-	.write_iter = generic_file_write_iter
+	.write_iter = ouichefs_file_write_iter,
+	.splice_read = filemap_splice_read,
+	.splice_write = iter_file_splice_write,
+	.remap_file_range = ouichefs_remap_file_range
 };
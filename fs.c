@@ -36,6 +36,9 @@ struct dentry *ouichefs_mount(struct file_system_type *fs_type, int flags,
  */
 void ouichefs_kill_sb(struct super_block *sb)
 {
+	/* The zone collector holds inodes, which must all be evicted */
+	if (sb->s_root)
+		ouichefs_zone_stop(sb);
 	kill_block_super(sb);
 
 	pr_info("unmounted disk\n");
@@ -11,24 +11,219 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/namei.h>
+#include <linux/math64.h>
 
 #include "ouichefs.h"
 #include "bitmap.h"
 
 static const struct inode_operations ouichefs_inode_ops;
 
+/*
+ * Load the target of symlink inode, stored in its on-disk record raw or in
+ * its index block, so that following the link costs no read.
+ */
+static int ouichefs_read_link(struct inode *inode, const void *raw)
+{
+	struct buffer_head *bh;
+
+	if (inode->i_size >= inode->i_sb->s_blocksize)
+		return -EUCLEAN;
+
+	if (!OUICHEFS_INODE(inode)->index_block) {
+		if (!ouichefs_compact_inodes(OUICHEFS_SB(inode->i_sb)) ||
+		    inode->i_size > OUICHEFS_INODE_V2_INLINE)
+			return -EUCLEAN;
+		inode->i_link = kstrndup(
+			((const struct ouichefs_inode_v2 *)raw)->i_inline,
+			inode->i_size, GFP_NOFS);
+		return inode->i_link ? 0 : -ENOMEM;
+	}
+
+	bh = ouichefs_bread(inode->i_sb, OUICHEFS_INODE(inode)->index_block);
+	if (!bh)
+		return -EIO;
+	inode->i_link = kstrndup(bh->b_data, inode->i_size, GFP_NOFS);
+	brelse(bh);
+
+	return inode->i_link ? 0 : -ENOMEM;
+}
+
+/*
+ * Read the inode-store block containing inode ino. *raw is set to the
+ * on-disk record of ino inside this block, whose layout depends on
+ * OUICHEFS_FEATURE_COMPACT_INODE.
+ */
+struct buffer_head *ouichefs_bread_inode(struct super_block *sb, uint32_t ino,
+					 void **raw)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+
+	bh = ouichefs_bread(sb, ouichefs_inode_block(sbi, ino));
+	if (bh)
+		*raw = bh->b_data + ouichefs_inode_offset(sbi, ino);
+	return bh;
+}
+
+/*
+ * Copy the on-disk record raw to di, in the original layout. The timestamps
+ * and symlink target of a compact record are left to the caller: the former
+ * are read with ouichefs_load_times(), as they do not fit in di.
+ */
+void ouichefs_load_inode(struct super_block *sb, const void *raw,
+			 struct ouichefs_inode *di)
+{
+	const struct ouichefs_inode_v2 *v2 = raw;
+
+	if (!ouichefs_compact_inodes(OUICHEFS_SB(sb))) {
+		memcpy(di, raw, sizeof(*di));
+		return;
+	}
+
+	memset(di, 0, sizeof(*di));
+	di->i_mode = v2->i_mode;
+	di->i_uid = v2->i_uid;
+	di->i_gid = v2->i_gid;
+	di->i_size = v2->i_size;
+	di->i_blocks = v2->i_blocks;
+	di->i_nlink = v2->i_nlink;
+	di->index_block = v2->index_block;
+	di->i_next_orphan = v2->i_next_orphan;
+	di->i_flags = v2->i_flags;
+	di->i_extent_start = v2->i_extent_start;
+	di->i_extent_len = v2->i_extent_len;
+}
+
+/*
+ * Copy di to the on-disk record raw. The timestamps and symlink target of a
+ * compact record are left untouched.
+ */
+void ouichefs_store_inode(struct super_block *sb, void *raw,
+			  const struct ouichefs_inode *di)
+{
+	struct ouichefs_inode_v2 *v2 = raw;
+
+	if (!ouichefs_compact_inodes(OUICHEFS_SB(sb))) {
+		memcpy(raw, di, sizeof(*di));
+		return;
+	}
+
+	v2->i_mode = di->i_mode;
+	v2->i_uid = di->i_uid;
+	v2->i_gid = di->i_gid;
+	v2->i_size = di->i_size;
+	v2->i_blocks = di->i_blocks;
+	v2->i_nlink = di->i_nlink;
+	v2->index_block = di->index_block;
+	v2->i_next_orphan = di->i_next_orphan;
+	v2->i_flags = di->i_flags;
+	v2->i_extent_start = di->i_extent_start;
+	v2->i_extent_len = di->i_extent_len;
+}
+
+static struct timespec64 ns_to_time(uint64_t ns)
+{
+	struct timespec64 ts;
+	uint32_t rem;
+
+	ts.tv_sec = div_u64_rem(ns, NSEC_PER_SEC, &rem);
+	ts.tv_nsec = rem;
+	return ts;
+}
+
+static uint64_t time_to_ns(const struct timespec64 *ts)
+{
+	return (uint64_t)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+/*
+ * Timestamps of the on-disk record raw. Compact records keep them as 64-bit
+ * nanosecond counts, which 32-bit seconds would truncate.
+ */
+void ouichefs_load_times(struct super_block *sb, const void *raw,
+			 struct timespec64 *ctime, struct timespec64 *atime,
+			 struct timespec64 *mtime)
+{
+	const struct ouichefs_inode_v2 *v2 = raw;
+	const struct ouichefs_inode *v1 = raw;
+
+	if (!ouichefs_compact_inodes(OUICHEFS_SB(sb))) {
+		ctime->tv_sec = v1->i_ctime;
+		ctime->tv_nsec = v1->i_nctime;
+		atime->tv_sec = v1->i_atime;
+		atime->tv_nsec = v1->i_natime;
+		mtime->tv_sec = v1->i_mtime;
+		mtime->tv_nsec = v1->i_nmtime;
+		return;
+	}
+	*ctime = ns_to_time(v2->i_ctime);
+	*atime = ns_to_time(v2->i_atime);
+	*mtime = ns_to_time(v2->i_mtime);
+}
+
+void ouichefs_store_times(struct super_block *sb, void *raw,
+			  const struct timespec64 *ctime,
+			  const struct timespec64 *atime,
+			  const struct timespec64 *mtime)
+{
+	struct ouichefs_inode_v2 *v2 = raw;
+	struct ouichefs_inode *v1 = raw;
+
+	if (!ouichefs_compact_inodes(OUICHEFS_SB(sb))) {
+		v1->i_ctime = ctime->tv_sec;
+		v1->i_nctime = ctime->tv_nsec;
+		v1->i_atime = atime->tv_sec;
+		v1->i_natime = atime->tv_nsec;
+		v1->i_mtime = mtime->tv_sec;
+		v1->i_nmtime = mtime->tv_nsec;
+		return;
+	}
+	v2->i_ctime = time_to_ns(ctime);
+	v2->i_atime = time_to_ns(atime);
+	v2->i_mtime = time_to_ns(mtime);
+}
+
+/*
+ * First block of the extent of the on-disk record raw. Its high bits are
+ * only stored in compact records of 64-bit partitions.
+ */
+uint64_t ouichefs_load_extent_start(struct super_block *sb, const void *raw)
+{
+	const struct ouichefs_inode_v2 *v2 = raw;
+
+	if (!ouichefs_compact_inodes(OUICHEFS_SB(sb)))
+		return ((const struct ouichefs_inode *)raw)->i_extent_start;
+	if (!ouichefs_has_64bit(OUICHEFS_SB(sb)))
+		return v2->i_extent_start;
+	return (uint64_t)v2->i_extent_start_hi << 32 | v2->i_extent_start;
+}
+
+void ouichefs_store_extent_start(struct super_block *sb, void *raw,
+				 uint64_t start)
+{
+	struct ouichefs_inode_v2 *v2 = raw;
+
+	if (!ouichefs_compact_inodes(OUICHEFS_SB(sb))) {
+		((struct ouichefs_inode *)raw)->i_extent_start = start;
+		return;
+	}
+	v2->i_extent_start = lower_32_bits(start);
+	if (ouichefs_has_64bit(OUICHEFS_SB(sb)))
+		v2->i_extent_start_hi = upper_32_bits(start);
+}
+
 /*
  * Get inode ino from disk.
  */
 struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 {
 	struct inode *inode = NULL;
-	struct ouichefs_inode *cinode = NULL;
+	struct ouichefs_inode di, *cinode = &di;
 	struct ouichefs_inode_info *ci = NULL;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh = NULL;
-	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK) + 1;
-	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK;
+	void *raw;
 	int ret;
 
 	/* Fail if ino is out of range */
@@ -45,13 +240,12 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 
 	ci = OUICHEFS_INODE(inode);
 	/* Read inode from disk and initialize */
-	bh = sb_bread(sb, inode_block);
+	bh = ouichefs_bread_inode(sb, ino, &raw);
 	if (!bh) {
 		ret = -EIO;
 		goto failed;
 	}
-	cinode = (struct ouichefs_inode *)bh->b_data;
-	cinode += inode_shift;
+	ouichefs_load_inode(sb, raw, cinode);
 
 	inode->i_ino = ino;
 	inode->i_sb = sb;
@@ -61,22 +255,37 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 	i_uid_write(inode, le32_to_cpu(cinode->i_uid));
 	i_gid_write(inode, le32_to_cpu(cinode->i_gid));
 	inode->i_size = le32_to_cpu(cinode->i_size);
-	inode->i_ctime.tv_sec = (time64_t)le32_to_cpu(cinode->i_ctime);
-	inode->i_ctime.tv_nsec = (long)le64_to_cpu(cinode->i_nctime);
-	inode->i_atime.tv_sec = (time64_t)le32_to_cpu(cinode->i_atime);
-	inode->i_atime.tv_nsec = (long)le64_to_cpu(cinode->i_natime);
-	inode->i_mtime.tv_sec = (time64_t)le32_to_cpu(cinode->i_mtime);
-	inode->i_mtime.tv_nsec = (long)le64_to_cpu(cinode->i_nmtime);
+	ouichefs_load_times(sb, raw, &inode->i_ctime, &inode->i_atime,
+			    &inode->i_mtime);
 	inode->i_blocks = le32_to_cpu(cinode->i_blocks);
 	set_nlink(inode, le32_to_cpu(cinode->i_nlink));
 
 	ci->index_block = le32_to_cpu(cinode->index_block);
+	ci->flags = le32_to_cpu(cinode->i_flags);
+	ci->ext_start = ouichefs_load_extent_start(sb, raw);
+	ci->ext_len = le32_to_cpu(cinode->i_extent_len);
+	ouichefs_journal_init_tid(inode);
+	if (S_ISREG(inode->i_mode) && (ci->flags & OUICHEFS_INODE_COMPRESS) &&
+	    ouichefs_compact_inodes(sbi))
+		bitmap_from_arr32(
+			ci->cmap,
+			(const u32 *)((struct ouichefs_inode_v2 *)raw)->i_inline,
+			OUICHEFS_MAX_CLUSTERS);
+
+	/* Snapshots are read-only */
+	if (ci->flags & OUICHEFS_INODE_SNAPSHOT)
+		inode->i_flags |= S_IMMUTABLE | S_NOATIME;
 
 	if (S_ISDIR(inode->i_mode)) {
 		inode->i_fop = &ouichefs_dir_ops;
 	} else if (S_ISREG(inode->i_mode)) {
 		inode->i_fop = &ouichefs_file_ops;
 		inode->i_mapping->a_ops = &ouichefs_aops;
+	} else if (S_ISLNK(inode->i_mode)) {
+		ret = ouichefs_read_link(inode, raw);
+		if (ret)
+			goto failed;
+		inode->i_op = &simple_symlink_inode_operations;
 	}
 
 	brelse(bh);
@@ -113,13 +322,13 @@ static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
 		return ERR_PTR(-ENAMETOOLONG);
 
 	/* Read the directory index block on disk */
-	bh = sb_bread(sb, ci_dir->index_block);
+	bh = ouichefs_bread(sb, ci_dir->index_block);
 	if (!bh)
 		return ERR_PTR(-EIO);
 	dblock = (struct ouichefs_dir_block *)bh->b_data;
 
 	/* Search for the file in directory */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+	for (i = 0; i < OUICHEFS_MAX_SUBFILES(sb); i++) {
 		f = &dblock->files[i];
 		if (!f->inode)
 			break;
@@ -142,9 +351,12 @@ static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
 }
 
 /*
- * Create a new inode in dir.
+ * Create a new inode in dir, with an index block unless index is false.
+ * Allocations are journaled in handle. The inode is built in memory: its
+ * record is only written once it is dirtied. It is returned locked (I_NEW).
  */
-static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
+static struct inode *ouichefs_new_inode(handle_t *handle, struct inode *dir,
+					mode_t mode, bool index)
 {
 	struct inode *inode;
 	struct ouichefs_inode_info *ci;
@@ -154,41 +366,67 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	int ret;
 
 	/* Check mode before doing anything to avoid undoing everything */
-	if (!S_ISDIR(mode) && !S_ISREG(mode)) {
-		pr_err("File type not supported (only directory and regular files supported)\n");
+	if (!S_ISDIR(mode) && !S_ISREG(mode) && !S_ISLNK(mode)) {
+		pr_err("File type not supported (only directory, regular files and symlinks supported)\n");
 		return ERR_PTR(-EINVAL);
 	}
 
 	/* Check if inodes are available */
 	sb = dir->i_sb;
 	sbi = OUICHEFS_SB(sb);
-	if (sbi->nr_free_inodes == 0 || sbi->nr_free_blocks == 0)
+	if (sbi->nr_free_inodes == 0 || (index && sbi->free_blocks_count == 0))
 		return ERR_PTR(-ENOSPC);
 
 	/* Get a new free inode */
 	ino = get_free_inode(sbi);
 	if (!ino)
 		return ERR_PTR(-ENOSPC);
-	inode = ouichefs_iget(sb, ino);
-	if (IS_ERR(inode)) {
-		ret = PTR_ERR(inode);
+	ret = ouichefs_journal_ifree(handle, sb, ino, false);
+	if (ret)
+		goto put_ino;
+	inode = new_inode(sb);
+	if (!inode) {
+		ret = -ENOMEM;
+		goto put_ino;
+	}
+	inode->i_ino = ino;
+	ret = insert_inode_locked(inode);
+	if (ret) {
+		/* The previous user of ino is still being evicted */
+		make_bad_inode(inode);
+		iput(inode);
 		goto put_ino;
 	}
 	ci = OUICHEFS_INODE(inode);
 
 	/* Get a free block for this new inode's index */
-	bno = get_free_block(sbi);
-	if (!bno) {
-		ret = -ENOSPC;
-		goto put_inode;
+	bno = 0;
+	if (index) {
+		bno = get_free_block(sbi);
+		if (!bno) {
+			ret = -ENOSPC;
+			goto put_inode;
+		}
+		ret = ouichefs_journal_bfree(handle, sb, bno, 1, false);
+		if (ret) {
+			put_block(sbi, bno);
+			goto put_inode;
+		}
 	}
 	ci->index_block = bno;
 
 	/* Initialize inode */
 	inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
-	inode->i_blocks = 1;
+	inode->i_op = &ouichefs_inode_ops;
+	inode->i_blocks = index ? 1 : 0;
+	/* Files and directories created in a compressed directory are too */
+	ci->flags = 0;
+	if (!S_ISLNK(mode) && ouichefs_clusters_fit(sb))
+		ci->flags = OUICHEFS_INODE(dir)->flags & OUICHEFS_INODE_COMPRESS;
+	ci->ext_start = 0;
+	ci->ext_len = 0;
 	if (S_ISDIR(mode)) {
-		inode->i_size = OUICHEFS_BLOCK_SIZE;
+		inode->i_size = sb->s_blocksize;
 		inode->i_fop = &ouichefs_dir_ops;
 		set_nlink(inode, 2); /* . and .. */
 	} else if (S_ISREG(mode)) {
@@ -196,6 +434,20 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 		inode->i_fop = &ouichefs_file_ops;
 		inode->i_mapping->a_ops = &ouichefs_aops;
 		set_nlink(inode, 1);
+		/*
+		 * Small files live in their index block until they grow,
+		 * unless written back in clusters
+		 */
+		if ((sbi->features & OUICHEFS_FEATURE_INLINE_DATA) &&
+		    !ouichefs_is_clustered(inode))
+			ci->flags |= OUICHEFS_INODE_INLINE;
+	} else if (S_ISLNK(mode)) {
+		inode->i_size = 0;
+		inode->i_op = &simple_symlink_inode_operations;
+		set_nlink(inode, 1);
+		/* The target is stored in the index block, if any */
+		if (index)
+			ci->flags |= OUICHEFS_INODE_INLINE;
 	}
 
 	inode->i_ctime = inode->i_atime = inode->i_mtime = current_time(inode);
@@ -203,22 +455,24 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	return inode;
 
 put_inode:
-	iput(inode);
+	clear_nlink(inode);
+	discard_new_inode(inode);
 put_ino:
+	ouichefs_journal_ifree(handle, sb, ino, true);
 	put_inode(sbi, ino);
 
 	return ERR_PTR(ret);
 }
 
 /*
- * Create a file or directory in this way:
+ * Create a file, directory or symlink to symname in this way:
  *   - check filename length and if the parent directory is not full
  *   - create the new inode (allocate inode and blocks)
- *   - cleanup index block of the new inode
+ *   - cleanup index block of the new inode, store the symlink target there
  *   - add new file/directory in parent index
  */
-static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
-			   struct dentry *dentry, umode_t mode, bool excl)
+static int ouichefs_create_entry(struct inode *dir, struct dentry *dentry,
+				 umode_t mode, const char *symname)
 {
 	struct super_block *sb;
 	struct inode *inode;
@@ -226,55 +480,92 @@ static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
 	struct ouichefs_dir_block *dblock;
 	char *fblock;
 	struct buffer_head *bh, *bh2;
+	handle_t *handle;
+	uint32_t bno;
+	bool index;
 	int ret = 0, i;
 
 	/* Check filename length */
 	if (strlen(dentry->d_name.name) > OUICHEFS_FILENAME_LEN)
 		return -ENAMETOOLONG;
 
-	/* Read parent directory index */
 	ci_dir = OUICHEFS_INODE(dir);
 	sb = dir->i_sb;
-	bh = sb_bread(sb, ci_dir->index_block);
-	if (!bh)
-		return -EIO;
+	/* Short symlink targets fit in compact inodes */
+	index = !symname || !ouichefs_compact_inodes(OUICHEFS_SB(sb)) ||
+		strlen(symname) > OUICHEFS_INODE_V2_INLINE;
+	handle = ouichefs_journal_start(sb, OUICHEFS_CREATE_CREDITS, 0);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	/* Read parent directory index */
+	bh = ouichefs_bread(sb, ci_dir->index_block);
+	if (!bh) {
+		ret = -EIO;
+		goto stop;
+	}
 	dblock = (struct ouichefs_dir_block *)bh->b_data;
 
 	/* Check if parent directory is full */
-	if (dblock->files[OUICHEFS_MAX_SUBFILES - 1].inode != 0) {
+	if (dblock->files[OUICHEFS_MAX_SUBFILES(sb) - 1].inode != 0) {
 		ret = -EMLINK;
 		goto end;
 	}
+	ret = ouichefs_journal_get_write_access(handle, bh);
+	if (ret)
+		goto end;
 
 	/* Get a new free inode */
-	inode = ouichefs_new_inode(dir, mode);
+	inode = ouichefs_new_inode(handle, dir, mode, index);
 	if (IS_ERR(inode)) {
 		ret = PTR_ERR(inode);
 		goto end;
 	}
+	if (symname) {
+		inode->i_size = strlen(symname);
+		inode->i_link = kstrdup(symname, GFP_NOFS);
+		if (!inode->i_link) {
+			ret = -ENOMEM;
+			goto iput;
+		}
+	}
 
 	/*
 	 * Scrub index_block for new file/directory to avoid previous data
 	 * messing with new file/directory.
 	 */
-	bh2 = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
-	if (!bh2) {
-		ret = -EIO;
-		goto iput;
+	if (index) {
+		/* Its previous content is overwritten, no need to read it */
+		bh2 = ouichefs_getblk(sb, OUICHEFS_INODE(inode)->index_block);
+		if (!bh2) {
+			ret = -ENOMEM;
+			goto iput;
+		}
+		lock_buffer(bh2);
+		ret = ouichefs_journal_get_create_access(handle, bh2);
+		if (ret) {
+			unlock_buffer(bh2);
+			brelse(bh2);
+			goto iput;
+		}
+		fblock = (char *)bh2->b_data;
+		memset(fblock, 0, sb->s_blocksize);
+		if (symname)
+			memcpy(fblock, symname, inode->i_size);
+		set_buffer_uptodate(bh2);
+		unlock_buffer(bh2);
+		ouichefs_journal_dirty(handle, bh2);
+		brelse(bh2);
 	}
-	fblock = (char *)bh2->b_data;
-	memset(fblock, 0, OUICHEFS_BLOCK_SIZE);
-	mark_buffer_dirty(bh2);
-	brelse(bh2);
 
 	/* Find first free slot in parent index and register new inode */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++)
+	for (i = 0; i < OUICHEFS_MAX_SUBFILES(sb); i++)
 		if (dblock->files[i].inode == 0)
 			break;
 	dblock->files[i].inode = inode->i_ino;
 	strscpy(dblock->files[i].filename, dentry->d_name.name,
 		OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh);
+	ouichefs_journal_dirty(handle, bh);
 	brelse(bh);
 
 	/* Update stats and mark dir and new inode dirty */
@@ -284,49 +575,86 @@ static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
 		inode_inc_link_count(dir);
 	mark_inode_dirty(dir);
 
-	/* setup dentry */
-	d_instantiate(dentry, inode);
+	/* setup dentry and make the inode usable */
+	d_instantiate_new(dentry, inode);
 
-	return 0;
+	return ouichefs_journal_stop(handle);
 
 iput:
-	put_block(OUICHEFS_SB(sb), OUICHEFS_INODE(inode)->index_block);
+	bno = OUICHEFS_INODE(inode)->index_block;
+	if (bno) {
+		ouichefs_journal_bfree(handle, sb, bno, 1, true);
+		put_block(OUICHEFS_SB(sb), bno);
+	}
+	ouichefs_journal_ifree(handle, sb, inode->i_ino, true);
 	put_inode(OUICHEFS_SB(sb), inode->i_ino);
-	iput(inode);
+	clear_nlink(inode);
+	discard_new_inode(inode);
 end:
 	brelse(bh);
+stop:
+	ouichefs_journal_stop(handle);
 	return ret;
 }
 
 /*
  * Remove a link for a file. If link count is 0, destroy file in this way:
- *   - remove the file from its parent directory.
- *   - cleanup blocks containing data
- *   - cleanup file index block
- *   - cleanup inode
+ *   - put the file on the orphan list
+ *   - remove the file from its parent directory
+ * Blocks containing data, the file index block and the inode are released
+ * in the background once the last reference to the inode is dropped.
  */
 static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 {
 	struct super_block *sb = dir->i_sb;
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct inode *inode = d_inode(dentry);
-	struct buffer_head *bh = NULL, *bh2 = NULL;
+	struct buffer_head *bh = NULL;
 	struct ouichefs_dir_block *dir_block = NULL;
-	struct ouichefs_file_index_block *file_block = NULL;
-	uint32_t ino, bno;
-	int i, f_id = -1, nr_subs = 0;
+	handle_t *handle;
+	uint32_t ino;
+	int i, f_id = -1, nr_subs = 0, ret;
 
 	ino = inode->i_ino;
-	bno = OUICHEFS_INODE(inode)->index_block;
+
+	/*
+	 * rmtree_pass() removes the entries of a whole batch from the directory
+	 * block and puts their inodes on the orphan list itself, in a single
+	 * handle: only drop the links here, they are written with the entries.
+	 */
+	if (OUICHEFS_INODE(dir)->rmtree) {
+		dir->i_mtime = dir->i_atime = dir->i_ctime = current_time(dir);
+		inode->i_ctime = dir->i_ctime;
+		if (S_ISDIR(inode->i_mode)) {
+			drop_nlink(dir);
+			clear_nlink(inode);
+		} else {
+			drop_nlink(inode);
+		}
+		return 0;
+	}
+
+	handle = ouichefs_journal_start(sb, OUICHEFS_UNLINK_CREDITS, 0);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
 
 	/* Read parent directory index */
-	bh = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
-	if (!bh)
-		return -EIO;
+	bh = ouichefs_bread(sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh) {
+		ret = -EIO;
+		goto stop;
+	}
 	dir_block = (struct ouichefs_dir_block *)bh->b_data;
+	ret = ouichefs_journal_get_write_access(handle, bh);
+	if (ret)
+		goto brelse;
+
+	/* Record the inode as orphan before it disappears from its parent */
+	ret = ouichefs_orphan_add(handle, inode);
+	if (ret)
+		goto brelse;
 
 	/* Search for inode in parent index and get number of subfiles */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+	for (i = 0; i < OUICHEFS_MAX_SUBFILES(sb); i++) {
 		if (dir_block->files[i].inode == ino)
 			f_id = i;
 		else if (dir_block->files[i].inode == 0)
@@ -335,11 +663,11 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 	nr_subs = i;
 
 	/* Remove file from parent directory */
-	if (f_id != OUICHEFS_MAX_SUBFILES - 1)
+	if (f_id != OUICHEFS_MAX_SUBFILES(sb) - 1)
 		memmove(dir_block->files + f_id, dir_block->files + f_id + 1,
 			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
 	memset(&dir_block->files[nr_subs - 1], 0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh);
+	ouichefs_journal_dirty(handle, bh);
 	brelse(bh);
 
 	/* Update inode stats */
@@ -348,60 +676,20 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 		inode_dec_link_count(dir);
 	mark_inode_dirty(dir);
 
-	/*
-	 * Cleanup pointed blocks if unlinking a file. If we fail to read the
-	 * index block, cleanup inode anyway and lose this file's blocks
-	 * forever. If we fail to scrub a data block, don't fail (too late
-	 * anyway), just put the block and continue.
-	 */
-	bh = sb_bread(sb, bno);
-	if (!bh)
-		goto clean_inode;
-	file_block = (struct ouichefs_file_index_block *)bh->b_data;
+	inode->i_ctime = dir->i_ctime;
 	if (S_ISDIR(inode->i_mode))
-		goto scrub;
-	for (i = 0; i < inode->i_blocks - 1; i++) {
-		char *block;
-
-		if (!file_block->blocks[i])
-			continue;
-
-		put_block(sbi, file_block->blocks[i]);
-		bh2 = sb_bread(sb, file_block->blocks[i]);
-		if (!bh2)
-			continue;
-		block = (char *)bh2->b_data;
-		memset(block, 0, OUICHEFS_BLOCK_SIZE);
-		mark_buffer_dirty(bh2);
-		brelse(bh2);
-	}
-
-scrub:
-	/* Scrub index block */
-	memset(file_block, 0, OUICHEFS_BLOCK_SIZE);
-	mark_buffer_dirty(bh);
-	brelse(bh);
-
-clean_inode:
-	/* Cleanup inode and mark dirty */
-	inode->i_blocks = 0;
-	OUICHEFS_INODE(inode)->index_block = 0;
-	inode->i_size = 0;
-	i_uid_write(inode, 0);
-	i_gid_write(inode, 0);
-	inode->i_mode = 0;
-	inode->i_ctime.tv_sec = inode->i_mtime.tv_sec = inode->i_atime.tv_sec =
-		0;
-	inode->i_ctime.tv_nsec = inode->i_mtime.tv_nsec = inode->i_atime.tv_nsec =
-		0;
-	inode_dec_link_count(inode);
+		clear_nlink(inode);
+	else
+		drop_nlink(inode);
 	mark_inode_dirty(inode);
 
-	/* Free inode and index block from bitmap */
-	put_block(sbi, bno);
-	put_inode(sbi, ino);
+	return ouichefs_journal_stop(handle);
 
-	return 0;
+brelse:
+	brelse(bh);
+stop:
+	ouichefs_journal_stop(handle);
+	return ret;
 }
 
 static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
@@ -414,6 +702,7 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 	struct inode *src = d_inode(old_dentry);
 	struct buffer_head *bh_old = NULL, *bh_new = NULL;
 	struct ouichefs_dir_block *dir_block = NULL;
+	handle_t *handle;
 	int i, f_id = -1, new_pos = -1, ret, nr_subs, f_pos = -1;
 
 	/* fail with these unsupported flags */
@@ -424,12 +713,18 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 	if (strlen(new_dentry->d_name.name) > OUICHEFS_FILENAME_LEN)
 		return -ENAMETOOLONG;
 
+	handle = ouichefs_journal_start(sb, OUICHEFS_RENAME_CREDITS, 0);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
 	/* Fail if new_dentry exists or if new_dir is full */
-	bh_new = sb_bread(sb, ci_new->index_block);
-	if (!bh_new)
-		return -EIO;
+	bh_new = ouichefs_bread(sb, ci_new->index_block);
+	if (!bh_new) {
+		ret = -EIO;
+		goto stop;
+	}
 	dir_block = (struct ouichefs_dir_block *)bh_new->b_data;
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+	for (i = 0; i < OUICHEFS_MAX_SUBFILES(sb); i++) {
 		/* if old_dir == new_dir, save the renamed file position */
 		if (new_dir == old_dir) {
 			if (strncmp(dir_block->files[i].filename,
@@ -446,12 +741,15 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 		if (new_pos < 0 && dir_block->files[i].inode == 0)
 			new_pos = i;
 	}
+	ret = ouichefs_journal_get_write_access(handle, bh_new);
+	if (ret)
+		goto relse_new;
+
 	/* if old_dir == new_dir, just rename entry */
 	if (old_dir == new_dir) {
 		strscpy(dir_block->files[f_pos].filename,
 			new_dentry->d_name.name, OUICHEFS_FILENAME_LEN);
-		mark_buffer_dirty(bh_new);
-		ret = 0;
+		ret = ouichefs_journal_dirty(handle, bh_new);
 		goto relse_new;
 	}
 
@@ -461,11 +759,21 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 		goto relse_new;
 	}
 
+	/* Read old parent directory before modifying anything */
+	bh_old = ouichefs_bread(sb, ci_old->index_block);
+	if (!bh_old) {
+		ret = -EIO;
+		goto relse_new;
+	}
+	ret = ouichefs_journal_get_write_access(handle, bh_old);
+	if (ret)
+		goto relse_old;
+
 	/* insert in new parent directory */
 	dir_block->files[new_pos].inode = src->i_ino;
 	strscpy(dir_block->files[new_pos].filename, new_dentry->d_name.name,
 		OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh_new);
+	ouichefs_journal_dirty(handle, bh_new);
 	brelse(bh_new);
 
 	/* Update new parent inode metadata */
@@ -476,12 +784,9 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 	mark_inode_dirty(new_dir);
 
 	/* remove target from old parent directory */
-	bh_old = sb_bread(sb, ci_old->index_block);
-	if (!bh_old)
-		return -EIO;
 	dir_block = (struct ouichefs_dir_block *)bh_old->b_data;
 	/* Search for inode in old directory and number of subfiles */
-	for (i = 0; OUICHEFS_MAX_SUBFILES; i++) {
+	for (i = 0; i < OUICHEFS_MAX_SUBFILES(sb); i++) {
 		if (dir_block->files[i].inode == src->i_ino)
 			f_id = i;
 		else if (dir_block->files[i].inode == 0)
@@ -490,11 +795,11 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 	nr_subs = i;
 
 	/* Remove file from old parent directory */
-	if (f_id != OUICHEFS_MAX_SUBFILES - 1)
+	if (f_id != OUICHEFS_MAX_SUBFILES(sb) - 1)
 		memmove(dir_block->files + f_id, dir_block->files + f_id + 1,
 			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
 	memset(&dir_block->files[nr_subs - 1], 0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh_old);
+	ouichefs_journal_dirty(handle, bh_old);
 	brelse(bh_old);
 
 	/* Update old parent inode metadata */
@@ -504,48 +809,342 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 		inode_dec_link_count(old_dir);
 	mark_inode_dirty(old_dir);
 
-	return 0;
+	return ouichefs_journal_stop(handle);
 
+relse_old:
+	brelse(bh_old);
 relse_new:
 	brelse(bh_new);
+stop:
+	ouichefs_journal_stop(handle);
 	return ret;
 }
 
+static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
+			   struct dentry *dentry, umode_t mode, bool excl)
+{
+	return ouichefs_create_entry(dir, dentry, mode, NULL);
+}
+
+/*
+ * Create a symlink to symname. The target is kept in the index block, and
+ * in memory in i_link from the time the inode is read.
+ */
+static int ouichefs_symlink(struct mnt_idmap *idmap, struct inode *dir,
+			    struct dentry *dentry, const char *symname)
+{
+	if (strlen(symname) >= dir->i_sb->s_blocksize)
+		return -ENAMETOOLONG;
+
+	return ouichefs_create_entry(dir, dentry, S_IFLNK | 0777, symname);
+}
+
 static int ouichefs_mkdir(struct mnt_idmap *idmap, struct inode *dir,
 			  struct dentry *dentry, umode_t mode)
 {
 	return ouichefs_create(NULL, dir, dentry, mode | S_IFDIR, 0);
 }
 
-static int ouichefs_rmdir(struct inode *dir, struct dentry *dentry)
+/*
+ * Return 0 if directory inode is empty, -ENOTEMPTY if not.
+ */
+static int ouichefs_dir_empty(struct inode *inode)
 {
-	struct super_block *sb = dir->i_sb;
-	struct inode *inode = d_inode(dentry);
 	struct buffer_head *bh;
 	struct ouichefs_dir_block *dblock;
+	int ret = 0;
 
-	/* If the directory is not empty, fail */
 	if (inode->i_nlink > 2)
 		return -ENOTEMPTY;
-	bh = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
+	bh = ouichefs_bread(inode->i_sb, OUICHEFS_INODE(inode)->index_block);
 	if (!bh)
 		return -EIO;
 	dblock = (struct ouichefs_dir_block *)bh->b_data;
-	if (dblock->files[0].inode != 0) {
-		brelse(bh);
-		return -ENOTEMPTY;
-	}
+	if (dblock->files[0].inode != 0)
+		ret = -ENOTEMPTY;
 	brelse(bh);
 
+	return ret;
+}
+
+static int ouichefs_rmdir(struct inode *dir, struct dentry *dentry)
+{
+	int ret;
+
+	/* If the directory is not empty, fail */
+	ret = ouichefs_dir_empty(d_inode(dentry));
+	if (ret)
+		return ret;
+
 	/* Remove directory with unlink */
 	return ouichefs_unlink(dir, dentry);
 }
 
+/*
+ * Write the removal of the nr inodes of removed, unlinked from directory dir
+ * by rmtree_pass(), in a single handle: put them on the orphan list, then
+ * drop their entries from the directory block at once. removed follows the
+ * order of the entries. An inode that cannot be put on the orphan list keeps
+ * its entry.
+ */
+static int rmtree_commit(struct inode *dir, struct inode **removed, int nr)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh;
+	handle_t *handle;
+	int i, j = 0, n = 0, ret, err;
+
+	handle = ouichefs_journal_start(sb, OUICHEFS_RMTREE_CREDITS, 0);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	bh = ouichefs_bread(sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh) {
+		ret = -EIO;
+		goto stop;
+	}
+	ret = ouichefs_journal_get_write_access(handle, bh);
+	if (ret)
+		goto brelse;
+
+	/* Orphan the removed inodes and keep the other entries, in order */
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+	for (i = 0; i < OUICHEFS_MAX_SUBFILES(sb) && dblock->files[i].inode;
+	     i++) {
+		if (j < nr && dblock->files[i].inode == removed[j]->i_ino) {
+			err = ouichefs_orphan_add(handle, removed[j]);
+			if (!err) {
+				mark_inode_dirty(removed[j++]);
+				continue;
+			}
+			pr_err("failed removing inode %lu (%d)\n",
+			       removed[j++]->i_ino, err);
+			ret = err;
+		}
+		dblock->files[n++] = dblock->files[i];
+	}
+	memset(dblock->files + n, 0, (i - n) * sizeof(struct ouichefs_file));
+	err = ouichefs_journal_dirty(handle, bh);
+	if (err && !ret)
+		ret = err;
+	mark_inode_dirty(dir);
+
+brelse:
+	brelse(bh);
+stop:
+	ouichefs_journal_stop(handle);
+	return ret;
+}
+
+/*
+ * Unlink child from dir for rmtree_pass(), holding a reference to its inode if
+ * it succeeds.
+ */
+static int rmtree_unlink(struct mnt_idmap *idmap, struct inode *dir,
+			 struct dentry *child, bool force)
+{
+	struct inode *inode = d_inode(child);
+	int ret;
+
+	if (force) {
+		inode_lock_nested(inode, I_MUTEX_CHILD);
+		inode->i_flags &= ~S_IMMUTABLE;
+		inode_unlock(inode);
+	}
+
+	ihold(inode);
+	if (S_ISDIR(inode->i_mode))
+		ret = vfs_rmdir(idmap, dir, child);
+	else
+		ret = vfs_unlink(idmap, dir, child, NULL);
+	if (ret)
+		iput(inode);
+
+	return ret;
+}
+
+/*
+ * Remove all the entries of directory dentry that can be removed right away:
+ * files and empty subdirectories. Removals go through vfs_unlink() and
+ * vfs_rmdir(), so that permissions, security modules and fsnotify see each
+ * of them, but they only update the inodes in memory: the entries are then
+ * dropped from the directory block and put on the orphan list by batches of
+ * OUICHEFS_RMTREE_BATCH, one handle each. The first non-empty subdirectory is
+ * returned in *next, with a reference held, so that the caller empties it
+ * first. Must be called with the directory locked. If force is true, the
+ * tree is a snapshot being deleted, whose inodes lose S_IMMUTABLE so that
+ * they can be removed.
+ */
+static int rmtree_pass(struct mnt_idmap *idmap, struct dentry *dentry,
+		       struct dentry **next, bool force)
+{
+	struct inode *dir = d_inode(dentry);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_block *dblock;
+	struct dentry **batch;
+	struct inode **removed, *inode;
+	struct buffer_head *bh;
+	int i, nr, nr_removed, kept = 0, ret = 0, err;
+
+	*next = NULL;
+	if (force)
+		dir->i_flags &= ~S_IMMUTABLE;
+
+	batch = kmalloc_array(OUICHEFS_RMTREE_BATCH, sizeof(*batch),
+			      GFP_KERNEL);
+	removed = kmalloc_array(OUICHEFS_RMTREE_BATCH, sizeof(*removed),
+				GFP_KERNEL);
+	if (!batch || !removed) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	do {
+		/*
+		 * Look up the next batch of entries. The entries kept so far
+		 * come first, as removals keep the order of the others.
+		 */
+		bh = ouichefs_bread(sb, ci->index_block);
+		if (!bh) {
+			ret = -EIO;
+			break;
+		}
+		dblock = (struct ouichefs_dir_block *)bh->b_data;
+		for (i = kept, nr = 0; i < OUICHEFS_MAX_SUBFILES(sb) &&
+				       dblock->files[i].inode &&
+				       nr < OUICHEFS_RMTREE_BATCH;
+		     i++) {
+			struct ouichefs_file *f = &dblock->files[i];
+			struct dentry *child;
+
+			child = lookup_one_len(f->filename, dentry,
+					       strnlen(f->filename,
+						       OUICHEFS_FILENAME_LEN));
+			if (IS_ERR(child)) {
+				ret = PTR_ERR(child);
+				break;
+			}
+			if (d_is_negative(child)) {
+				dput(child);
+				kept++;
+				continue;
+			}
+			batch[nr++] = child;
+		}
+		brelse(bh);
+
+		/* Unlink the batch in memory, holding the unlinked inodes */
+		ci->rmtree = true;
+		for (i = 0, nr_removed = 0; i < nr; i++) {
+			inode = d_inode(batch[i]);
+			err = ret ? ret :
+				    rmtree_unlink(idmap, dir, batch[i], force);
+			if (!err) {
+				removed[nr_removed++] = inode;
+			} else if (!ret) {
+				kept++;
+				if (err != -ENOTEMPTY)
+					ret = err;
+				else if (!*next)
+					*next = dget(batch[i]);
+			}
+			dput(batch[i]);
+		}
+		ci->rmtree = false;
+
+		if (nr_removed) {
+			err = rmtree_commit(dir, removed, nr_removed);
+			if (err && !ret)
+				ret = err;
+		}
+		for (i = 0; i < nr_removed; i++)
+			iput(removed[i]);
+	} while (!ret && nr == OUICHEFS_RMTREE_BATCH);
+
+free:
+	kfree(removed);
+	kfree(batch);
+
+	return ret;
+}
+
+/*
+ * Remove everything below directory top, which is left empty. The tree is
+ * walked depth-first without recursion: a directory is emptied of its files
+ * and empty subdirectories in one pass, then its first non-empty
+ * subdirectory is emptied the same way, after which the parent is visited
+ * again to remove it.
+ */
+int ouichefs_rmtree(struct mnt_idmap *idmap, struct dentry *top, bool force)
+{
+	struct dentry **stack = NULL, **tmp, *cur = dget(top), *next;
+	struct dentry *done = NULL;
+	int depth = 0, max = 0, ret;
+
+	for (;;) {
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		inode_lock_nested(d_inode(cur), I_MUTEX_PARENT);
+		ret = rmtree_pass(idmap, cur, &next, force);
+		inode_unlock(d_inode(cur));
+		/* The subdirectory just emptied is still not empty: give up */
+		if (!ret && next && next == done)
+			ret = -ENOTEMPTY;
+		dput(done);
+		done = NULL;
+		if (ret) {
+			dput(next);
+			break;
+		}
+
+		if (next) {
+			/* Empty this subdirectory, then come back */
+			if (depth == max) {
+				max = max ? max * 2 : 16;
+				tmp = krealloc_array(stack, max, sizeof(*stack),
+						     GFP_KERNEL);
+				if (!tmp) {
+					dput(next);
+					ret = -ENOMEM;
+					break;
+				}
+				stack = tmp;
+			}
+			stack[depth++] = cur;
+			cur = next;
+		} else if (depth) {
+			/* cur is empty, its parent can now remove it */
+			done = cur;
+			cur = stack[--depth];
+		} else {
+			break;
+		}
+
+		cond_resched();
+	}
+
+	dput(done);
+	dput(cur);
+	while (depth)
+		dput(stack[--depth]);
+	kfree(stack);
+
+	return ret;
+}
+
 static const struct inode_operations ouichefs_inode_ops = {
 	.lookup = ouichefs_lookup,
 	.create = ouichefs_create,
 	.unlink = ouichefs_unlink,
 	.mkdir = ouichefs_mkdir,
+	.symlink = ouichefs_symlink,
 	.rmdir = ouichefs_rmdir,
 	.rename = ouichefs_rename,
+	.fileattr_get = ouichefs_fileattr_get,
+	.fileattr_set = ouichefs_fileattr_set,
 };
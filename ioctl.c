@@ -0,0 +1,408 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/uaccess.h>
+#include <linux/mount.h>
+#include <linux/fileattr.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/* Largest chunk of a free run reserved and discarded at once by FITRIM */
+#define OUICHEFS_TRIM_MAX_RUN 1024
+
+static int cmp_stat_ino(const void *a, const void *b)
+{
+	const struct ouichefs_stat *sa = *(const struct ouichefs_stat **)a;
+	const struct ouichefs_stat *sb = *(const struct ouichefs_stat **)b;
+
+	if (sa->ino < sb->ino)
+		return -1;
+	return sa->ino > sb->ino;
+}
+
+/*
+ * Fill st from the inode-store record raw.
+ */
+static void fill_stat_disk(struct super_block *sb, struct ouichefs_stat *st,
+			   const void *raw)
+{
+	struct ouichefs_inode di;
+	struct timespec64 ctime, atime, mtime;
+
+	ouichefs_load_inode(sb, raw, &di);
+	ouichefs_load_times(sb, raw, &ctime, &atime, &mtime);
+	st->mode = le32_to_cpu(di.i_mode);
+	st->size = le32_to_cpu(di.i_size);
+	st->mtime = mtime.tv_sec;
+	st->mtime_nsec = mtime.tv_nsec;
+}
+
+/*
+ * Fill st from an inode already present in the inode cache. This inode may be
+ * more recent than its inode-store record.
+ */
+static void fill_stat_inode(struct ouichefs_stat *st, struct inode *inode)
+{
+	st->mode = inode->i_mode;
+	st->size = i_size_read(inode);
+	st->mtime = inode->i_mtime.tv_sec;
+	st->mtime_nsec = inode->i_mtime.tv_nsec;
+}
+
+/*
+ * Return the name, inode number, mode, size and mtime of up to bs.count
+ * entries of directory dir, starting at entry bs.pos, without instantiating
+ * their inodes. Entries are sorted by inode number, i.e. by inode-store
+ * block, so that each inode-store block is read at most once per call.
+ */
+static long ouichefs_ioc_bulkstat(struct file *dir,
+				  struct ouichefs_bulkstat __user *arg)
+{
+	struct inode *inode = file_inode(dir);
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_bulkstat bs;
+	struct ouichefs_stat *stats = NULL, **order = NULL;
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh = NULL;
+	long ret = 0;
+	int i, nr = 0;
+
+	if (!S_ISDIR(inode->i_mode))
+		return -ENOTDIR;
+	if (copy_from_user(&bs, arg, sizeof(bs)))
+		return -EFAULT;
+	if (bs.pos >= OUICHEFS_MAX_SUBFILES(sb) || !bs.count)
+		goto out;
+	bs.count = min_t(__u32, bs.count, OUICHEFS_MAX_SUBFILES(sb) - bs.pos);
+
+	stats = kcalloc(bs.count, sizeof(*stats), GFP_KERNEL);
+	order = kmalloc_array(bs.count, sizeof(*order), GFP_KERNEL);
+	if (!stats || !order) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	/* Collect names and inode numbers from the directory block */
+	inode_lock_shared(inode);
+	bh = ouichefs_bread(sb, ci->index_block);
+	if (!bh) {
+		inode_unlock_shared(inode);
+		ret = -EIO;
+		goto free;
+	}
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+	for (i = bs.pos; i < OUICHEFS_MAX_SUBFILES(sb) && nr < bs.count; i++) {
+		if (!dblock->files[i].inode)
+			break;
+		stats[nr].ino = dblock->files[i].inode;
+		memcpy(stats[nr].name, dblock->files[i].filename,
+		       OUICHEFS_FILENAME_LEN);
+		order[nr] = &stats[nr];
+		nr++;
+	}
+	brelse(bh);
+	bh = NULL;
+	inode_unlock_shared(inode);
+
+	/* Visit inodes in inode-store order */
+	sort(order, nr, sizeof(*order), cmp_stat_ino, NULL);
+	for (i = 0; i < nr; i++) {
+		struct ouichefs_stat *st = order[i];
+		uint32_t inode_block = ouichefs_inode_block(sbi, st->ino);
+		struct inode *child;
+
+		child = ilookup(sb, st->ino);
+		if (child) {
+			fill_stat_inode(st, child);
+			iput(child);
+			continue;
+		}
+
+		if (!bh || bh->b_blocknr != inode_block) {
+			brelse(bh);
+			bh = ouichefs_bread(sb, inode_block);
+			if (!bh) {
+				ret = -EIO;
+				goto free;
+			}
+		}
+		fill_stat_disk(sb, st,
+			       bh->b_data + ouichefs_inode_offset(sbi, st->ino));
+	}
+	brelse(bh);
+
+	if (copy_to_user(u64_to_user_ptr(bs.buf), stats,
+			 nr * sizeof(*stats))) {
+		ret = -EFAULT;
+		goto free;
+	}
+	bs.pos += nr;
+out:
+	bs.count = nr;
+	if (copy_to_user(arg, &bs, sizeof(bs)))
+		ret = -EFAULT;
+free:
+	kfree(order);
+	kfree(stats);
+
+	return ret;
+}
+
+/*
+ * Discard free blocks in the byte range given by arg, ignoring runs of free
+ * blocks shorter than range.minlen. Each run is measured whole, then taken
+ * out of the free bitmap in chunks of at most OUICHEFS_TRIM_MAX_RUN blocks
+ * while they are being discarded, so that they cannot be allocated and
+ * written meanwhile. On return, range.len holds the number of bytes
+ * discarded. If interrupted, -EINTR is returned and range.start points to
+ * the first byte not examined yet, so that the caller can resume from there.
+ */
+static long ouichefs_ioc_fitrim(struct file *file,
+				struct fstrim_range __user *arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	unsigned char bits = sb->s_blocksize_bits;
+	struct fstrim_range range;
+	uint64_t bno, end, first, run, run_end = 0, minlen, trimmed = 0;
+	uint32_t len;
+	long ret = 0;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	/* Zones are reset whole rather than discarded */
+	if (!bdev_max_discard_sectors(sb->s_bdev) || ouichefs_is_zoned(sbi))
+		return -EOPNOTSUPP;
+	if (copy_from_user(&range, arg, sizeof(range)))
+		return -EFAULT;
+
+	if (range.start >= (sbi->blocks_count << bits))
+		return -EINVAL;
+	bno = range.start >> bits;
+	if (range.len >= (sbi->blocks_count << bits) - range.start)
+		end = sbi->blocks_count;
+	else
+		end = (range.start + range.len) >> bits;
+	minlen = max_t(uint64_t, range.minlen,
+		       bdev_discard_granularity(sb->s_bdev)) >> bits;
+	minlen = max_t(uint64_t, minlen, 1);
+
+	while (bno < end) {
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		cond_resched();
+
+		/* Measure the next free run before discarding any of it */
+		if (bno >= run_end) {
+			run = free_block_run(sbi, bno, end, &first);
+			if (!run) {
+				bno = end;
+				break;
+			}
+			run_end = first + run;
+			bno = run < minlen ? run_end : first;
+			continue;
+		}
+
+		len = reserve_block_range(sbi, bno, run_end,
+					  OUICHEFS_TRIM_MAX_RUN, &first);
+		if (!len) {
+			bno = run_end;
+			continue;
+		}
+		ret = ouichefs_issue_discard(sb, first, len, false);
+		if (!ret)
+			trimmed += len;
+		put_block_range(sbi, first, len);
+		bno = first + len;
+		if (ret)
+			break;
+	}
+
+	range.start = bno << bits;
+	range.len = trimmed << bits;
+	if (copy_to_user(arg, &range, sizeof(range)))
+		return -EFAULT;
+
+	return ret;
+}
+
+/*
+ * Remove the whole subtree below directory file in a single call.
+ */
+static long ouichefs_ioc_rmtree(struct file *file)
+{
+	long ret;
+
+	if (!S_ISDIR(file_inode(file)->i_mode))
+		return -ENOTDIR;
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+	ret = ouichefs_rmtree(file_mnt_idmap(file), file->f_path.dentry,
+			      false);
+	mnt_drop_write_file(file);
+
+	return ret;
+}
+
+/*
+ * Create or delete the snapshot named by arg in directory file.
+ */
+static long ouichefs_ioc_snapshot(struct file *file, unsigned int cmd,
+				  struct ouichefs_snapshot __user *arg)
+{
+	struct ouichefs_snapshot snap;
+	char name[OUICHEFS_FILENAME_LEN + 1];
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&snap, arg, sizeof(snap)))
+		return -EFAULT;
+	memcpy(name, snap.name, OUICHEFS_FILENAME_LEN);
+	name[OUICHEFS_FILENAME_LEN] = '\0';
+
+	if (cmd == OUICHEFS_IOC_SNAPSHOT_CREATE)
+		return ouichefs_snapshot_create(file, name);
+	return ouichefs_snapshot_delete(file, name);
+}
+
+/*
+ * Write the buffer described by arg at its offset in file, all or nothing.
+ */
+static long ouichefs_ioc_atomic_write(struct file *file,
+				      struct ouichefs_atomic_write __user *arg)
+{
+	struct ouichefs_atomic_write aw;
+	long ret;
+
+	if (!S_ISREG(file_inode(file)->i_mode))
+		return -EINVAL;
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (copy_from_user(&aw, arg, sizeof(aw)))
+		return -EFAULT;
+	if (aw.flags)
+		return -EINVAL;
+	if (aw.offset > OUICHEFS_MAX_FILESIZE(file_inode(file)->i_sb))
+		return -EFBIG;
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+	ret = ouichefs_atomic_write(file, aw.offset, u64_to_user_ptr(aw.buf),
+				    aw.len);
+	mnt_drop_write_file(file);
+
+	return ret;
+}
+
+/*
+ * Report compression (FS_COMPR_FL), and the immutability of snapshots.
+ */
+int ouichefs_fileattr_get(struct dentry *dentry, struct fileattr *fa)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(d_inode(dentry));
+	u32 flags = 0;
+
+	if (ci->flags & OUICHEFS_INODE_COMPRESS)
+		flags |= FS_COMPR_FL;
+	if (ci->flags & OUICHEFS_INODE_SNAPSHOT)
+		flags |= FS_IMMUTABLE_FL;
+	fileattr_fill_flags(fa, flags);
+
+	return 0;
+}
+
+/*
+ * Only compression can be changed (chattr +c or -c). On a directory, it
+ * applies to the files and directories created in it afterwards. A regular
+ * file must be empty, since its blocks are not converted. Called with the
+ * inode locked.
+ */
+int ouichefs_fileattr_set(struct mnt_idmap *idmap, struct dentry *dentry,
+			  struct fileattr *fa)
+{
+	struct inode *inode = d_inode(dentry);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	bool compress = fa->flags & FS_COMPR_FL;
+	struct fileattr old;
+	int ret;
+
+	if (fileattr_has_fsx(fa))
+		return -EOPNOTSUPP;
+	ouichefs_fileattr_get(dentry, &old);
+	if ((fa->flags ^ old.flags) & ~FS_COMPR_FL)
+		return -EOPNOTSUPP;
+	if (compress == !!(ci->flags & OUICHEFS_INODE_COMPRESS))
+		return 0;
+	if (!ouichefs_has_compression(sbi) ||
+	    !ouichefs_clusters_fit(inode->i_sb))
+		return -EOPNOTSUPP;
+	if (IS_IMMUTABLE(inode))
+		return -EPERM;
+
+	if (S_ISREG(inode->i_mode)) {
+		if (i_size_read(inode))
+			return -EINVAL;
+		/* Drop blocks left past the end of file, or inline data */
+		ret = ouichefs_truncate(inode);
+		if (ret)
+			return ret;
+	}
+
+	if (compress) {
+		ci->flags &= ~OUICHEFS_INODE_INLINE;
+		ci->flags |= OUICHEFS_INODE_COMPRESS;
+	} else {
+		ci->flags &= ~OUICHEFS_INODE_COMPRESS;
+		/* Zoned mode still writes the file back in clusters */
+		if (S_ISREG(inode->i_mode) &&
+		    (sbi->features & OUICHEFS_FEATURE_INLINE_DATA) &&
+		    !ouichefs_is_clustered(inode))
+			ci->flags |= OUICHEFS_INODE_INLINE;
+	}
+	if (S_ISREG(inode->i_mode))
+		inode->i_blocks = (ci->flags & OUICHEFS_INODE_INLINE) ? 1 : 0;
+	inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+
+	return 0;
+}
+
+long ouichefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case OUICHEFS_IOC_BULKSTAT:
+		return ouichefs_ioc_bulkstat(file, (void __user *)arg);
+	case OUICHEFS_IOC_RMTREE:
+		return ouichefs_ioc_rmtree(file);
+	case OUICHEFS_IOC_SNAPSHOT_CREATE:
+	case OUICHEFS_IOC_SNAPSHOT_DELETE:
+		return ouichefs_ioc_snapshot(file, cmd, (void __user *)arg);
+	case OUICHEFS_IOC_ATOMIC_WRITE:
+		return ouichefs_ioc_atomic_write(file, (void __user *)arg);
+	case FITRIM:
+		return ouichefs_ioc_fitrim(file, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
@@ -0,0 +1,438 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/jbd2.h>
+#include <linux/slab.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * Metadata journal
+ *
+ * Every change to the superblock, inode store, bitmaps, directory and index
+ * blocks is made through a jbd2 handle. Handles running concurrently join
+ * the same transaction, which jbd2 writes to the journal area in one
+ * sequential I/O (group commit) before the blocks are written in place.
+ * File data is written before the transaction that allocates its blocks
+ * commits, so that a crash never exposes stale blocks.
+ *
+ * Partitions without a journal keep writing metadata in place: all the
+ * helpers below accept a NULL handle and fall back to mark_buffer_dirty().
+ */
+
+/* Blocks released by a transaction, freed once it has committed */
+struct ouichefs_free_extent {
+	struct list_head list;
+	uint64_t first;
+	uint32_t len;
+};
+
+/*
+ * Called by jbd2 once a transaction is on disk: the blocks it released can
+ * no longer be referenced after a crash, hand them over to free_work.
+ */
+static void ouichefs_journal_commit_callback(journal_t *journal,
+					     transaction_t *txn)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(
+		((struct super_block *)journal->j_private));
+
+	if (list_empty(&txn->t_private_list))
+		return;
+
+	spin_lock(&sbi->free_lock);
+	list_splice_tail_init(&txn->t_private_list, &sbi->committed_frees);
+	spin_unlock(&sbi->free_lock);
+
+	queue_work(system_unbound_wq, &sbi->free_work);
+}
+
+static void ouichefs_free_work(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(work, struct ouichefs_sb_info, free_work);
+	struct ouichefs_free_extent *ext, *tmp;
+	LIST_HEAD(list);
+
+	spin_lock(&sbi->free_lock);
+	list_splice_init(&sbi->committed_frees, &list);
+	spin_unlock(&sbi->free_lock);
+
+	list_for_each_entry_safe(ext, tmp, &list, list) {
+		ouichefs_discard_blocks(sbi->sb, ext->first, ext->len);
+		put_block_range(sbi, ext->first, ext->len);
+		list_del(&ext->list);
+		kfree(ext);
+	}
+}
+
+/*
+ * With a metadata device, the journal and the commit barrier are on it, so
+ * the main device must be flushed once the data of a transaction is written
+ * and before its commit block. ouichefs_journal_data() files data_jinode in
+ * every transaction it adds data to. Its turn waits for the data of all the
+ * inodes of the transaction, as jbd2 does for each of them, then flushes the
+ * main device once. An inode evicted meanwhile has left the list, but its
+ * data was written before: the flush still covers it.
+ */
+static int ouichefs_finish_inode_data(struct jbd2_inode *jinode)
+{
+	transaction_t *txn = jinode->i_transaction;
+	journal_t *journal = txn->t_journal;
+	struct super_block *sb = journal->j_private;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct jbd2_inode *ji;
+	int err, ret = 0;
+
+	if (jinode != &sbi->data_jinode)
+		return jbd2_journal_finish_inode_data_buffers(jinode);
+
+	spin_lock(&journal->j_list_lock);
+	list_for_each_entry(ji, &txn->t_inode_list, i_list) {
+		if (ji == jinode || !(ji->i_flags & JI_WAIT_DATA))
+			continue;
+		/* Keeps ji in the list, see jbd2_journal_release_jbd_inode() */
+		ji->i_flags |= JI_COMMIT_RUNNING;
+		spin_unlock(&journal->j_list_lock);
+		err = jbd2_journal_finish_inode_data_buffers(ji);
+		if (!ret)
+			ret = err;
+		spin_lock(&journal->j_list_lock);
+		ji->i_flags &= ~JI_COMMIT_RUNNING;
+		smp_mb();
+		wake_up_bit(&ji->i_flags, __JI_COMMIT_RUNNING);
+	}
+	spin_unlock(&journal->j_list_lock);
+
+	return blkdev_issue_flush(sb->s_bdev) ?: ret;
+}
+
+/*
+ * Open the journal located after the bitmaps and replay it if the partition
+ * was not cleanly unmounted. Must be called before any other metadata block
+ * is read.
+ */
+int ouichefs_journal_load(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t start = 1 + sbi->nr_istore_blocks + sbi->nr_ifree_blocks +
+			 sbi->nr_bfree_blocks;
+	journal_t *journal;
+	int ret;
+
+	spin_lock_init(&sbi->free_lock);
+	INIT_LIST_HEAD(&sbi->committed_frees);
+	INIT_WORK(&sbi->free_work, ouichefs_free_work);
+
+	if (!(sbi->features & OUICHEFS_FEATURE_JOURNAL))
+		return 0;
+
+	if (start + sbi->nr_journal_blocks > sbi->blocks_count) {
+		pr_err("journal beyond end of partition\n");
+		return -EUCLEAN;
+	}
+
+	journal = jbd2_journal_init_dev(ouichefs_block_bdev(sb, start),
+					ouichefs_block_bdev(sb, start), start,
+					sbi->nr_journal_blocks,
+					sb->s_blocksize);
+	if (!journal) {
+		pr_err("failed to initialize journal\n");
+		return -EINVAL;
+	}
+	journal->j_private = sb;
+	journal->j_commit_callback = ouichefs_journal_commit_callback;
+	journal->j_submit_inode_data_buffers =
+		jbd2_journal_submit_inode_data_buffers;
+	journal->j_finish_inode_data_buffers =
+		sbi->meta_bdev ? ouichefs_finish_inode_data :
+				 jbd2_journal_finish_inode_data_buffers;
+
+	ret = jbd2_journal_load(journal);
+	if (ret) {
+		pr_err("failed to load journal (%d)\n", ret);
+		jbd2_journal_destroy(journal);
+		return ret;
+	}
+
+	write_lock(&journal->j_state_lock);
+	journal->j_flags |= JBD2_BARRIER;
+	write_unlock(&journal->j_state_lock);
+
+	sbi->journal = journal;
+
+	return 0;
+}
+
+/*
+ * Commit the running transaction, checkpoint the journal and wait for the
+ * blocks it released to be returned to the bitmap.
+ */
+int ouichefs_journal_destroy(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	int ret;
+
+	if (!sbi->journal)
+		return 0;
+
+	ret = jbd2_journal_destroy(sbi->journal);
+	sbi->journal = NULL;
+	flush_work(&sbi->free_work);
+
+	return ret;
+}
+
+/*
+ * Start a handle allowed to modify credits metadata blocks and to revoke
+ * revokes of them. If the current task already holds a handle, it is reused
+ * and must have been started with enough credits. Return NULL if the
+ * partition has no journal.
+ */
+handle_t *ouichefs_journal_start(struct super_block *sb, int credits,
+				 int revokes)
+{
+	journal_t *journal = OUICHEFS_SB(sb)->journal;
+
+	if (!journal)
+		return NULL;
+	if (sb_rdonly(sb))
+		return ERR_PTR(-EROFS);
+
+	return jbd2__journal_start(journal, credits, 0, revokes, GFP_NOFS, 0,
+				   0);
+}
+
+/*
+ * Return the handle held by the current task, e.g. the one started by
+ * write_begin, or NULL if the partition has no journal.
+ */
+handle_t *ouichefs_journal_current(struct super_block *sb)
+{
+	if (!OUICHEFS_SB(sb)->journal)
+		return NULL;
+	return journal_current_handle();
+}
+
+int ouichefs_journal_stop(handle_t *handle)
+{
+	if (!handle)
+		return 0;
+	return jbd2_journal_stop(handle);
+}
+
+/*
+ * Must be called before modifying bh, a metadata block already in use.
+ */
+int ouichefs_journal_get_write_access(handle_t *handle,
+				      struct buffer_head *bh)
+{
+	if (!handle)
+		return 0;
+	return jbd2_journal_get_write_access(handle, bh);
+}
+
+/*
+ * Must be called before filling bh, a newly allocated metadata block.
+ */
+int ouichefs_journal_get_create_access(handle_t *handle,
+				       struct buffer_head *bh)
+{
+	if (!handle)
+		return 0;
+	return jbd2_journal_get_create_access(handle, bh);
+}
+
+/*
+ * Mark the modified metadata block bh dirty.
+ */
+int ouichefs_journal_dirty(handle_t *handle, struct buffer_head *bh)
+{
+	if (!handle) {
+		mark_buffer_dirty(bh);
+		return 0;
+	}
+	return jbd2_journal_dirty_metadata(handle, bh);
+}
+
+/*
+ * Drop the metadata block bh, about to be released, so that neither the
+ * journal nor a replay of it writes it again once it has been reallocated.
+ * The reference to bh is consumed. The handle must have a revoke credit.
+ */
+int ouichefs_journal_forget(handle_t *handle, struct buffer_head *bh)
+{
+	if (!handle) {
+		bforget(bh);
+		return 0;
+	}
+	return jbd2_journal_revoke(handle, bh->b_blocknr, bh);
+}
+
+/*
+ * Make the transaction of handle write the data of inode in [pos, pos + len)
+ * before it commits, since it allocates the blocks holding this data.
+ */
+int ouichefs_journal_data(handle_t *handle, struct inode *inode, loff_t pos,
+			  loff_t len)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	int ret;
+
+	if (!handle)
+		return 0;
+	ret = jbd2_journal_inode_ranges_for_write(
+		handle, &OUICHEFS_INODE(inode)->jinode, pos, len);
+	if (ret || !sbi->meta_bdev)
+		return ret;
+	/* The commit must flush the main device, see finish_inode_data */
+	return jbd2_journal_inode_ranges_for_wait(handle, &sbi->data_jinode,
+						  0, 1);
+}
+
+/*
+ * Record that the transaction of handle modified inode, for fsync. datasync
+ * is false if only attributes fdatasync can ignore (timestamps) changed.
+ */
+void ouichefs_journal_update_tid(handle_t *handle, struct inode *inode,
+				 bool datasync)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	if (!handle)
+		return;
+	WRITE_ONCE(ci->i_sync_tid, handle->h_transaction->t_tid);
+	if (datasync)
+		WRITE_ONCE(ci->i_datasync_tid, handle->h_transaction->t_tid);
+}
+
+/*
+ * Called when inode is read from disk: it may have been modified by the
+ * running or committing transaction before being evicted, so fsync must
+ * wait for it.
+ */
+void ouichefs_journal_init_tid(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	journal_t *journal = OUICHEFS_SB(inode->i_sb)->journal;
+	transaction_t *txn;
+	tid_t tid;
+
+	if (!journal)
+		return;
+
+	read_lock(&journal->j_state_lock);
+	txn = journal->j_running_transaction ?:
+		      journal->j_committing_transaction;
+	tid = txn ? txn->t_tid : journal->j_commit_sequence;
+	read_unlock(&journal->j_state_lock);
+
+	ci->i_sync_tid = tid;
+	ci->i_datasync_tid = tid;
+}
+
+/*
+ * Copy the state of len bits starting at bit into the on-disk bitmap whose
+ * first block is map. Only the bitmap blocks covering these bits are
+ * journaled, the in-memory bitmap is left untouched.
+ */
+static int journal_bitmap(handle_t *handle, struct super_block *sb,
+			  uint32_t map, uint64_t bit, uint32_t len, bool free)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	unsigned int shift = sb->s_blocksize_bits + 3; /* bits per block */
+	uint32_t off, nr;
+	struct buffer_head *bh;
+	int ret;
+
+	while (len) {
+		off = bit & ((1U << shift) - 1);
+		nr = min(len, (1U << shift) - off);
+
+		bh = ouichefs_bread(sb, map + (bit >> shift));
+		if (!bh)
+			return -EIO;
+		ret = jbd2_journal_get_write_access(handle, bh);
+		if (ret) {
+			brelse(bh);
+			return ret;
+		}
+		/* Other handles may be updating bits of the same word */
+		spin_lock(&sbi->bitmap_lock);
+		if (free)
+			bitmap_set((unsigned long *)bh->b_data, off, nr);
+		else
+			bitmap_clear((unsigned long *)bh->b_data, off, nr);
+		spin_unlock(&sbi->bitmap_lock);
+		ret = jbd2_journal_dirty_metadata(handle, bh);
+		brelse(bh);
+		if (ret)
+			return ret;
+
+		bit += nr;
+		len -= nr;
+	}
+
+	return 0;
+}
+
+/*
+ * Journal the allocation or release of inode ino. Without a journal, the
+ * whole bitmap is written by sync_fs instead.
+ */
+int ouichefs_journal_ifree(handle_t *handle, struct super_block *sb,
+			   uint32_t ino, bool free)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (!handle)
+		return 0;
+	return journal_bitmap(handle, sb, 1 + sbi->nr_istore_blocks, ino, 1,
+			      free);
+}
+
+/*
+ * Journal the allocation or release of len blocks starting at block first.
+ */
+int ouichefs_journal_bfree(handle_t *handle, struct super_block *sb,
+			   uint64_t first, uint32_t len, bool free)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (!handle)
+		return 0;
+	return journal_bitmap(handle, sb,
+			      1 + sbi->nr_istore_blocks + sbi->nr_ifree_blocks,
+			      first, len, free);
+}
+
+/*
+ * Return len blocks starting at block first to the in-memory bitmap once
+ * the transaction of handle has committed. Until then, a crash could bring
+ * back the file that used them, so they must not be reallocated (nor
+ * discarded).
+ */
+void ouichefs_journal_defer_free(handle_t *handle, struct super_block *sb,
+				 uint64_t first, uint32_t len)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_free_extent *ext;
+
+	ext = kmalloc(sizeof(*ext), GFP_NOFS | __GFP_NOFAIL);
+	ext->first = first;
+	ext->len = len;
+
+	spin_lock(&sbi->free_lock);
+	list_add_tail(&ext->list, &handle->h_transaction->t_private_list);
+	spin_unlock(&sbi->free_lock);
+}
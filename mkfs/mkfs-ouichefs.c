@@ -8,34 +8,50 @@
 #include <errno.h>
 #include <endian.h>
 #include <string.h>
+#include <sys/random.h>
+#include <sys/ioctl.h>
+#include <linux/blkzoned.h>
 
 #define OUICHEFS_MAGIC 0x48434957
 
 #define OUICHEFS_SB_BLOCK_NR 0
 
-#define OUICHEFS_BLOCK_SIZE (1 << 12) /* 4 KiB */
-#define OUICHEFS_MAX_FILESIZE (1 << 22) /* 4 MiB */
+#define OUICHEFS_MIN_BLOCK_SIZE (1 << 12) /* 4 KiB */
+#define OUICHEFS_MAX_BLOCK_SIZE (1 << 16) /* 64 KiB */
 #define OUICHEFS_FILENAME_LEN 28
-#define OUICHEFS_MAX_SUBFILES 128
 
+/* Block size of the partition being formatted (-b) */
+static uint32_t block_size = OUICHEFS_MIN_BLOCK_SIZE;
+/* 64-bit block numbers (-w), also used above 2^32 blocks */
+static int wide;
+
+/*
+ * Compact inode record (OUICHEFS_FEATURE_COMPACT_INODE): 128 B, no padding.
+ * Timestamps are nanoseconds since the epoch.
+ */
 struct ouichefs_inode {
-	mode_t i_mode; /* File mode */
+	uint32_t i_mode; /* File mode */
 	uint32_t i_uid; /* Owner id */
 	uint32_t i_gid; /* Group id */
 	uint32_t i_size; /* Size in bytes */
-	uint32_t i_ctime; /* Inode change time (sec)*/
-	uint64_t i_nctime; /* Inode change time (nsec) */
-	uint32_t i_atime; /* Access time (sec) */
-	uint64_t i_natime; /* Access time (nsec) */
-	uint32_t i_mtime; /* Modification time (sec) */
-	uint64_t i_nmtime; /* Modification time (nsec) */
-	uint32_t i_blocks; /* Block count (subdir count for directories) */
+	uint64_t i_ctime; /* Inode change time */
+	uint64_t i_atime; /* Access time */
+	uint64_t i_mtime; /* Modification time */
+	uint32_t i_blocks; /* Block count */
 	uint32_t i_nlink; /* Hard links count */
 	uint32_t index_block; /* Block with list of blocks for this file */
+	uint32_t i_next_orphan; /* Next inode in the orphan list */
+	uint32_t i_flags; /* Inode flags */
+	uint32_t i_extent_start; /* First block of the extent */
+	uint32_t i_extent_len; /* Number of blocks in the extent */
+	uint32_t i_extent_start_hi; /* OUICHEFS_FEATURE_64BIT only */
+	char i_inline[56]; /* Short symlink target */
 };
 
 #define OUICHEFS_INODES_PER_BLOCK \
-	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
+	(block_size / sizeof(struct ouichefs_inode))
+/* Inode numbers are 32-bit, larger partitions get fewer inodes than blocks */
+#define OUICHEFS_MAX_INODES (1U << 31)
 
 struct ouichefs_superblock {
 	uint32_t magic; /* Magic number */
@@ -50,87 +66,359 @@ struct ouichefs_superblock {
 	uint32_t nr_free_inodes; /* Number of free inodes */
 	uint32_t nr_free_blocks; /* Number of free blocks */
 
-	char padding[4064]; /* Padding to match block size */
+	uint32_t orphan_head; /* First inode of the orphan list */
+
+	uint32_t features; /* Incompatible features (OUICHEFS_FEATURE_*) */
+	uint32_t nr_journal_blocks; /* Number of journal blocks */
+	uint32_t nr_refcount_blocks; /* Number of refcount table blocks */
+	uint32_t nr_meta_blocks; /* Number of metadata zone blocks */
+	uint8_t uuid[16]; /* Also in the superblock of the metadata device */
+	uint32_t zone_blocks; /* Blocks per zone of a zoned device */
+	uint32_t block_size; /* Block size in bytes */
+	uint32_t nr_blocks_hi; /* High 32 bits (OUICHEFS_FEATURE_64BIT) */
+	uint32_t nr_free_blocks_hi; /* Same */
+
+	char padding[4012]; /* Padding to the smallest block size */
 };
 
-struct ouichefs_file_index_block {
-	uint32_t blocks[OUICHEFS_BLOCK_SIZE >> 2];
+#define OUICHEFS_FEATURE_JOURNAL 0x1 /* Metadata journal after the bitmaps */
+#define OUICHEFS_FEATURE_INLINE_DATA 0x2 /* Small files stored inline */
+#define OUICHEFS_FEATURE_COMPACT_INODE 0x4 /* 128-byte inode records */
+#define OUICHEFS_FEATURE_REFLINK 0x8 /* Refcount table after the journal */
+#define OUICHEFS_FEATURE_COMPRESSION 0x10 /* Compressed files allowed */
+#define OUICHEFS_FEATURE_METADEV 0x20 /* Metadata on a separate device */
+#define OUICHEFS_FEATURE_ZONED 0x40 /* Data written sequentially in zones */
+#define OUICHEFS_FEATURE_BLOCK_SIZE 0x80 /* Blocks other than 4 KiB */
+#define OUICHEFS_FEATURE_64BIT 0x100 /* 64-bit data block numbers */
+
+/* Zones kept empty by the collector, plus the open one */
+#define OUICHEFS_MIN_DATA_ZONES 3
+
+/* One 16-bit counter per block in the refcount table */
+#define OUICHEFS_REFS_PER_BLOCK (block_size / sizeof(uint16_t))
+
+/*
+ * jbd2 journal superblock, stored big-endian in the first journal block (see
+ * include/linux/jbd2.h). Only the fields we initialize are listed.
+ */
+#define JBD2_MAGIC_NUMBER 0xc03b3998
+#define JBD2_SUPERBLOCK_V2 4
+#define JBD2_MIN_JOURNAL_BLOCKS 1024
+
+struct journal_superblock {
+	uint32_t h_magic;
+	uint32_t h_blocktype;
+	uint32_t h_sequence;
+	uint32_t s_blocksize; /* Journal device block size */
+	uint32_t s_maxlen; /* Total blocks in journal */
+	uint32_t s_first; /* First block of log information */
+	uint32_t s_sequence; /* First commit ID expected in log */
+	uint32_t s_start; /* Block number of start of log, 0 if clean */
+	uint32_t s_errno;
+	uint32_t s_feature_compat;
+	uint32_t s_feature_incompat;
+	uint32_t s_feature_ro_compat;
+	uint8_t s_uuid[16];
+	uint32_t s_nr_users; /* Number of filesystems sharing the journal */
 };
 
-struct ouichefs_dir_block {
-	struct ouichefs_file {
-		uint32_t inode;
-		char filename[OUICHEFS_FILENAME_LEN];
-	} files[OUICHEFS_MAX_SUBFILES];
+/*
+ * Index blocks hold block_size / 4 block numbers (block_size / 8 with
+ * OUICHEFS_FEATURE_64BIT), and directory blocks
+ * block_size / sizeof(struct ouichefs_file) entries.
+ */
+struct ouichefs_file {
+	uint32_t inode;
+	char filename[OUICHEFS_FILENAME_LEN];
 };
 
 static inline void usage(char *appname)
 {
 	fprintf(stderr,
 		"Usage:\n"
-		"%s disk\n",
+		"%s [-b block_size] [-m metadev] [-w] disk\n",
 		appname);
 }
 
+/* Returns the size in bytes of the image or block device open as fd */
+static off_t device_size(int fd)
+{
+	off_t size = lseek(fd, 0, SEEK_END);
+
+	if (size == -1 || lseek(fd, 0, SEEK_SET) == -1)
+		return -1;
+	return size;
+}
+
+/*
+ * If fd is a zoned block device with sequential zones, store its zone size
+ * in blocks in *zone_blocks and the first block of its first sequential zone
+ * in *first_seq, and return 1. Return 0 for other devices and images, -1 on
+ * error.
+ */
+static int zone_info(int fd, uint32_t *zone_blocks, uint64_t *first_seq)
+{
+	struct blk_zone_report *rep;
+	uint32_t sectors = 0, i;
+	uint64_t sector = 0;
+	int ret = -1;
+
+	if (ioctl(fd, BLKGETZONESZ, &sectors) == -1 || !sectors)
+		return 0;
+	*zone_blocks = sectors / (block_size >> 9);
+
+	rep = malloc(sizeof(*rep) + 64 * sizeof(struct blk_zone));
+	if (!rep)
+		return -1;
+	for (;;) {
+		memset(rep, 0, sizeof(*rep));
+		rep->sector = sector;
+		rep->nr_zones = 64;
+		if (ioctl(fd, BLKREPORTZONE, rep) == -1)
+			goto end;
+		if (!rep->nr_zones) {
+			/* Only conventional zones, used as a regular device */
+			ret = 0;
+			goto end;
+		}
+		for (i = 0; i < rep->nr_zones; i++) {
+			if (rep->zones[i].type != BLK_ZONE_TYPE_CONVENTIONAL) {
+				*first_seq = rep->zones[i].start /
+					     (block_size >> 9);
+				ret = 1;
+				goto end;
+			}
+		}
+		sector = rep->zones[i - 1].start + rep->zones[i - 1].len;
+	}
+
+end:
+	free(rep);
+	return ret;
+}
+
+/* Reset the zones of fd from block start on, so that they can be written */
+static int reset_zones(int fd, uint64_t start, uint64_t nr_blocks)
+{
+	struct blk_zone_range range = {
+		.sector = start * (block_size >> 9),
+		.nr_sectors = (nr_blocks - start) * (block_size >> 9),
+	};
+
+	if (start >= nr_blocks)
+		return 0;
+	return ioctl(fd, BLKRESETZONE, &range);
+}
+
 /* Returns ceil(a/b) */
-static inline uint32_t idiv_ceil(uint32_t a, uint32_t b)
+static inline uint64_t idiv_ceil(uint64_t a, uint64_t b)
 {
-	uint32_t ret = a / b;
+	uint64_t ret = a / b;
 	if (a % b != 0)
 		return ret + 1;
 	return ret;
 }
 
-static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
+/*
+ * Journal size: 1/32 of the partition, within jbd2 limits. Partitions too
+ * small to spare 1/8 of their blocks get no journal.
+ */
+static uint32_t journal_size(uint64_t nr_blocks)
+{
+	uint64_t nr = nr_blocks / 32;
+
+	if (nr_blocks / 8 < JBD2_MIN_JOURNAL_BLOCKS)
+		return 0;
+	if (nr < JBD2_MIN_JOURNAL_BLOCKS)
+		return JBD2_MIN_JOURNAL_BLOCKS;
+	if (nr > 32768)
+		return 32768;
+	return nr;
+}
+
+/* End of the metadata zone */
+static uint32_t meta_end(struct ouichefs_superblock *sb)
+{
+	return 1 + le32toh(sb->nr_istore_blocks) +
+	       le32toh(sb->nr_ifree_blocks) + le32toh(sb->nr_bfree_blocks) +
+	       le32toh(sb->nr_journal_blocks) +
+	       le32toh(sb->nr_refcount_blocks) + le32toh(sb->nr_meta_blocks);
+}
+
+/* First data block of a zoned partition, at the start of a zone */
+static uint64_t zone_data_start(struct ouichefs_superblock *sb)
+{
+	uint32_t zone_blocks = le32toh(sb->zone_blocks);
+
+	if (!zone_blocks)
+		return meta_end(sb);
+	return idiv_ceil(meta_end(sb), zone_blocks) * zone_blocks;
+}
+
+/*
+ * Write the superblock of a partition of nr_blocks blocks to fd. If
+ * nr_metadev_blocks is not 0, fd is a metadata device of that size, and the
+ * metadata zone fills it up. If zone_blocks is not 0, the main device is
+ * zoned and its first sequential zone starts at block first_seq: the
+ * metadata zone otherwise fills the conventional zones before it. Everything
+ * up to the end of the metadata zone must lie below block 2^32.
+ */
+static struct ouichefs_superblock *write_superblock(int fd, uint64_t nr_blocks,
+						    uint64_t nr_metadev_blocks,
+						    uint32_t zone_blocks,
+						    uint64_t first_seq)
 {
 	int ret;
 	struct ouichefs_superblock *sb;
-	uint32_t nr_inodes = 0, nr_blocks = 0, nr_ifree_blocks = 0;
-	uint32_t nr_bfree_blocks = 0, nr_data_blocks = 0, nr_istore_blocks = 0;
+	uint32_t nr_inodes = 0, nr_ifree_blocks = 0, nr_istore_blocks = 0;
+	uint32_t nr_journal_blocks = 0;
+	uint64_t nr_bfree_blocks = 0, nr_refcount_blocks = 0;
+	uint64_t nr_data_blocks = 0, nr_meta_blocks = 0, nr_unused = 0;
+	uint64_t nr_free_blocks, data_start, meta_start, max_meta;
 	uint32_t mod;
 
 	sb = malloc(sizeof(struct ouichefs_superblock));
 	if (!sb)
 		return NULL;
 
-	nr_blocks = fstats->st_size / OUICHEFS_BLOCK_SIZE;
-	nr_inodes = nr_blocks;
+	nr_inodes = nr_blocks < OUICHEFS_MAX_INODES ? nr_blocks :
+						      OUICHEFS_MAX_INODES;
 	mod = nr_inodes % OUICHEFS_INODES_PER_BLOCK;
 	if (mod != 0)
 		nr_inodes += mod;
 	nr_istore_blocks = idiv_ceil(nr_inodes, OUICHEFS_INODES_PER_BLOCK);
-	nr_ifree_blocks = idiv_ceil(nr_inodes, OUICHEFS_BLOCK_SIZE * 8);
-	nr_bfree_blocks = idiv_ceil(nr_blocks, OUICHEFS_BLOCK_SIZE * 8);
+	nr_ifree_blocks = idiv_ceil(nr_inodes, block_size * 8);
+	nr_bfree_blocks = idiv_ceil(nr_blocks, block_size * 8);
+	nr_journal_blocks = journal_size(nr_blocks);
+	nr_refcount_blocks = idiv_ceil(nr_blocks, OUICHEFS_REFS_PER_BLOCK);
 	nr_data_blocks = nr_blocks - 1 - nr_istore_blocks - nr_ifree_blocks -
-			 nr_bfree_blocks;
+			 nr_bfree_blocks - nr_journal_blocks -
+			 nr_refcount_blocks;
+	meta_start = nr_blocks - nr_data_blocks;
+	if (meta_start + 2 > UINT32_MAX) {
+		fprintf(stderr, "Too many blocks (%llu)\n",
+			(unsigned long long)nr_blocks);
+		errno = EINVAL;
+		free(sb);
+		return NULL;
+	}
+	/* Metadata zone for directory and index blocks: 1/16 of the data blocks */
+	nr_meta_blocks = nr_data_blocks / 16;
+	if (meta_start + nr_meta_blocks > UINT32_MAX)
+		nr_meta_blocks = UINT32_MAX - meta_start;
+	if (nr_metadev_blocks) {
+		max_meta = nr_blocks - 1 < UINT32_MAX ? nr_blocks - 1 :
+							UINT32_MAX;
+		if (nr_metadev_blocks < meta_start + 2 ||
+		    nr_metadev_blocks > max_meta) {
+			fprintf(stderr,
+				"Metadata device must have %llu to %llu blocks\n",
+				(unsigned long long)meta_start + 2,
+				(unsigned long long)max_meta);
+			errno = EINVAL;
+			free(sb);
+			return NULL;
+		}
+		nr_meta_blocks = nr_metadev_blocks - meta_start;
+	} else if (zone_blocks) {
+		if (first_seq < meta_start + 2 || first_seq > UINT32_MAX) {
+			fprintf(stderr,
+				"Conventional zones must hold %llu to %u blocks\n",
+				(unsigned long long)meta_start + 2, UINT32_MAX);
+			errno = EINVAL;
+			free(sb);
+			return NULL;
+		}
+		nr_meta_blocks = first_seq - meta_start;
+	}
+	/* Blocks between the metadata zone and the first data zone are unused */
+	if (zone_blocks) {
+		data_start = meta_start + nr_meta_blocks;
+		data_start = idiv_ceil(data_start, zone_blocks) * zone_blocks;
+		if (data_start > nr_blocks ||
+		    (nr_blocks - data_start) / zone_blocks <
+			    OUICHEFS_MIN_DATA_ZONES) {
+			fprintf(stderr, "Device must have %u data zones\n",
+				OUICHEFS_MIN_DATA_ZONES);
+			errno = EINVAL;
+			free(sb);
+			return NULL;
+		}
+		nr_unused = data_start - meta_start - nr_meta_blocks;
+	}
+	nr_free_blocks = nr_data_blocks - 1 - nr_unused;
+	if (nr_blocks > UINT32_MAX)
+		wide = 1;
 
 	memset(sb, 0, sizeof(struct ouichefs_superblock));
 	sb->magic = htole32(OUICHEFS_MAGIC);
-	sb->nr_blocks = htole32(nr_blocks);
+	sb->nr_blocks = htole32((uint32_t)nr_blocks);
+	sb->nr_blocks_hi = htole32(nr_blocks >> 32);
 	sb->nr_inodes = htole32(nr_inodes);
 	sb->nr_istore_blocks = htole32(nr_istore_blocks);
 	sb->nr_ifree_blocks = htole32(nr_ifree_blocks);
 	sb->nr_bfree_blocks = htole32(nr_bfree_blocks);
 	sb->nr_free_inodes = htole32(nr_inodes - 1);
-	sb->nr_free_blocks = htole32(nr_data_blocks - 1);
+	sb->nr_free_blocks = htole32((uint32_t)nr_free_blocks);
+	sb->nr_free_blocks_hi = htole32(nr_free_blocks >> 32);
+	sb->nr_journal_blocks = htole32(nr_journal_blocks);
+	sb->nr_refcount_blocks = htole32(nr_refcount_blocks);
+	sb->nr_meta_blocks = htole32(nr_meta_blocks);
+	sb->zone_blocks = htole32(zone_blocks);
+	sb->block_size = htole32(block_size);
+	sb->features = OUICHEFS_FEATURE_INLINE_DATA |
+		       OUICHEFS_FEATURE_COMPACT_INODE | OUICHEFS_FEATURE_REFLINK;
+	/* The bitmap of compressed clusters only covers 4 KiB index blocks */
+	if (block_size == OUICHEFS_MIN_BLOCK_SIZE)
+		sb->features |= OUICHEFS_FEATURE_COMPRESSION;
+	else
+		sb->features |= OUICHEFS_FEATURE_BLOCK_SIZE;
+	if (nr_journal_blocks)
+		sb->features |= OUICHEFS_FEATURE_JOURNAL;
+	if (nr_metadev_blocks)
+		sb->features |= OUICHEFS_FEATURE_METADEV;
+	if (zone_blocks)
+		sb->features |= OUICHEFS_FEATURE_ZONED;
+	if (wide)
+		sb->features |= OUICHEFS_FEATURE_64BIT;
+	sb->features = htole32(sb->features);
+	if (getrandom(sb->uuid, sizeof(sb->uuid), 0) != sizeof(sb->uuid)) {
+		free(sb);
+		return NULL;
+	}
 
 	ret = write(fd, sb, sizeof(struct ouichefs_superblock));
 	if (ret != sizeof(struct ouichefs_superblock)) {
 		free(sb);
 		return NULL;
 	}
+	/* The rest of block 0 is unused */
+	if (lseek(fd, block_size, SEEK_SET) == -1) {
+		free(sb);
+		return NULL;
+	}
 
 	printf("Superblock: (%ld)\n"
 	       "\tmagic=%#x\n"
-	       "\tnr_blocks=%u\n"
+	       "\tnr_blocks=%llu\n"
 	       "\tnr_inodes=%u (istore=%u blocks)\n"
 	       "\tnr_ifree_blocks=%u\n"
 	       "\tnr_bfree_blocks=%u\n"
 	       "\tnr_free_inodes=%u\n"
-	       "\tnr_free_blocks=%u\n",
-	       sizeof(struct ouichefs_superblock), sb->magic, sb->nr_blocks,
-	       sb->nr_inodes, sb->nr_istore_blocks, sb->nr_ifree_blocks,
-	       sb->nr_bfree_blocks, sb->nr_free_inodes, sb->nr_free_blocks);
+	       "\tnr_free_blocks=%llu\n"
+	       "\tnr_journal_blocks=%u\n"
+	       "\tnr_refcount_blocks=%u\n"
+	       "\tnr_meta_blocks=%u\n"
+	       "\tzone_blocks=%u\n"
+	       "\tblock_size=%u\n"
+	       "\tfeatures=%#x\n",
+	       sizeof(struct ouichefs_superblock), sb->magic,
+	       (unsigned long long)nr_blocks, sb->nr_inodes,
+	       sb->nr_istore_blocks, sb->nr_ifree_blocks, sb->nr_bfree_blocks,
+	       sb->nr_free_inodes, (unsigned long long)nr_free_blocks,
+	       sb->nr_journal_blocks, sb->nr_refcount_blocks,
+	       sb->nr_meta_blocks, sb->zone_blocks, sb->block_size,
+	       sb->features);
 
 	return sb;
 }
@@ -144,39 +432,40 @@ static int write_inode_store(int fd, struct ouichefs_superblock *sb)
 	uint32_t first_data_block;
 
 	/* Allocate a zeroed block for inode store */
-	block = malloc(OUICHEFS_BLOCK_SIZE);
+	block = malloc(block_size);
 	if (!block)
 		return -1;
-	memset(block, 0, OUICHEFS_BLOCK_SIZE);
+	memset(block, 0, block_size);
 
 	/* Root inode (inode 1) */
 	inode = (struct ouichefs_inode *)block + 1;
 	first_data_block = 1 + le32toh(sb->nr_bfree_blocks) +
 			   le32toh(sb->nr_ifree_blocks) +
-			   le32toh(sb->nr_istore_blocks);
+			   le32toh(sb->nr_istore_blocks) +
+			   le32toh(sb->nr_journal_blocks) +
+			   le32toh(sb->nr_refcount_blocks);
 	inode->i_mode =
 		htole32(S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR |
 			S_IWGRP | S_IXUSR | S_IXGRP | S_IXOTH);
 	inode->i_uid = 0;
 	inode->i_gid = 0;
-	inode->i_size = htole32(OUICHEFS_BLOCK_SIZE);
-	inode->i_ctime = inode->i_atime = inode->i_mtime = htole32(0);
-	inode->i_nctime = inode->i_natime = inode->i_nmtime = htole64(0);
+	inode->i_size = htole32(block_size);
+	inode->i_ctime = inode->i_atime = inode->i_mtime = htole64(0);
 	inode->i_blocks = htole32(1);
 	inode->i_nlink = htole32(2);
 	inode->index_block = htole32(first_data_block);
 
-	ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
-	if (ret != OUICHEFS_BLOCK_SIZE) {
+	ret = write(fd, block, block_size);
+	if (ret != block_size) {
 		ret = -1;
 		goto end;
 	}
 
 	/* Reset inode store blocks to zero */
-	memset(block, 0, OUICHEFS_BLOCK_SIZE);
+	memset(block, 0, block_size);
 	for (i = 1; i < sb->nr_istore_blocks; i++) {
-		ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
-		if (ret != OUICHEFS_BLOCK_SIZE) {
+		ret = write(fd, block, block_size);
+		if (ret != block_size) {
 			ret = -1;
 			goto end;
 		}
@@ -199,18 +488,18 @@ static int write_ifree_blocks(int fd, struct ouichefs_superblock *sb)
 	char *block;
 	uint64_t *ifree;
 
-	block = malloc(OUICHEFS_BLOCK_SIZE);
+	block = malloc(block_size);
 	if (!block)
 		return -1;
 	ifree = (uint64_t *)block;
 
 	/* Set all bits to 1 */
-	memset(ifree, 0xff, OUICHEFS_BLOCK_SIZE);
+	memset(ifree, 0xff, block_size);
 
 	/* First ifree block, containing first used inode */
 	ifree[0] = htole64(0xfffffffffffffffc);
-	ret = write(fd, ifree, OUICHEFS_BLOCK_SIZE);
-	if (ret != OUICHEFS_BLOCK_SIZE) {
+	ret = write(fd, ifree, block_size);
+	if (ret != block_size) {
 		ret = -1;
 		goto end;
 	}
@@ -218,8 +507,8 @@ static int write_ifree_blocks(int fd, struct ouichefs_superblock *sb)
 	/* All ifree blocks except the one containing 2 first inodes */
 	ifree[0] = 0xffffffffffffffff;
 	for (i = 1; i < le32toh(sb->nr_ifree_blocks); i++) {
-		ret = write(fd, ifree, OUICHEFS_BLOCK_SIZE);
-		if (ret != OUICHEFS_BLOCK_SIZE) {
+		ret = write(fd, ifree, block_size);
+		if (ret != block_size) {
 			ret = -1;
 			goto end;
 		}
@@ -234,56 +523,129 @@ end:
 	return ret;
 }
 
+/* Clear the bits of blocks start to end - 1 in the bitmap block at base */
+static void mark_used(uint8_t *bfree, uint64_t base, uint64_t start,
+		      uint64_t end)
+{
+	uint64_t nr;
+
+	if (end > base + block_size * 8)
+		end = base + block_size * 8;
+	for (nr = start > base ? start : base; nr < end; nr++)
+		bfree[(nr - base) / 8] &= ~(1 << ((nr - base) % 8));
+}
+
 static int write_bfree_blocks(int fd, struct ouichefs_superblock *sb)
 {
 	int ret = 0;
+	uint64_t base;
 	uint32_t i;
-	char *block;
-	uint64_t *bfree, mask, line;
+	uint8_t *bfree;
 	uint32_t nr_used = le32toh(sb->nr_istore_blocks) +
 			   le32toh(sb->nr_ifree_blocks) +
-			   le32toh(sb->nr_bfree_blocks) + 2;
+			   le32toh(sb->nr_bfree_blocks) +
+			   le32toh(sb->nr_journal_blocks) +
+			   le32toh(sb->nr_refcount_blocks) + 2;
 
-	block = malloc(OUICHEFS_BLOCK_SIZE);
-	if (!block)
+	bfree = malloc(block_size);
+	if (!bfree)
 		return -1;
-	bfree = (uint64_t *)block;
 
 	/*
-	 * First blocks (incl. sb + istore + ifree + bfree + 1 used block)
-	 * we suppose it won't go further than the first block
+	 * First blocks (incl. sb + istore + ifree + bfree + journal + refcount
+	 * table + 1 used block) are used, they may span several bitmap blocks.
+	 * So are those before the first data zone of a zoned partition.
 	 */
-	memset(bfree, 0xff, OUICHEFS_BLOCK_SIZE);
-	i = 0;
-	while (nr_used) {
-		line = 0xffffffffffffffff;
-		for (mask = 0x1; mask != 0x0; mask <<= 1) {
-			line &= ~mask;
-			nr_used--;
-			if (!nr_used)
-				break;
+	for (i = 0; i < le32toh(sb->nr_bfree_blocks); i++) {
+		memset(bfree, 0xff, block_size);
+		base = (uint64_t)i * block_size * 8;
+		mark_used(bfree, base, 0, nr_used);
+		mark_used(bfree, base, meta_end(sb), zone_data_start(sb));
+		ret = write(fd, bfree, block_size);
+		if (ret != block_size) {
+			ret = -1;
+			goto end;
 		}
-		bfree[i] = htole64(line);
-		i++;
 	}
-	ret = write(fd, bfree, OUICHEFS_BLOCK_SIZE);
-	if (ret != OUICHEFS_BLOCK_SIZE) {
+	ret = 0;
+
+	printf("Bfree blocks: wrote %d blocks\n", i);
+end:
+	free(bfree);
+
+	return ret;
+}
+
+static int write_journal_blocks(int fd, struct ouichefs_superblock *sb)
+{
+	int ret = 0;
+	uint32_t i, nr = le32toh(sb->nr_journal_blocks);
+	char *block;
+	struct journal_superblock *jsb;
+
+	if (!nr)
+		return 0;
+
+	block = malloc(block_size);
+	if (!block)
+		return -1;
+	memset(block, 0, block_size);
+
+	/* Empty journal: the log starts right after its superblock */
+	jsb = (struct journal_superblock *)block;
+	jsb->h_magic = htobe32(JBD2_MAGIC_NUMBER);
+	jsb->h_blocktype = htobe32(JBD2_SUPERBLOCK_V2);
+	jsb->s_blocksize = htobe32(block_size);
+	jsb->s_maxlen = htobe32(nr);
+	jsb->s_first = htobe32(1);
+	jsb->s_sequence = htobe32(1);
+	jsb->s_nr_users = htobe32(1);
+
+	ret = write(fd, block, block_size);
+	if (ret != block_size) {
 		ret = -1;
 		goto end;
 	}
 
-	/* other blocks */
-	memset(bfree, 0xff, OUICHEFS_BLOCK_SIZE);
-	for (i = 1; i < le32toh(sb->nr_bfree_blocks); i++) {
-		ret = write(fd, bfree, OUICHEFS_BLOCK_SIZE);
-		if (ret != OUICHEFS_BLOCK_SIZE) {
+	memset(block, 0, block_size);
+	for (i = 1; i < nr; i++) {
+		ret = write(fd, block, block_size);
+		if (ret != block_size) {
 			ret = -1;
 			goto end;
 		}
 	}
 	ret = 0;
 
-	printf("Bfree blocks: wrote %d blocks\n", i);
+	printf("Journal: wrote %d blocks\n", i);
+end:
+	free(block);
+
+	return ret;
+}
+
+/* No block is shared yet: all counters are 0 */
+static int write_refcount_blocks(int fd, struct ouichefs_superblock *sb)
+{
+	int ret = 0;
+	uint32_t i, nr = le32toh(sb->nr_refcount_blocks);
+	char *block;
+
+	block = malloc(block_size);
+	if (!block)
+		return -1;
+	memset(block, 0, block_size);
+
+	for (i = 0; i < nr; i++) {
+		ret = write(fd, block, block_size);
+		if (ret != block_size) {
+			ret = -1;
+			goto end;
+		}
+	}
+	ret = 0;
+
+	printf("Refcount table: wrote %d blocks\n", i);
 end:
 	free(block);
 
@@ -295,13 +657,13 @@ static int write_root_index_block(int fd, struct ouichefs_superblock *sb)
 	int ret = 0;
 	char *block;
 
-	block = malloc(OUICHEFS_BLOCK_SIZE);
+	block = malloc(block_size);
 	if (!block)
 		return -1;
-	memset(block, 0, OUICHEFS_BLOCK_SIZE);
+	memset(block, 0, block_size);
 
-	ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
-	if (ret != OUICHEFS_BLOCK_SIZE) {
+	ret = write(fd, block, block_size);
+	if (ret != block_size) {
 		ret = -1;
 		goto end;
 	}
@@ -323,10 +685,10 @@ static int write_data_blocks(int fd, struct ouichefs_superblock *sb)
 	/* uint32_t first_block = le32toh(sb->nr_istore_blocks) + */
 	/* 	le32toh(sb->nr_ifree_blocks) + le32toh(sb->nr_bfree_blocks) + 3; */
 
-	/* foo = malloc(OUICHEFS_BLOCK_SIZE); */
+	/* foo = malloc(block_size); */
 	/* if (!foo) */
 	/* 	return -1; */
-	/* memset(foo, 0, OUICHEFS_BLOCK_SIZE); */
+	/* memset(foo, 0, block_size); */
 
 	/* end: */
 	/* 	free(foo); */
@@ -336,51 +698,121 @@ static int write_data_blocks(int fd, struct ouichefs_superblock *sb)
 
 int main(int argc, char **argv)
 {
-	int ret = EXIT_SUCCESS, fd;
+	int ret = EXIT_SUCCESS, fd, meta_fd = -1, mfd, opt, zoned;
+	uint64_t nr_blocks, first_seq = 0;
+	uint32_t zone_blocks = 0;
 	long int min_size;
-	struct stat stat_buf;
+	off_t size, meta_size = 0;
+	char *metadev = NULL;
 	struct ouichefs_superblock *sb = NULL;
 
-	if (argc != 2 || argv[1][0] == '-') {
+	while ((opt = getopt(argc, argv, "b:m:w")) != -1) {
+		switch (opt) {
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			if (block_size < OUICHEFS_MIN_BLOCK_SIZE ||
+			    block_size > OUICHEFS_MAX_BLOCK_SIZE ||
+			    (block_size & (block_size - 1))) {
+				fprintf(stderr,
+					"Block size must be a power of 2 from %u to %u\n",
+					OUICHEFS_MIN_BLOCK_SIZE,
+					OUICHEFS_MAX_BLOCK_SIZE);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':
+			metadev = optarg;
+			break;
+		case 'w':
+			wide = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
 		usage(argv[0]);
 		return EXIT_FAILURE;
 	}
+	/* The page cache of the kernel cannot hold blocks larger than a page */
+	if (block_size > sysconf(_SC_PAGESIZE))
+		fprintf(stderr,
+			"Warning: kernels with %ld-byte pages cannot mount a partition with %u-byte blocks\n",
+			sysconf(_SC_PAGESIZE), block_size);
 
 	/* Open disk image */
-	fd = open(argv[1], O_RDWR);
+	fd = open(argv[optind], O_RDWR);
 	if (fd == -1) {
 		perror("open():");
 		return EXIT_FAILURE;
 	}
 
 	/* Get image size */
-	ret = fstat(fd, &stat_buf);
-	if (ret != 0) {
-		perror("fstat():");
+	size = device_size(fd);
+	if (size == -1) {
+		perror("lseek():");
 		ret = EXIT_FAILURE;
 		goto fclose;
 	}
 
 	/* Check if image is large enough */
-	min_size = 100 * OUICHEFS_BLOCK_SIZE;
-	if (stat_buf.st_size < min_size) {
+	min_size = 100 * block_size;
+	if (size < min_size) {
 		fprintf(stderr,
 			"File is not large enough (size=%ld, min size=%ld)\n",
-			stat_buf.st_size, min_size);
+			(long int)size, min_size);
 		ret = EXIT_FAILURE;
 		goto fclose;
 	}
 
+	/* Data is written sequentially in the zones of a zoned device */
+	nr_blocks = size / block_size;
+	zoned = zone_info(fd, &zone_blocks, &first_seq);
+	if (zoned == -1) {
+		perror("zone_info():");
+		ret = EXIT_FAILURE;
+		goto fclose;
+	}
+	if (zoned)
+		nr_blocks -= nr_blocks % zone_blocks;
+
+	/* Everything up to the metadata zone goes to the metadata device */
+	mfd = fd;
+	if (metadev) {
+		meta_fd = open(metadev, O_RDWR);
+		if (meta_fd == -1) {
+			perror("open():");
+			ret = EXIT_FAILURE;
+			goto fclose;
+		}
+		meta_size = device_size(meta_fd);
+		if (meta_size == -1) {
+			perror("lseek():");
+			ret = EXIT_FAILURE;
+			goto fclose;
+		}
+		mfd = meta_fd;
+	}
+
 	/* Write superblock (block 0) */
-	sb = write_superblock(fd, &stat_buf);
+	sb = write_superblock(mfd, nr_blocks, meta_size / block_size,
+			      zone_blocks, first_seq);
 	if (!sb) {
 		perror("write_superblock():");
 		ret = EXIT_FAILURE;
 		goto fclose;
 	}
 
+	/* Sequential zones are written from their start */
+	if (zoned && reset_zones(fd, first_seq, nr_blocks)) {
+		perror("reset_zones():");
+		ret = EXIT_FAILURE;
+		goto free_sb;
+	}
+
 	/* Write inode store blocks (from block 1) */
-	ret = write_inode_store(fd, sb);
+	ret = write_inode_store(mfd, sb);
 	if (ret != 0) {
 		perror("write_inode_store():");
 		ret = EXIT_FAILURE;
@@ -388,7 +820,7 @@ int main(int argc, char **argv)
 	}
 
 	/* Write inode free bitmap blocks */
-	ret = write_ifree_blocks(fd, sb);
+	ret = write_ifree_blocks(mfd, sb);
 	if (ret != 0) {
 		perror("write_ifree_blocks()");
 		ret = EXIT_FAILURE;
@@ -396,15 +828,31 @@ int main(int argc, char **argv)
 	}
 
 	/* Write block free bitmap blocks */
-	ret = write_bfree_blocks(fd, sb);
+	ret = write_bfree_blocks(mfd, sb);
 	if (ret != 0) {
 		perror("write_bfree_blocks()");
 		ret = EXIT_FAILURE;
 		goto free_sb;
 	}
 
+	/* Write journal blocks */
+	ret = write_journal_blocks(mfd, sb);
+	if (ret != 0) {
+		perror("write_journal_blocks()");
+		ret = EXIT_FAILURE;
+		goto free_sb;
+	}
+
+	/* Write refcount table blocks */
+	ret = write_refcount_blocks(mfd, sb);
+	if (ret != 0) {
+		perror("write_refcount_blocks()");
+		ret = EXIT_FAILURE;
+		goto free_sb;
+	}
+
 	/* Write the root index block */
-	ret = write_root_index_block(fd, sb);
+	ret = write_root_index_block(mfd, sb);
 	if (ret != 0) {
 		perror("write_root_index_block()");
 		ret = EXIT_FAILURE;
@@ -419,9 +867,22 @@ int main(int argc, char **argv)
 		goto free_sb;
 	}
 
+	/* Copy the superblock to the main device, to find the other one */
+	if (metadev) {
+		if (pwrite(fd, sb, sizeof(*sb), 0) != sizeof(*sb)) {
+			perror("pwrite():");
+			ret = EXIT_FAILURE;
+			goto free_sb;
+		}
+		printf("Metadata device: %s (%ld blocks)\n", metadev,
+		       (long int)(meta_size / block_size));
+	}
+
 free_sb:
 	free(sb);
 fclose:
+	if (meta_fd != -1)
+		close(meta_fd);
 	close(fd);
 
 	return ret;
@@ -0,0 +1,370 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * Make the on-disk successor of prev be ino. If prev is NULL, ino becomes
+ * the head of the list. Called with orphan_lock held.
+ */
+static int set_next_orphan(handle_t *handle, struct super_block *sb,
+			   struct ouichefs_orphan *prev, uint32_t ino)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode di;
+	struct buffer_head *bh;
+	void *raw = NULL;
+	int ret;
+
+	if (prev)
+		bh = ouichefs_bread_inode(sb, prev->ino, &raw);
+	else
+		bh = ouichefs_bread(sb, OUICHEFS_SB_BLOCK_NR);
+	if (!bh)
+		return -EIO;
+	ret = ouichefs_journal_get_write_access(handle, bh);
+	if (ret)
+		goto brelse;
+
+	if (prev) {
+		ouichefs_load_inode(sb, raw, &di);
+		di.i_next_orphan = ino;
+		ouichefs_store_inode(sb, raw, &di);
+	} else {
+		((struct ouichefs_sb_info *)bh->b_data)->orphan_head = ino;
+		sbi->orphan_head = ino;
+	}
+	ret = ouichefs_journal_dirty(handle, bh);
+brelse:
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Put inode at the head of the orphan list. Called on unlink, in the handle
+ * removing the directory entry. Its blocks are released once the inode is
+ * evicted.
+ */
+int ouichefs_orphan_add(handle_t *handle, struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_orphan *orphan;
+	struct ouichefs_inode di;
+	struct buffer_head *bh;
+	void *raw;
+	int ret = 0;
+
+	orphan = kzalloc(sizeof(*orphan), GFP_KERNEL);
+	if (!orphan)
+		return -ENOMEM;
+	orphan->ino = inode->i_ino;
+	orphan->dir = S_ISDIR(inode->i_mode);
+
+	mutex_lock(&sbi->orphan_lock);
+
+	/* Chain the current head behind this inode, then make it the head */
+	bh = ouichefs_bread_inode(sb, inode->i_ino, &raw);
+	if (!bh) {
+		ret = -EIO;
+		goto unlock;
+	}
+	ret = ouichefs_journal_get_write_access(handle, bh);
+	if (!ret) {
+		ouichefs_load_inode(sb, raw, &di);
+		di.i_next_orphan = sbi->orphan_head;
+		ouichefs_store_inode(sb, raw, &di);
+		ret = ouichefs_journal_dirty(handle, bh);
+	}
+	brelse(bh);
+	if (ret)
+		goto unlock;
+
+	ret = set_next_orphan(handle, sb, NULL, inode->i_ino);
+	if (ret)
+		goto unlock;
+
+	list_add(&orphan->list, &sbi->orphans);
+	OUICHEFS_INODE(inode)->orphan = orphan;
+
+unlock:
+	mutex_unlock(&sbi->orphan_lock);
+	if (ret)
+		kfree(orphan);
+
+	return ret;
+}
+
+/*
+ * Called when an unlinked inode is evicted: hand its blocks over to the
+ * orphan worker.
+ */
+void ouichefs_orphan_reclaim(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_orphan *orphan = ci->orphan;
+
+	if (!orphan)
+		return;
+
+	mutex_lock(&sbi->orphan_lock);
+	orphan->index_block = ci->index_block;
+	orphan->inline_data = ci->flags & OUICHEFS_INODE_INLINE;
+	orphan->ext_start = ci->ext_start;
+	orphan->ext_len = ci->ext_len;
+	orphan->ready = true;
+	mutex_unlock(&sbi->orphan_lock);
+	ci->orphan = NULL;
+
+	queue_work(system_unbound_wq, &sbi->orphan_work);
+}
+
+/*
+ * Release the blocks mapped by the index of an orphan, one batch per handle,
+ * starting with handle if it is not NULL. Released entries are cleared in the
+ * same handle, so that a crash in between does not release them twice.
+ * Return the handle of the last batch, for the rest of the release.
+ */
+static handle_t *release_orphan_index(struct super_block *sb,
+				      struct ouichefs_orphan *orphan,
+				      handle_t *handle)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh = NULL;
+	bool more;
+
+	if (orphan->index_block && !orphan->dir && !orphan->inline_data)
+		bh = ouichefs_bread(sb, orphan->index_block);
+
+	for (;;) {
+		if (!handle)
+			handle = ouichefs_journal_start(
+				sb, OUICHEFS_ORPHAN_CREDITS(sbi),
+				OUICHEFS_RELEASE_BATCH);
+		if (IS_ERR(handle) || !bh ||
+		    ouichefs_journal_get_write_access(handle, bh))
+			break;
+		index = (struct ouichefs_file_index_block *)bh->b_data;
+		more = ouichefs_release_index_batch(handle, sb, index, 0);
+		ouichefs_journal_dirty(handle, bh);
+		if (!more)
+			break;
+		ouichefs_journal_stop(handle);
+		handle = NULL;
+		cond_resched();
+	}
+	brelse(bh);
+
+	return handle;
+}
+
+/*
+ * Release the extent and the index block of an orphan, whose index entries
+ * were released by release_orphan_index(). If we fail to read the index
+ * block, we just lose the blocks it maps forever.
+ */
+static void release_orphan_blocks(handle_t *handle, struct super_block *sb,
+				  struct ouichefs_orphan *orphan)
+{
+	struct buffer_head *bh;
+	uint32_t bno = orphan->index_block;
+
+	if (orphan->ext_len)
+		ouichefs_release_block_range(handle, sb, orphan->ext_start,
+					     orphan->ext_len);
+	if (!bno)
+		return;
+
+	bh = ouichefs_bread(sb, bno);
+	if (!bh || ouichefs_journal_get_write_access(handle, bh)) {
+		pr_err("failed reading index of inode %u, blocks lost\n",
+		       orphan->ino);
+		brelse(bh);
+		goto release_index;
+	}
+	memset(bh->b_data, 0, sb->s_blocksize);
+	ouichefs_journal_forget(handle, bh);
+
+release_index:
+	ouichefs_release_block_range(handle, sb, bno, 1);
+}
+
+/*
+ * Release the blocks of evicted orphans, one inode at a time, then remove
+ * them from the orphan list and free their inode. Consecutive orphans share
+ * a handle as long as it has credits left for a whole release, so that
+ * removing many small files does not take a handle each.
+ */
+static void ouichefs_orphan_work(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(work, struct ouichefs_sb_info, orphan_work);
+	struct super_block *sb = sbi->sb;
+	struct ouichefs_orphan *orphan, *prev;
+	struct buffer_head *bh;
+	handle_t *handle = NULL;
+	void *raw;
+	uint32_t next, nr = 0;
+
+	for (;;) {
+		mutex_lock(&sbi->orphan_lock);
+		list_for_each_entry(orphan, &sbi->orphans, list) {
+			if (orphan->ready)
+				break;
+		}
+		if (list_entry_is_head(orphan, &sbi->orphans, list)) {
+			mutex_unlock(&sbi->orphan_lock);
+			break;
+		}
+		orphan->ready = false;
+		mutex_unlock(&sbi->orphan_lock);
+
+		/*
+		 * Data blocks are released in bounded batches, the last handle
+		 * also releasing the extent and the inode itself.
+		 */
+		handle = release_orphan_index(sb, orphan, handle);
+		if (IS_ERR(handle)) {
+			pr_err("failed releasing orphan inode %u (%ld)\n",
+			       orphan->ino, PTR_ERR(handle));
+			return;
+		}
+
+		release_orphan_blocks(handle, sb, orphan);
+
+		/* Unchain the orphan and free its inode */
+		mutex_lock(&sbi->orphan_lock);
+		next = list_is_last(&orphan->list, &sbi->orphans) ?
+			       0 :
+			       list_next_entry(orphan, list)->ino;
+		prev = list_is_first(&orphan->list, &sbi->orphans) ?
+			       NULL :
+			       list_prev_entry(orphan, list);
+		if (set_next_orphan(handle, sb, prev, next))
+			pr_err("failed unchaining orphan inode %u\n",
+			       orphan->ino);
+
+		bh = ouichefs_bread_inode(sb, orphan->ino, &raw);
+		if (bh) {
+			if (!ouichefs_journal_get_write_access(handle, bh)) {
+				memset(raw, 0, ouichefs_inode_size(sbi));
+				ouichefs_journal_dirty(handle, bh);
+			}
+			brelse(bh);
+		}
+		ouichefs_journal_ifree(handle, sb, orphan->ino, true);
+		put_inode(sbi, orphan->ino);
+
+		list_del(&orphan->list);
+		mutex_unlock(&sbi->orphan_lock);
+		kfree(orphan);
+
+		if (handle && (++nr == OUICHEFS_RELEASE_BATCH ||
+			       jbd2_handle_buffer_credits(handle) <
+				       OUICHEFS_RELEASE_CREDITS(sbi))) {
+			ouichefs_journal_stop(handle);
+			handle = NULL;
+			nr = 0;
+		}
+		cond_resched();
+	}
+	ouichefs_journal_stop(handle);
+}
+
+/*
+ * Load the on-disk orphan list. Orphans found there were unlinked before a
+ * crash or an unmount that did not complete their release: since nobody can
+ * reference them anymore, release them right away (unless read-only).
+ */
+int ouichefs_orphan_init(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_orphan *orphan, *tmp;
+	struct ouichefs_inode di;
+	struct buffer_head *bh;
+	uint32_t ino = sbi->orphan_head, nr = 0;
+	void *raw;
+	int ret = 0;
+
+	INIT_LIST_HEAD(&sbi->orphans);
+	mutex_init(&sbi->orphan_lock);
+	INIT_WORK(&sbi->orphan_work, ouichefs_orphan_work);
+
+	while (ino) {
+		if (ino >= sbi->nr_inodes || nr++ >= sbi->nr_inodes) {
+			pr_err("corrupted orphan list\n");
+			ret = -EUCLEAN;
+			goto free;
+		}
+
+		orphan = kzalloc(sizeof(*orphan), GFP_KERNEL);
+		if (!orphan) {
+			ret = -ENOMEM;
+			goto free;
+		}
+		bh = ouichefs_bread_inode(sb, ino, &raw);
+		if (!bh) {
+			kfree(orphan);
+			ret = -EIO;
+			goto free;
+		}
+		ouichefs_load_inode(sb, raw, &di);
+		orphan->ext_start = ouichefs_load_extent_start(sb, raw);
+		brelse(bh);
+		orphan->ino = ino;
+		orphan->index_block = le32_to_cpu(di.index_block);
+		orphan->dir = S_ISDIR(le32_to_cpu(di.i_mode));
+		orphan->inline_data = le32_to_cpu(di.i_flags) &
+				      OUICHEFS_INODE_INLINE;
+		orphan->ext_len = le32_to_cpu(di.i_extent_len);
+		orphan->ready = true;
+		ino = le32_to_cpu(di.i_next_orphan);
+
+		list_add_tail(&orphan->list, &sbi->orphans);
+	}
+
+	if (nr && !sb_rdonly(sb)) {
+		pr_info("releasing %u orphan inodes\n", nr);
+		queue_work(system_unbound_wq, &sbi->orphan_work);
+	}
+
+	return 0;
+
+free:
+	list_for_each_entry_safe(orphan, tmp, &sbi->orphans, list) {
+		list_del(&orphan->list);
+		kfree(orphan);
+	}
+	return ret;
+}
+
+/*
+ * Wait for pending releases and drop what is left of the in-memory orphan
+ * list (orphans of a read-only mount stay on disk).
+ */
+void ouichefs_orphan_destroy(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_orphan *orphan, *tmp;
+
+	flush_work(&sbi->orphan_work);
+
+	list_for_each_entry_safe(orphan, tmp, &sbi->orphans, list) {
+		list_del(&orphan->list);
+		kfree(orphan);
+	}
+}
@@ -8,18 +8,44 @@
 #define _OUICHEFS_H
 
 #include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/ioctl.h>
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/jbd2.h>
 
 #define OUICHEFS_MAGIC 0x48434957
 
 #define OUICHEFS_SB_BLOCK_NR 0
 
-#define OUICHEFS_BLOCK_SIZE (1 << 12) /* 4 KiB */
-#define OUICHEFS_MAX_FILESIZE (1 << 22) /* 4 MiB */
+/*
+ * Blocks are 4 KiB to 64 KiB large, as chosen by mkfs (sb->block_size), and
+ * no larger than a page, which may hold several of them: file data is mapped
+ * per block, not per page. Block-sized structures and per-block capacities
+ * follow sb->s_blocksize.
+ */
+#define OUICHEFS_MIN_BLOCK_SHIFT 12 /* 4 KiB */
+#define OUICHEFS_MAX_BLOCK_SHIFT 16 /* 64 KiB */
+#define OUICHEFS_MIN_BLOCK_SIZE (1 << OUICHEFS_MIN_BLOCK_SHIFT)
 #define OUICHEFS_FILENAME_LEN 28
-#define OUICHEFS_MAX_SUBFILES 128
 
 /*
- * ouiche_fs partition layout
+ * Entries of an index block, i.e. blocks of a regular file. They are 32-bit
+ * block numbers, or 64-bit ones with OUICHEFS_FEATURE_64BIT.
+ */
+#define OUICHEFS_INDEX_ENTRIES(sb)                   \
+	((uint32_t)((sb)->s_blocksize >>             \
+		    (ouichefs_has_64bit(OUICHEFS_SB(sb)) ? 3 : 2)))
+#define OUICHEFS_MAX_FILESIZE(sb) \
+	((loff_t)OUICHEFS_INDEX_ENTRIES(sb) << (sb)->s_blocksize_bits)
+/* Entries of a directory block */
+#define OUICHEFS_MAX_SUBFILES(sb) \
+	((uint32_t)((sb)->s_blocksize / sizeof(struct ouichefs_file)))
+
+/*
+ * ouiche_fs partition layout, in blocks of sb->block_size bytes
  *
  * +---------------+
  * |  superblock   |  1 block
@@ -30,35 +56,152 @@
  * +---------------+
  * | bfree bitmap  |  sb->nr_bfree_blocks blocks
  * +---------------+
+ * |    journal    |  sb->nr_journal_blocks blocks (may be 0)
+ * +---------------+
+ * |   refcounts   |  sb->nr_refcount_blocks blocks (may be 0)
+ * +---------------+
+ * | metadata zone |  sb->nr_meta_blocks blocks (may be 0)
+ * +---------------+
  * |    data       |
  * |      blocks   |  rest of the blocks
  * +---------------+
  *
+ * With OUICHEFS_FEATURE_METADEV, everything up to the end of the metadata
+ * zone is stored on a separate metadata device, at the same block numbers.
+ * The matching blocks of the main device are unused, except for block 0
+ * which holds a copy of the superblock as written by mkfs.
+ *
+ * With OUICHEFS_FEATURE_ZONED, the main device is a zoned block device: the
+ * metadata lies in its conventional zones (unless on a metadata device), and
+ * the data blocks in the zones of sb->zone_blocks blocks that follow.
+ *
+ * With OUICHEFS_FEATURE_64BIT, the partition may have more than 2^32 blocks.
+ * Only data blocks lie above 2^32: everything up to the end of the metadata
+ * zone, directory and index blocks, and inode numbers stay 32-bit.
  */
 
+/*
+ * The first i_extent_len blocks of a regular file are the contiguous blocks
+ * starting at i_extent_start, and are mapped without reading the index
+ * block. The matching index entries are unused (0). Blocks past the extent
+ * are mapped by the index block, at their own position in it. With
+ * OUICHEFS_FEATURE_64BIT, the compact record also holds the high 32 bits of
+ * i_extent_start.
+ */
 struct ouichefs_inode {
 	uint32_t i_mode; /* File mode */
 	uint32_t i_uid; /* Owner id */
 	uint32_t i_gid; /* Group id */
 	uint32_t i_size; /* Size in bytes */
 	uint32_t i_ctime; /* Inode change time (sec)*/
+	uint32_t i_flags; /* OUICHEFS_INODE_* flags */
 	uint64_t i_nctime; /* Inode change time (nsec) */
 	uint32_t i_atime; /* Access time (sec) */
+	uint32_t i_extent_start; /* First block of the extent */
 	uint64_t i_natime; /* Access time (nsec) */
 	uint32_t i_mtime; /* Modification time (sec) */
+	uint32_t i_extent_len; /* Number of blocks in the extent */
 	uint64_t i_nmtime; /* Modification time (nsec) */
 	uint32_t i_blocks; /* Block count */
 	uint32_t i_nlink; /* Hard links count */
 	uint32_t index_block; /* Block with list of blocks for this file */
+	uint32_t i_next_orphan; /* Next inode in the orphan list */
 };
 
+/* Inode flags (i_flags) */
+#define OUICHEFS_INODE_INLINE 0x1 /* Data stored in the index block */
+#define OUICHEFS_INODE_SNAPSHOT 0x2 /* Part of a snapshot, immutable */
+#define OUICHEFS_INODE_COMPRESS 0x4 /* Data stored in compressed clusters */
+
+/* Largest regular file whose data is stored inline */
+#define OUICHEFS_INLINE_MAX(sb) ((sb)->s_blocksize)
+
+/*
+ * Compressed files, and all regular files in zoned mode, are written back in
+ * clusters of OUICHEFS_CLUSTER_BLOCKS blocks. A cluster stored compressed
+ * uses the first index entries of its slot, and its bit is set in the bitmap
+ * kept in i_inline. The bitmap only covers the index block of 4 KiB blocks,
+ * so compression needs those.
+ */
+#define OUICHEFS_CLUSTER_SHIFT 2
+#define OUICHEFS_CLUSTER_BLOCKS (1 << OUICHEFS_CLUSTER_SHIFT)
+#define OUICHEFS_CLUSTER_SIZE(sb) ((sb)->s_blocksize << OUICHEFS_CLUSTER_SHIFT)
+#define OUICHEFS_MAX_CLUSTERS \
+	((OUICHEFS_MIN_BLOCK_SIZE >> 2) >> OUICHEFS_CLUSTER_SHIFT)
+/* Clusters of a file, i.e. of its index block */
+#define OUICHEFS_NR_CLUSTERS(sb) \
+	(OUICHEFS_INDEX_ENTRIES(sb) >> OUICHEFS_CLUSTER_SHIFT)
+
 struct ouichefs_inode_info {
 	uint32_t index_block;
+	uint32_t flags; /* OUICHEFS_INODE_* flags */
+	uint64_t ext_start; /* First block of the extent */
+	uint32_t ext_len; /* Number of blocks in the extent */
+	struct mutex map_lock; /* Protects the extent and the index block */
+	struct ouichefs_orphan *orphan; /* Orphan list entry once unlinked */
+	bool rmtree; /* Directory emptied by rmtree_pass(), see unlink */
+	struct jbd2_inode jinode; /* Data written before allocations commit */
+	tid_t i_sync_tid; /* Last transaction that modified the inode */
+	tid_t i_datasync_tid; /* Same, ignoring changes fdatasync skips */
+	DECLARE_BITMAP(cmap, OUICHEFS_MAX_CLUSTERS); /* Compressed clusters */
+	unsigned long *rmap; /* Reserved clusters, OUICHEFS_NR_CLUSTERS bits */
 	struct inode vfs_inode;
 };
 
-#define OUICHEFS_INODES_PER_BLOCK \
-	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
+/*
+ * Inodes that have been unlinked but whose blocks have not been released
+ * yet. They are chained on disk from the superblock through i_next_orphan,
+ * so that the release can be completed at mount after a crash. The
+ * in-memory list mirrors the on-disk one, in the same order.
+ */
+struct ouichefs_orphan {
+	struct list_head list;
+	uint32_t ino;
+	uint32_t index_block;
+	uint64_t ext_start;
+	uint32_t ext_len;
+	bool dir;
+	bool inline_data; /* The index block holds data, not block numbers */
+	bool ready; /* Inode evicted, blocks can be released */
+};
+
+#define OUICHEFS_INODES_PER_BLOCK(sb) \
+	((uint32_t)((sb)->s_blocksize / sizeof(struct ouichefs_inode)))
+
+/*
+ * Inode-store record of partitions with OUICHEFS_FEATURE_COMPACT_INODE. It has
+ * no padding and a power-of-two size, so that inodes are located with shifts.
+ * Timestamps are nanoseconds since the epoch. Symlink targets that fit in
+ * i_inline are stored there, and such symlinks have no index block. For
+ * compressed regular files, i_inline holds the bitmap of compressed clusters.
+ * Its fixed fields alone take 72 B, so a 64 B record is out of reach: with
+ * i_inline, 32 records fit in a 4 KiB block where 51 original ones do.
+ */
+#define OUICHEFS_INODE_V2_SHIFT 7 /* 128 B */
+#define OUICHEFS_INODES_PER_BLOCK_V2_SHIFT(sb) \
+	((sb)->s_blocksize_bits - OUICHEFS_INODE_V2_SHIFT)
+#define OUICHEFS_INODE_V2_INLINE 56
+
+struct ouichefs_inode_v2 {
+	uint32_t i_mode; /* File mode */
+	uint32_t i_uid; /* Owner id */
+	uint32_t i_gid; /* Group id */
+	uint32_t i_size; /* Size in bytes */
+	uint64_t i_ctime; /* Inode change time */
+	uint64_t i_atime; /* Access time */
+	uint64_t i_mtime; /* Modification time */
+	uint32_t i_blocks; /* Block count */
+	uint32_t i_nlink; /* Hard links count */
+	uint32_t index_block; /* Block with list of blocks for this file */
+	uint32_t i_next_orphan; /* Next inode in the orphan list */
+	uint32_t i_flags; /* OUICHEFS_INODE_* flags */
+	uint32_t i_extent_start; /* First block of the extent */
+	uint32_t i_extent_len; /* Number of blocks in the extent */
+	uint32_t i_extent_start_hi; /* OUICHEFS_FEATURE_64BIT only */
+	char i_inline[OUICHEFS_INODE_V2_INLINE]; /* Short symlink target */
+};
+static_assert(sizeof(struct ouichefs_inode_v2) == 1 << OUICHEFS_INODE_V2_SHIFT);
+static_assert(OUICHEFS_MAX_CLUSTERS / 8 <= OUICHEFS_INODE_V2_INLINE);
 
 struct ouichefs_sb_info {
 	uint32_t magic; /* Magic number */
@@ -73,37 +216,510 @@ struct ouichefs_sb_info {
 	uint32_t nr_free_inodes; /* Number of free inodes */
 	uint32_t nr_free_blocks; /* Number of free blocks */
 
+	uint32_t orphan_head; /* First inode of the orphan list */
+
+	uint32_t features; /* Incompatible features (OUICHEFS_FEATURE_*) */
+	uint32_t nr_journal_blocks; /* Number of journal blocks */
+	uint32_t nr_refcount_blocks; /* Number of refcount table blocks */
+	uint32_t nr_meta_blocks; /* Number of metadata zone blocks */
+	uint8_t uuid[16]; /* Also in the superblock of the metadata device */
+	uint32_t zone_blocks; /* Blocks per zone of a zoned device */
+	uint32_t block_size; /* Block size (OUICHEFS_FEATURE_BLOCK_SIZE) */
+	uint32_t nr_blocks_hi; /* High 32 bits (OUICHEFS_FEATURE_64BIT) */
+	uint32_t nr_free_blocks_hi; /* Same */
+
+	/* nr_blocks and nr_free_blocks, with their high bits */
+	uint64_t blocks_count;
+	uint64_t free_blocks_count;
+	/* Free blocks promised to dirty clusters, or past zone capacities */
+	uint64_t reserved_blocks;
+
 	unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
 	unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
+	spinlock_t bitmap_lock; /* Protects bitmaps, free counts, reservations */
+
+	unsigned int mount_opts; /* Mount options (OUICHEFS_MOUNT_*) */
+	struct super_block *sb; /* Back pointer to the VFS superblock */
+	struct block_device *meta_bdev; /* Metadata device, NULL if none */
+
+	struct list_head orphans; /* In-memory copy of the orphan list */
+	struct mutex orphan_lock; /* Protects the orphan list */
+	struct work_struct orphan_work; /* Releases blocks of orphans */
+
+	journal_t *journal; /* Metadata journal, NULL if none */
+	struct jbd2_inode data_jinode; /* Flushes the main device at commit */
+	spinlock_t free_lock; /* Protects pending block releases */
+	struct list_head committed_frees; /* Released by committed handles */
+	struct work_struct free_work; /* Returns committed_frees to bfree */
+
+	spinlock_t refcount_lock; /* Protects refcount table updates */
+
+	struct mutex snapshot_lock; /* Serializes snapshot creations */
+	struct ouichefs_snapshot_req *snapshot; /* Taken by the next freeze */
+
+	unsigned long *seq_zones; /* Zones that must be reset to be reused */
+	uint32_t *zone_cap; /* Writable blocks of each zone */
+	struct mutex zone_lock; /* Orders data allocation and writes */
+	uint64_t zone_wp; /* Next block to write in the open zone */
+	uint64_t zone_end; /* End of the open zone */
+	struct work_struct gc_work; /* Empties zones for reuse */
+	bool gc_stopped; /* Set at unmount, no more collection */
 };
 
+/* Features that older modules cannot handle (sbi->features) */
+#define OUICHEFS_FEATURE_JOURNAL 0x1 /* Metadata journal after the bitmaps */
+#define OUICHEFS_FEATURE_INLINE_DATA 0x2 /* Small files stored inline */
+#define OUICHEFS_FEATURE_COMPACT_INODE 0x4 /* struct ouichefs_inode_v2 */
+#define OUICHEFS_FEATURE_REFLINK 0x8 /* Refcount table after the journal */
+#define OUICHEFS_FEATURE_COMPRESSION 0x10 /* Compressed files allowed */
+#define OUICHEFS_FEATURE_METADEV 0x20 /* Metadata on a separate device */
+#define OUICHEFS_FEATURE_ZONED 0x40 /* Data written sequentially in zones */
+#define OUICHEFS_FEATURE_BLOCK_SIZE 0x80 /* Blocks other than 4 KiB */
+#define OUICHEFS_FEATURE_64BIT 0x100 /* 64-bit data block numbers */
+#define OUICHEFS_FEATURES_SUPPORTED                                  \
+	(OUICHEFS_FEATURE_JOURNAL | OUICHEFS_FEATURE_INLINE_DATA | \
+	 OUICHEFS_FEATURE_COMPACT_INODE | OUICHEFS_FEATURE_REFLINK | \
+	 OUICHEFS_FEATURE_COMPRESSION | OUICHEFS_FEATURE_METADEV | \
+	 OUICHEFS_FEATURE_ZONED | OUICHEFS_FEATURE_BLOCK_SIZE |    \
+	 OUICHEFS_FEATURE_64BIT)
+
+static inline bool ouichefs_compact_inodes(struct ouichefs_sb_info *sbi)
+{
+	return sbi->features & OUICHEFS_FEATURE_COMPACT_INODE;
+}
+
+static inline bool ouichefs_has_reflink(struct ouichefs_sb_info *sbi)
+{
+	return sbi->features & OUICHEFS_FEATURE_REFLINK;
+}
+
+static inline bool ouichefs_has_compression(struct ouichefs_sb_info *sbi)
+{
+	return sbi->features & OUICHEFS_FEATURE_COMPRESSION;
+}
+
+/*
+ * Compressed files, and zoned partitions, are written back a cluster of whole
+ * pages at a time, which kernels whose pages are larger than a cluster cannot
+ * do
+ */
+static inline bool ouichefs_clusters_fit(struct super_block *sb)
+{
+	return OUICHEFS_CLUSTER_SIZE(sb) >= PAGE_SIZE;
+}
+
+static inline bool ouichefs_is_zoned(struct ouichefs_sb_info *sbi)
+{
+	return sbi->features & OUICHEFS_FEATURE_ZONED;
+}
+
+static inline bool ouichefs_has_64bit(struct ouichefs_sb_info *sbi)
+{
+	return sbi->features & OUICHEFS_FEATURE_64BIT;
+}
+
+/* Number of empty zones the collector of zoned partitions tries to keep */
+#define OUICHEFS_ZONE_RESERVE 2
+
+/* One little-endian 16-bit counter per block in the refcount table */
+#define OUICHEFS_REFS_PER_BLOCK(sb) \
+	((uint32_t)((sb)->s_blocksize / sizeof(__le16)))
+
+static inline uint32_t ouichefs_refcount_start(struct ouichefs_sb_info *sbi)
+{
+	return 1 + sbi->nr_istore_blocks + sbi->nr_ifree_blocks +
+	       sbi->nr_bfree_blocks + sbi->nr_journal_blocks;
+}
+
+/*
+ * Directory and index blocks are allocated from the metadata zone, the first
+ * nr_meta_blocks blocks after the refcount table, and file data from the
+ * blocks after it. The zone only guides allocation: its blocks are tracked in
+ * the bfree bitmap like any other, and each kind of block spills over into
+ * the area of the other once its own is full, unless the zone is on a
+ * metadata device or the partition is zoned.
+ */
+static inline uint32_t ouichefs_meta_end(struct ouichefs_sb_info *sbi)
+{
+	return ouichefs_refcount_start(sbi) + sbi->nr_refcount_blocks +
+	       sbi->nr_meta_blocks;
+}
+
+/*
+ * Inode-store block holding inode ino
+ */
+static inline uint32_t ouichefs_inode_block(struct ouichefs_sb_info *sbi,
+					    uint32_t ino)
+{
+	if (ouichefs_compact_inodes(sbi))
+		return (ino >> OUICHEFS_INODES_PER_BLOCK_V2_SHIFT(sbi->sb)) + 1;
+	return (ino / OUICHEFS_INODES_PER_BLOCK(sbi->sb)) + 1;
+}
+
+/*
+ * Offset of the record of inode ino in its inode-store block
+ */
+static inline uint32_t ouichefs_inode_offset(struct ouichefs_sb_info *sbi,
+					     uint32_t ino)
+{
+	if (ouichefs_compact_inodes(sbi))
+		return (ino &
+			((1 << OUICHEFS_INODES_PER_BLOCK_V2_SHIFT(sbi->sb)) - 1))
+		       << OUICHEFS_INODE_V2_SHIFT;
+	return (ino % OUICHEFS_INODES_PER_BLOCK(sbi->sb)) *
+	       sizeof(struct ouichefs_inode);
+}
+
+static inline uint32_t ouichefs_inode_size(struct ouichefs_sb_info *sbi)
+{
+	if (ouichefs_compact_inodes(sbi))
+		return 1 << OUICHEFS_INODE_V2_SHIFT;
+	return sizeof(struct ouichefs_inode);
+}
+
+/*
+ * Journal credits, i.e. number of metadata blocks a handle may modify
+ */
+#define OUICHEFS_INODE_CREDITS 1 /* inode-store block */
+/* Blocks of a file a page covers */
+#define OUICHEFS_PAGE_BLOCKS(sb) (PAGE_SIZE >> (sb)->s_blocksize_bits)
+/*
+ * index block, inode, plus for each block of a page its bfree block, and the
+ * refcount and bfree blocks of the shared block a copy is allocated for
+ */
+#define OUICHEFS_ALLOC_CREDITS(sb) (2 + 3 * OUICHEFS_PAGE_BLOCKS(sb))
+/* parent block and inode, new inode and index block, ifree and bfree blocks */
+#define OUICHEFS_CREATE_CREDITS 6
+/* parent block and inode, inode, previous orphan head (superblock) */
+#define OUICHEFS_UNLINK_CREDITS 4
+/* Entries of a directory removed in a single handle by rmtree */
+#define OUICHEFS_RMTREE_BATCH 64
+/* parent block and inode, superblock, inodes of a batch of removed entries */
+#define OUICHEFS_RMTREE_CREDITS (3 + OUICHEFS_RMTREE_BATCH)
+/* both parent blocks and inodes, renamed inode */
+#define OUICHEFS_RENAME_CREDITS 5
+/*
+ * Bitmap or refcount blocks covering the blocks of a file, which has no more
+ * blocks than index entries plus its index block
+ */
+#define OUICHEFS_FILE_SPAN(sbi, nr) \
+	min_t(uint32_t, nr, OUICHEFS_INDEX_ENTRIES((sbi)->sb) + 1)
+/* Index entries whose blocks, or orphans, are released in a single handle */
+#define OUICHEFS_RELEASE_BATCH 48
+/*
+ * bfree and refcount blocks covering a batch of index entries and the extent
+ * (at most two of each for the latter), index block, ifree block, inode,
+ * orphan list neighbour. This stays well below a quarter of the smallest
+ * journal, the most jbd2 allows a handle.
+ */
+#define OUICHEFS_RELEASE_SPAN(nr) \
+	min_t(uint32_t, nr, OUICHEFS_RELEASE_BATCH + 2)
+#define OUICHEFS_RELEASE_CREDITS(sbi)                     \
+	(OUICHEFS_RELEASE_SPAN((sbi)->nr_bfree_blocks) + \
+	 OUICHEFS_RELEASE_SPAN((sbi)->nr_refcount_blocks) + 4)
+/* Enough for several small orphans, which share a handle */
+#define OUICHEFS_ORPHAN_CREDITS(sbi) (2 * OUICHEFS_RELEASE_CREDITS(sbi))
+/*
+ * index block, inode, refcount block of the shared block, refcount and bfree
+ * blocks of the block it replaces
+ */
+#define OUICHEFS_CLONE_CREDITS 5
+/*
+ * refcount blocks of the shared data blocks, bfree block and copy of the
+ * index block, ifree block and new inode, parent directory block
+ */
+#define OUICHEFS_SNAPSHOT_CREDITS(sbi) \
+	(OUICHEFS_FILE_SPAN(sbi, (sbi)->nr_refcount_blocks) + 5)
+/*
+ * index block, inode, bfree blocks of the new blocks of a cluster, refcount
+ * and bfree blocks of those it replaces
+ */
+#define OUICHEFS_CLUSTER_CREDITS (2 + 3 * OUICHEFS_CLUSTER_BLOCKS)
+/*
+ * index block, bfree and refcount blocks of the block a zone is emptied of,
+ * and of its copy
+ */
+#define OUICHEFS_MOVE_CREDITS 5
+/*
+ * index block, inode, bfree blocks of the new blocks of an atomic write,
+ * refcount and bfree blocks of those it replaces; an unaligned write spans
+ * one more block than its length
+ */
+#define OUICHEFS_ATOMIC_BLOCKS \
+	(OUICHEFS_ATOMIC_WRITE_MAX / OUICHEFS_MIN_BLOCK_SIZE + 1)
+#define OUICHEFS_ATOMIC_CREDITS (2 + 3 * OUICHEFS_ATOMIC_BLOCKS)
+
+/* What to do with the blocks of a deleted or truncated file */
+#define OUICHEFS_MOUNT_DISCARD 0x1 /* Discard freed blocks */
+#define OUICHEFS_MOUNT_SCRUB 0x2 /* Zero freed blocks */
+
+/*
+ * Index and directory blocks fill a block of sb->s_blocksize bytes. Entries
+ * of index blocks are accessed with ouichefs_index_get/set().
+ */
 struct ouichefs_file_index_block {
-	uint32_t blocks[OUICHEFS_BLOCK_SIZE >> 2];
+	union {
+		/* OUICHEFS_INDEX_ENTRIES(sb) */
+		DECLARE_FLEX_ARRAY(uint32_t, blocks);
+		DECLARE_FLEX_ARRAY(uint64_t, blocks64); /* 64-bit partitions */
+	};
+};
+
+struct ouichefs_file {
+	uint32_t inode;
+	char filename[OUICHEFS_FILENAME_LEN];
 };
 
 struct ouichefs_dir_block {
-	struct ouichefs_file {
-		uint32_t inode;
-		char filename[OUICHEFS_FILENAME_LEN];
-	} files[OUICHEFS_MAX_SUBFILES];
+	/* OUICHEFS_MAX_SUBFILES(sb) entries */
+	DECLARE_FLEX_ARRAY(struct ouichefs_file, files);
+};
+
+/*
+ * ouichefs-specific ioctls
+ */
+#define OUICHEFS_IOC_MAGIC 'O'
+
+/* Attributes of one directory entry, as returned by OUICHEFS_IOC_BULKSTAT */
+struct ouichefs_stat {
+	__u32 ino; /* Inode number */
+	__u32 mode; /* File mode */
+	__u64 size; /* Size in bytes */
+	__s64 mtime; /* Modification time (sec) */
+	__u32 mtime_nsec; /* Modification time (nsec) */
+	char name[OUICHEFS_FILENAME_LEN]; /* Not NUL-terminated if full */
 };
 
+struct ouichefs_bulkstat {
+	__u64 buf; /* User buffer of struct ouichefs_stat records */
+	__u32 count; /* In: capacity of buf in records, out: records filled */
+	__u32 pos; /* In/out: index of the next directory entry to return */
+};
+
+#define OUICHEFS_IOC_BULKSTAT \
+	_IOWR(OUICHEFS_IOC_MAGIC, 1, struct ouichefs_bulkstat)
+/* Remove everything below a directory */
+#define OUICHEFS_IOC_RMTREE _IO(OUICHEFS_IOC_MAGIC, 2)
+
+/* Name of a snapshot in the directory the ioctl is issued on */
+struct ouichefs_snapshot {
+	char name[OUICHEFS_FILENAME_LEN]; /* Not NUL-terminated if full */
+};
+
+#define OUICHEFS_IOC_SNAPSHOT_CREATE \
+	_IOW(OUICHEFS_IOC_MAGIC, 3, struct ouichefs_snapshot)
+#define OUICHEFS_IOC_SNAPSHOT_DELETE \
+	_IOW(OUICHEFS_IOC_MAGIC, 4, struct ouichefs_snapshot)
+
+/* Largest write of OUICHEFS_IOC_ATOMIC_WRITE */
+#define OUICHEFS_ATOMIC_WRITE_MAX (64 << 10) /* 64 KiB */
+
+/* Write that a crash leaves either complete or not done at all */
+struct ouichefs_atomic_write {
+	__u64 buf; /* User buffer holding the data */
+	__u64 offset; /* Offset in the file */
+	__u32 len; /* At most OUICHEFS_ATOMIC_WRITE_MAX bytes */
+	__u32 flags; /* Must be 0 */
+};
+
+#define OUICHEFS_IOC_ATOMIC_WRITE \
+	_IOW(OUICHEFS_IOC_MAGIC, 5, struct ouichefs_atomic_write)
+
 /* superblock functions */
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent);
 
 /* inode functions */
 int ouichefs_init_inode_cache(void);
 void ouichefs_destroy_inode_cache(void);
+struct buffer_head *ouichefs_bread_inode(struct super_block *sb, uint32_t ino,
+					 void **raw);
+void ouichefs_load_inode(struct super_block *sb, const void *raw,
+			 struct ouichefs_inode *di);
+void ouichefs_store_inode(struct super_block *sb, void *raw,
+			  const struct ouichefs_inode *di);
+void ouichefs_load_times(struct super_block *sb, const void *raw,
+			 struct timespec64 *ctime, struct timespec64 *atime,
+			 struct timespec64 *mtime);
+void ouichefs_store_times(struct super_block *sb, void *raw,
+			  const struct timespec64 *ctime,
+			  const struct timespec64 *atime,
+			  const struct timespec64 *mtime);
+uint64_t ouichefs_load_extent_start(struct super_block *sb, const void *raw);
+void ouichefs_store_extent_start(struct super_block *sb, void *raw,
+				 uint64_t start);
 struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino);
+int ouichefs_rmtree(struct mnt_idmap *idmap, struct dentry *top, bool force);
+
+/* orphan functions */
+int ouichefs_orphan_add(handle_t *handle, struct inode *inode);
+void ouichefs_orphan_reclaim(struct inode *inode);
+int ouichefs_orphan_init(struct super_block *sb);
+void ouichefs_orphan_destroy(struct super_block *sb);
 
 /* file functions */
 extern const struct file_operations ouichefs_file_ops;
 extern const struct file_operations ouichefs_dir_ops;
 extern const struct address_space_operations ouichefs_aops;
+int ouichefs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+int ouichefs_truncate(struct inode *inode);
+void ouichefs_release_blocks(handle_t *handle, struct super_block *sb,
+			     uint64_t *blocks, int nr);
+void ouichefs_release_index(handle_t *handle, struct super_block *sb,
+			    struct ouichefs_file_index_block *index,
+			    uint32_t from, uint32_t count);
+bool ouichefs_release_index_batch(handle_t *handle, struct super_block *sb,
+				  struct ouichefs_file_index_block *index,
+				  uint32_t from);
+void ouichefs_release_block_range(handle_t *handle, struct super_block *sb,
+				  uint64_t first, uint32_t len);
+int ouichefs_alloc_blocks(handle_t *handle, struct inode *inode,
+			  uint64_t *blocks, int n);
+ssize_t ouichefs_atomic_write(struct file *file, loff_t pos,
+			      const void __user *buf, size_t len);
+int ouichefs_issue_discard(struct super_block *sb, uint64_t first,
+			   uint64_t len, bool zero);
+void ouichefs_discard_blocks(struct super_block *sb, uint64_t first,
+			     uint32_t len);
+
+/* refcount functions */
+int ouichefs_block_shared(struct super_block *sb, uint64_t bno, bool nowait);
+int ouichefs_refcount_get(handle_t *handle, struct super_block *sb,
+			  uint64_t bno);
+int ouichefs_refcount_put(handle_t *handle, struct super_block *sb,
+			  uint64_t bno);
+
+/* compression functions */
+int ouichefs_compress_read_folio(struct folio *folio);
+void ouichefs_compress_readahead(struct readahead_control *rac);
+int ouichefs_compress_writepages(struct address_space *mapping,
+				 struct writeback_control *wbc);
+int ouichefs_compress_write_begin(struct address_space *mapping, loff_t pos,
+				  unsigned int len, struct page **pagep);
+int ouichefs_compress_write_end(struct inode *inode, loff_t pos,
+				unsigned int len, unsigned int copied,
+				struct page *page);
+vm_fault_t ouichefs_compress_page_mkwrite(struct vm_fault *vmf);
+void ouichefs_compress_unreserve(struct inode *inode, loff_t size);
+
+/* zoned device functions */
+int ouichefs_zone_init(struct super_block *sb);
+void ouichefs_zone_stop(struct super_block *sb);
+void ouichefs_zone_destroy(struct super_block *sb);
+int ouichefs_zone_alloc(handle_t *handle, struct super_block *sb,
+			uint64_t *blocks, int n);
+void ouichefs_zone_close(struct super_block *sb);
+
+/* snapshot functions */
+int ouichefs_snapshot_create(struct file *file, const char *name);
+void ouichefs_snapshot_freeze(struct super_block *sb);
+int ouichefs_snapshot_delete(struct file *file, const char *name);
+
+/* journal functions */
+int ouichefs_journal_load(struct super_block *sb);
+int ouichefs_journal_destroy(struct super_block *sb);
+handle_t *ouichefs_journal_start(struct super_block *sb, int credits,
+				 int revokes);
+handle_t *ouichefs_journal_current(struct super_block *sb);
+int ouichefs_journal_stop(handle_t *handle);
+int ouichefs_journal_get_write_access(handle_t *handle,
+				      struct buffer_head *bh);
+int ouichefs_journal_get_create_access(handle_t *handle,
+				       struct buffer_head *bh);
+int ouichefs_journal_dirty(handle_t *handle, struct buffer_head *bh);
+int ouichefs_journal_forget(handle_t *handle, struct buffer_head *bh);
+int ouichefs_journal_data(handle_t *handle, struct inode *inode, loff_t pos,
+			  loff_t len);
+void ouichefs_journal_init_tid(struct inode *inode);
+void ouichefs_journal_update_tid(handle_t *handle, struct inode *inode,
+				 bool datasync);
+int ouichefs_journal_ifree(handle_t *handle, struct super_block *sb,
+			   uint32_t ino, bool free);
+int ouichefs_journal_bfree(handle_t *handle, struct super_block *sb,
+			   uint64_t first, uint32_t len, bool free);
+void ouichefs_journal_defer_free(handle_t *handle, struct super_block *sb,
+				 uint64_t first, uint32_t len);
+
+/* ioctl functions */
+long ouichefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+int ouichefs_fileattr_get(struct dentry *dentry, struct fileattr *fa);
+int ouichefs_fileattr_set(struct mnt_idmap *idmap, struct dentry *dentry,
+			  struct fileattr *fa);
 
 /* Getters for superbock and inode */
-#define OUICHEFS_SB(sb) (sb->s_fs_info)
+#define OUICHEFS_SB(sb) ((struct ouichefs_sb_info *)(sb)->s_fs_info)
 #define OUICHEFS_INODE(inode) \
 	(container_of(inode, struct ouichefs_inode_info, vfs_inode))
 
+static inline bool ouichefs_is_compressed(struct inode *inode)
+{
+	return OUICHEFS_INODE(inode)->flags & OUICHEFS_INODE_COMPRESS;
+}
+
+/*
+ * Regular files written back a cluster at a time to new blocks (see
+ * compress.c): compressed files, and all of them in zoned mode
+ */
+static inline bool ouichefs_is_clustered(struct inode *inode)
+{
+	return ouichefs_is_compressed(inode) ||
+	       (S_ISREG(inode->i_mode) &&
+		ouichefs_is_zoned(OUICHEFS_SB(inode->i_sb)));
+}
+
+/*
+ * Block mapped by entry i of index, 0 for none
+ */
+static inline uint64_t
+ouichefs_index_get(struct super_block *sb,
+		   const struct ouichefs_file_index_block *index, uint32_t i)
+{
+	if (ouichefs_has_64bit(OUICHEFS_SB(sb)))
+		return index->blocks64[i];
+	return index->blocks[i];
+}
+
+static inline void ouichefs_index_set(struct super_block *sb,
+				      struct ouichefs_file_index_block *index,
+				      uint32_t i, uint64_t bno)
+{
+	if (ouichefs_has_64bit(OUICHEFS_SB(sb)))
+		index->blocks64[i] = bno;
+	else
+		index->blocks[i] = bno;
+}
+
+/*
+ * Device holding block bno. Metadata blocks must be accessed through the
+ * helpers below rather than sb_bread() and friends, which always use the
+ * main device.
+ */
+static inline struct block_device *ouichefs_block_bdev(struct super_block *sb,
+							uint64_t bno)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (sbi->meta_bdev && bno < ouichefs_meta_end(sbi))
+		return sbi->meta_bdev;
+	return sb->s_bdev;
+}
+
+static inline struct buffer_head *ouichefs_bread(struct super_block *sb,
+						 uint64_t bno)
+{
+	return __bread(ouichefs_block_bdev(sb, bno), bno, sb->s_blocksize);
+}
+
+static inline struct buffer_head *ouichefs_getblk(struct super_block *sb,
+						  uint64_t bno)
+{
+	return __getblk(ouichefs_block_bdev(sb, bno), bno, sb->s_blocksize);
+}
+
+static inline struct buffer_head *
+ouichefs_find_get_block(struct super_block *sb, uint64_t bno)
+{
+	return __find_get_block(ouichefs_block_bdev(sb, bno), bno,
+				sb->s_blocksize);
+}
+
 #endif /* _OUICHEFS_H */
@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/math64.h>
+
+#include "ouichefs.h"
+
+/*
+ * Shared blocks
+ *
+ * Cloning a file range (FICLONE, FICLONERANGE, copy_file_range()) makes the
+ * destination file point to the blocks of the source file instead of copying
+ * them. The refcount table, located after the journal, holds one 16-bit
+ * counter per block of the partition: the number of references to this block
+ * beyond the first one. A zeroed table thus means that no block is shared.
+ * Dropping a reference to a block whose counter is not zero decrements the
+ * counter instead of freeing the block, and a shared block is copied to a
+ * new one before it is modified.
+ */
+
+/*
+ * Read the refcount block holding the counter of block bno, and point
+ * *count to this counter. With nowait, fail with -EAGAIN instead of reading
+ * the refcount block if it is not cached.
+ */
+static struct buffer_head *refcount_bread(struct super_block *sb,
+					  uint64_t bno, __le16 **count,
+					  bool nowait)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	uint32_t block, off;
+
+	if (bno >= sbi->blocks_count)
+		return ERR_PTR(-EIO);
+	block = ouichefs_refcount_start(sbi) +
+		div_u64_rem(bno, OUICHEFS_REFS_PER_BLOCK(sb), &off);
+	if (nowait) {
+		bh = ouichefs_find_get_block(sb, block);
+		if (!bh || !buffer_uptodate(bh)) {
+			brelse(bh);
+			return ERR_PTR(-EAGAIN);
+		}
+	} else {
+		bh = ouichefs_bread(sb, block);
+		if (!bh)
+			return ERR_PTR(-EIO);
+	}
+	*count = (__le16 *)bh->b_data + off;
+
+	return bh;
+}
+
+/*
+ * Return 1 if block bno is referenced more than once, 0 if it is not, or a
+ * negative error code (-EAGAIN if nowait and the answer is not cached).
+ */
+int ouichefs_block_shared(struct super_block *sb, uint64_t bno, bool nowait)
+{
+	struct buffer_head *bh;
+	__le16 *count;
+	int ret;
+
+	if (!ouichefs_has_reflink(OUICHEFS_SB(sb)))
+		return 0;
+
+	bh = refcount_bread(sb, bno, &count, nowait);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	ret = le16_to_cpu(READ_ONCE(*count)) != 0;
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Add delta (1 or -1) to the counter of block bno. Adding a reference fails
+ * with -EMLINK if the counter is saturated. Dropping one returns 1 if the
+ * block is still referenced, or 0 if the reference dropped was the last one
+ * and the counter was left untouched: the caller must then free the block.
+ */
+static int refcount_update(handle_t *handle, struct super_block *sb,
+			   uint64_t bno, int delta)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	__le16 *count;
+	uint16_t val;
+	int ret;
+
+	bh = refcount_bread(sb, bno, &count, false);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	ret = ouichefs_journal_get_write_access(handle, bh);
+	if (ret)
+		goto brelse;
+
+	/* Other handles may be updating counters of the same block */
+	spin_lock(&sbi->refcount_lock);
+	val = le16_to_cpu(*count);
+	if (delta > 0 && val == U16_MAX)
+		ret = -EMLINK;
+	else if (delta < 0 && !val)
+		ret = 0;
+	else {
+		*count = cpu_to_le16(val + delta);
+		ret = 1;
+	}
+	spin_unlock(&sbi->refcount_lock);
+	if (ret <= 0)
+		goto brelse;
+
+	ret = ouichefs_journal_dirty(handle, bh);
+	if (!ret && delta < 0)
+		ret = 1;
+brelse:
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Add a reference to the allocated block bno.
+ */
+int ouichefs_refcount_get(handle_t *handle, struct super_block *sb,
+			  uint64_t bno)
+{
+	int ret = refcount_update(handle, sb, bno, 1);
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Drop a reference to block bno. Return 1 if other references remain, 0 if
+ * the block must be freed, or a negative error code.
+ */
+int ouichefs_refcount_put(handle_t *handle, struct super_block *sb,
+			  uint64_t bno)
+{
+	if (!ouichefs_has_reflink(OUICHEFS_SB(sb)))
+		return 0;
+	return refcount_update(handle, sb, bno, -1);
+}
@@ -0,0 +1,615 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/namei.h>
+#include <linux/mount.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * Snapshots
+ *
+ * A snapshot is a read-only copy of the whole tree, taken while the partition
+ * is frozen so that it captures a single point in time. Inodes, directory and
+ * index blocks are copied, while data blocks are shared through the refcount
+ * table, so their content is not. Sharing still costs a journaled increment
+ * of the counter of every data block, one handle per file: writers are
+ * stopped for a time that grows with the number of files and with the number
+ * of blocks they use, though the counters of neighbouring blocks share a
+ * refcount block. Afterwards, either side copies a shared block before
+ * modifying it.
+ *
+ * Every inode of a snapshot has OUICHEFS_INODE_SNAPSHOT set, which makes it
+ * immutable, and existing snapshots are left out of new ones. A snapshot is
+ * linked in the directory the ioctl was issued on, from where it can be
+ * bind-mounted read-only. Deleting it releases the blocks that only it
+ * references.
+ */
+
+/* Inode of the root directory */
+#define OUICHEFS_ROOT_INO 1
+
+/* A copied directory whose entries still point to the original inodes */
+struct snapshot_dir {
+	uint32_t ino;
+	uint32_t bno; /* Copy of its directory block */
+};
+
+/*
+ * Add a reference to each data block of the regular file whose extent is the
+ * len blocks starting at block start, and whose index block is index: this
+ * is the part of a snapshot whose cost grows with the size of files. On
+ * failure, the references already added are kept, i.e. these blocks are
+ * lost.
+ */
+static int share_file_blocks(handle_t *handle, struct super_block *sb,
+			     uint64_t start, uint32_t len,
+			     struct ouichefs_file_index_block *index)
+{
+	uint64_t bno;
+	uint32_t i;
+	int ret;
+
+	for (i = 0; i < len; i++) {
+		ret = ouichefs_refcount_get(handle, sb, start + i);
+		if (ret)
+			return ret;
+	}
+	for (i = 0; i < OUICHEFS_INDEX_ENTRIES(sb); i++) {
+		bno = ouichefs_index_get(sb, index, i);
+		if (!bno)
+			continue;
+		ret = ouichefs_refcount_get(handle, sb, bno);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Allocate a block holding a copy of the block src.
+ */
+static int copy_block(handle_t *handle, struct super_block *sb,
+		      struct buffer_head *src, uint32_t *bno)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	int ret;
+
+	*bno = get_free_block(sbi);
+	if (!*bno)
+		return -ENOSPC;
+	ret = ouichefs_journal_bfree(handle, sb, *bno, 1, false);
+	if (ret) {
+		put_block(sbi, *bno);
+		return ret;
+	}
+
+	bh = ouichefs_getblk(sb, *bno);
+	if (!bh) {
+		ret = -ENOMEM;
+		goto release;
+	}
+	lock_buffer(bh);
+	ret = ouichefs_journal_get_create_access(handle, bh);
+	if (!ret) {
+		memcpy(bh->b_data, src->b_data, sb->s_blocksize);
+		set_buffer_uptodate(bh);
+	}
+	unlock_buffer(bh);
+	if (!ret)
+		ret = ouichefs_journal_dirty(handle, bh);
+	brelse(bh);
+	if (!ret)
+		return 0;
+release:
+	ouichefs_release_block_range(handle, sb, *bno, 1);
+	return ret;
+}
+
+/*
+ * Copy inode ino to a new inode, *new_ino, flagged as part of a snapshot.
+ * Its index block is copied too, to *new_bno, and the data blocks of a
+ * regular file are shared. The entries of a directory copy still point to
+ * the original inodes. Return 1 without copying anything if ino is itself
+ * part of a snapshot.
+ */
+static int copy_inode(handle_t *handle, struct super_block *sb, uint32_t ino,
+		      uint32_t *new_ino, uint32_t *new_bno, bool *dir)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh, *bh_index = NULL, *bh_new;
+	struct ouichefs_inode di;
+	uint32_t flags;
+	void *raw, *new_raw;
+	int ret;
+
+	*new_ino = 0;
+	*new_bno = 0;
+	bh = ouichefs_bread_inode(sb, ino, &raw);
+	if (!bh)
+		return -EIO;
+	ouichefs_load_inode(sb, raw, &di);
+	flags = le32_to_cpu(di.i_flags);
+	*dir = S_ISDIR(le32_to_cpu(di.i_mode));
+	ret = 1;
+	if (flags & OUICHEFS_INODE_SNAPSHOT)
+		goto brelse;
+
+	if (di.index_block) {
+		bh_index = ouichefs_bread(sb, le32_to_cpu(di.index_block));
+		if (!bh_index) {
+			ret = -EIO;
+			goto brelse;
+		}
+		if (S_ISREG(le32_to_cpu(di.i_mode)) &&
+		    !(flags & OUICHEFS_INODE_INLINE)) {
+			ret = share_file_blocks(
+				handle, sb, ouichefs_load_extent_start(sb, raw),
+				le32_to_cpu(di.i_extent_len),
+				(struct ouichefs_file_index_block *)
+					bh_index->b_data);
+			if (ret)
+				goto brelse;
+		}
+		ret = copy_block(handle, sb, bh_index, new_bno);
+		if (ret)
+			goto brelse;
+	}
+
+	*new_ino = get_free_inode(sbi);
+	if (!*new_ino) {
+		ret = -ENOSPC;
+		goto release;
+	}
+	ret = ouichefs_journal_ifree(handle, sb, *new_ino, false);
+	if (ret)
+		goto put_inode;
+	bh_new = ouichefs_bread_inode(sb, *new_ino, &new_raw);
+	if (!bh_new) {
+		ret = -EIO;
+		goto put_inode;
+	}
+	ret = ouichefs_journal_get_write_access(handle, bh_new);
+	if (!ret) {
+		/* Also copies the target of short symlinks */
+		memcpy(new_raw, raw, ouichefs_inode_size(sbi));
+		di.index_block = *new_bno;
+		di.i_next_orphan = 0;
+		di.i_flags = flags | OUICHEFS_INODE_SNAPSHOT;
+		ouichefs_store_inode(sb, new_raw, &di);
+		ret = ouichefs_journal_dirty(handle, bh_new);
+	}
+	brelse(bh_new);
+	if (!ret)
+		goto brelse;
+
+put_inode:
+	ouichefs_journal_ifree(handle, sb, *new_ino, true);
+	put_inode(sbi, *new_ino);
+	*new_ino = 0;
+release:
+	if (*new_bno)
+		ouichefs_release_block_range(handle, sb, *new_bno, 1);
+	*new_bno = 0;
+brelse:
+	brelse(bh_index);
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Drop the entries of the copied directory cur from entry from onward, which
+ * still point to the original inodes, and set its link count to 2 plus its
+ * nr_subdirs remaining subdirectories.
+ */
+static int truncate_dir(struct super_block *sb, struct snapshot_dir *cur,
+			int from, uint32_t nr_subdirs)
+{
+	struct ouichefs_dir_block *dblock;
+	struct ouichefs_inode di;
+	struct buffer_head *bh;
+	handle_t *handle;
+	void *raw;
+	int ret;
+
+	/* Directory block and inode */
+	handle = ouichefs_journal_start(sb, 2, 0);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	bh = ouichefs_bread(sb, cur->bno);
+	if (!bh) {
+		ret = -EIO;
+		goto stop;
+	}
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+	ret = 0;
+	if (from < OUICHEFS_MAX_SUBFILES(sb) && dblock->files[from].inode) {
+		ret = ouichefs_journal_get_write_access(handle, bh);
+		if (!ret) {
+			memset(&dblock->files[from], 0,
+			       (OUICHEFS_MAX_SUBFILES(sb) - from) *
+				       sizeof(struct ouichefs_file));
+			ret = ouichefs_journal_dirty(handle, bh);
+		}
+	}
+	brelse(bh);
+	if (ret)
+		goto stop;
+
+	bh = ouichefs_bread_inode(sb, cur->ino, &raw);
+	if (!bh) {
+		ret = -EIO;
+		goto stop;
+	}
+	ret = ouichefs_journal_get_write_access(handle, bh);
+	if (!ret) {
+		ouichefs_load_inode(sb, raw, &di);
+		di.i_nlink = 2 + nr_subdirs;
+		ouichefs_store_inode(sb, raw, &di);
+		ret = ouichefs_journal_dirty(handle, bh);
+	}
+	brelse(bh);
+stop:
+	return ouichefs_journal_stop(handle) ?: ret;
+}
+
+/*
+ * Make the copied directory cur point to copies of its entries, and push the
+ * copies of its subdirectories on the stack. Snapshots are left out of the
+ * copy. Each entry is copied in a handle of its own; on failure, the entries
+ * not copied yet are dropped.
+ */
+static int copy_dir_entries(struct super_block *sb, struct snapshot_dir *cur,
+			    struct snapshot_dir **stack, int *depth, int *max)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_dir_block *dblock;
+	struct snapshot_dir *tmp;
+	struct buffer_head *bh;
+	handle_t *handle;
+	uint32_t new_ino, new_bno, nr_subdirs = 0;
+	int i = 0, nr_subs, ret = 0;
+	bool dir;
+
+	bh = ouichefs_bread(sb, cur->bno);
+	if (!bh) {
+		ret = -EIO;
+		goto truncate;
+	}
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+	for (nr_subs = 0; nr_subs < OUICHEFS_MAX_SUBFILES(sb); nr_subs++) {
+		if (!dblock->files[nr_subs].inode)
+			break;
+	}
+
+	while (i < nr_subs) {
+		struct ouichefs_file *f = &dblock->files[i];
+
+		/* Room for a subdirectory, before it is copied */
+		if (*depth == *max) {
+			tmp = krealloc_array(*stack, *max ? *max * 2 : 16,
+					     sizeof(**stack), GFP_KERNEL);
+			if (!tmp) {
+				ret = -ENOMEM;
+				break;
+			}
+			*stack = tmp;
+			*max = *max ? *max * 2 : 16;
+		}
+
+		handle = ouichefs_journal_start(
+			sb, OUICHEFS_SNAPSHOT_CREDITS(sbi), 0);
+		if (IS_ERR(handle)) {
+			ret = PTR_ERR(handle);
+			break;
+		}
+		ret = ouichefs_journal_get_write_access(handle, bh);
+		if (!ret)
+			ret = copy_inode(handle, sb, f->inode, &new_ino,
+					 &new_bno, &dir);
+		if (ret == 1) {
+			/* Fill the hole left by a snapshot with the last entry */
+			nr_subs--;
+			*f = dblock->files[nr_subs];
+			memset(&dblock->files[nr_subs], 0,
+			       sizeof(struct ouichefs_file));
+			ret = ouichefs_journal_dirty(handle, bh);
+		} else if (!ret) {
+			f->inode = new_ino;
+			ret = ouichefs_journal_dirty(handle, bh);
+			if (dir) {
+				nr_subdirs++;
+				(*stack)[(*depth)++] = (struct snapshot_dir){
+					.ino = new_ino, .bno = new_bno
+				};
+			}
+			i++;
+		}
+		ret = ouichefs_journal_stop(handle) ?: ret;
+		if (ret)
+			break;
+
+		cond_resched();
+	}
+	brelse(bh);
+
+truncate:
+	/* Subdirectories that were snapshots are gone */
+	return truncate_dir(sb, cur, i, nr_subdirs) ?: ret;
+}
+
+/*
+ * Copy the whole tree to a new snapshot, whose root is returned in *root.
+ * The tree is walked without recursion: each copied directory is pushed on
+ * a stack until its entries are copied. On failure, the directories left on
+ * the stack are emptied, so that *root (if any) is a consistent, partial
+ * snapshot that can be deleted.
+ */
+static int copy_tree(struct super_block *sb, uint32_t *root)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct snapshot_dir *stack = NULL, cur;
+	int depth = 0, max = 0, ret;
+	handle_t *handle;
+	bool dir;
+
+	handle = ouichefs_journal_start(sb, OUICHEFS_SNAPSHOT_CREDITS(sbi), 0);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	ret = copy_inode(handle, sb, OUICHEFS_ROOT_INO, &cur.ino, &cur.bno,
+			 &dir);
+	ret = ouichefs_journal_stop(handle) ?: ret;
+	*root = cur.ino;
+	if (ret)
+		return ret < 0 ? ret : -EUCLEAN;
+
+	for (;;) {
+		if (fatal_signal_pending(current))
+			ret = truncate_dir(sb, &cur, 0, 0) ?: -EINTR;
+		else
+			ret = copy_dir_entries(sb, &cur, &stack, &depth, &max);
+		if (ret || !depth)
+			break;
+		cur = stack[--depth];
+	}
+
+	while (depth) {
+		cur = stack[--depth];
+		truncate_dir(sb, &cur, 0, 0);
+	}
+	kfree(stack);
+
+	return ret;
+}
+
+/*
+ * Add the snapshot root to directory dir, as dentry.
+ */
+static int link_snapshot(struct inode *dir, struct dentry *dentry,
+			 uint32_t root)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh;
+	handle_t *handle;
+	int i, ret;
+
+	/* Directory block and inode */
+	handle = ouichefs_journal_start(sb, 2, 0);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	bh = ouichefs_bread(sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh) {
+		ret = -EIO;
+		goto stop;
+	}
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+	for (i = 0; i < OUICHEFS_MAX_SUBFILES(sb); i++) {
+		if (!dblock->files[i].inode)
+			break;
+	}
+	ret = -EMLINK;
+	if (i == OUICHEFS_MAX_SUBFILES(sb))
+		goto brelse;
+	ret = ouichefs_journal_get_write_access(handle, bh);
+	if (ret)
+		goto brelse;
+	dblock->files[i].inode = root;
+	strncpy(dblock->files[i].filename, dentry->d_name.name,
+		OUICHEFS_FILENAME_LEN);
+	ret = ouichefs_journal_dirty(handle, bh);
+	if (ret)
+		goto brelse;
+
+	dir->i_mtime = dir->i_ctime = current_time(dir);
+	inc_nlink(dir);
+	mark_inode_dirty(dir);
+brelse:
+	brelse(bh);
+stop:
+	return ouichefs_journal_stop(handle) ?: ret;
+}
+
+/*
+ * Look up name in the directory parent, locked by the caller.
+ */
+static struct dentry *snapshot_lookup(struct dentry *parent, const char *name)
+{
+	size_t len = strnlen(name, OUICHEFS_FILENAME_LEN);
+
+	if (!len || memchr(name, '/', len) ||
+	    (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'))))
+		return ERR_PTR(-EINVAL);
+	return lookup_one_len(name, parent, len);
+}
+
+/* Snapshot to take once the partition is frozen */
+struct ouichefs_snapshot_req {
+	struct task_struct *task; /* Task that froze the partition */
+	struct dentry *parent; /* Directory to link the snapshot in */
+	const char *name; /* Name of the snapshot */
+	int ret; /* Result */
+};
+
+/*
+ * Copy the whole tree and link it as req->name in req->parent.
+ */
+static int take_snapshot(struct super_block *sb,
+			 struct ouichefs_snapshot_req *req)
+{
+	struct inode *dir = d_inode(req->parent);
+	struct dentry *dentry;
+	uint32_t root = 0;
+	int ret, err;
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	dentry = snapshot_lookup(req->parent, req->name);
+	if (IS_ERR(dentry)) {
+		ret = PTR_ERR(dentry);
+		goto unlock;
+	}
+	ret = -EEXIST;
+	if (d_really_is_positive(dentry))
+		goto dput;
+
+	ret = copy_tree(sb, &root);
+	if (root) {
+		err = link_snapshot(dir, dentry, root);
+		if (err)
+			pr_err("failed linking snapshot '%s' (%d), inode %u lost\n",
+			       req->name, err, root);
+		ret = ret ?: err;
+	}
+	/* The next lookup reads the new entry */
+	d_drop(dentry);
+dput:
+	dput(dentry);
+unlock:
+	inode_unlock(dir);
+
+	return ret;
+}
+
+/*
+ * Take the snapshot requested by the current task, if any. Called by
+ * ->freeze_fs, when writers are stopped and dirty data is written back but
+ * the partition is not frozen yet, so that the snapshot is part of what the
+ * freeze makes consistent on disk.
+ */
+void ouichefs_snapshot_freeze(struct super_block *sb)
+{
+	struct ouichefs_snapshot_req *req = OUICHEFS_SB(sb)->snapshot;
+
+	if (req && req->task == current)
+		req->ret = take_snapshot(sb, req);
+}
+
+/*
+ * Take a snapshot of the whole partition and link it as name in the
+ * directory file. Writers are stopped until it is complete: the snapshot is
+ * taken while the partition is being frozen.
+ */
+int ouichefs_snapshot_create(struct file *file, const char *name)
+{
+	struct inode *dir = file_inode(file);
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_snapshot_req req = {
+		.task = current,
+		.parent = file->f_path.dentry,
+		.name = name,
+	};
+	int ret;
+
+	if (!S_ISDIR(dir->i_mode))
+		return -ENOTDIR;
+	if (!ouichefs_has_reflink(sbi))
+		return -EOPNOTSUPP;
+	if (OUICHEFS_INODE(dir)->flags & OUICHEFS_INODE_SNAPSHOT)
+		return -EPERM;
+	if (sb_rdonly(sb) || __mnt_is_readonly(file->f_path.mnt))
+		return -EROFS;
+
+	/* Wait for pending writes, flush them and block new ones */
+	mutex_lock(&sbi->snapshot_lock);
+	sbi->snapshot = &req;
+	ret = freeze_super(sb);
+	sbi->snapshot = NULL;
+	mutex_unlock(&sbi->snapshot_lock);
+	if (ret)
+		return ret;
+	thaw_super(sb);
+
+	return req.ret;
+}
+
+/*
+ * Delete the snapshot name of the directory file. Blocks shared with the
+ * live tree or other snapshots are kept.
+ */
+int ouichefs_snapshot_delete(struct file *file, const char *name)
+{
+	struct dentry *parent = file->f_path.dentry, *dentry;
+	struct inode *dir = d_inode(parent), *inode;
+	int ret;
+
+	if (!S_ISDIR(dir->i_mode))
+		return -ENOTDIR;
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	dentry = snapshot_lookup(parent, name);
+	inode_unlock(dir);
+	if (IS_ERR(dentry)) {
+		ret = PTR_ERR(dentry);
+		goto drop_write;
+	}
+	inode = d_inode(dentry);
+	ret = -ENOENT;
+	if (!inode)
+		goto dput;
+	/* Only the root of a snapshot can be deleted */
+	ret = -EINVAL;
+	if (!(OUICHEFS_INODE(inode)->flags & OUICHEFS_INODE_SNAPSHOT) ||
+	    (OUICHEFS_INODE(dir)->flags & OUICHEFS_INODE_SNAPSHOT) ||
+	    !S_ISDIR(inode->i_mode))
+		goto dput;
+	ret = -EBUSY;
+	if (d_mountpoint(dentry))
+		goto dput;
+
+	/* Snapshots are immutable: lift it while removing them */
+	ret = ouichefs_rmtree(file_mnt_idmap(file), dentry, true);
+	if (ret)
+		goto dput;
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	ret = -ENOENT;
+	if (dentry->d_parent == parent && !d_unhashed(dentry))
+		ret = vfs_rmdir(file_mnt_idmap(file), dir, dentry);
+	inode_unlock(dir);
+dput:
+	dput(dentry);
+drop_write:
+	mnt_drop_write_file(file);
+
+	return ret;
+}
@@ -12,8 +12,16 @@
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
 #include <linux/statfs.h>
+#include <linux/blkdev.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/bitmap.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/jbd2.h>
 
 #include "ouichefs.h"
+#include "bitmap.h"
 
 static struct kmem_cache *ouichefs_inode_cache;
 
@@ -41,52 +49,159 @@ static struct inode *ouichefs_alloc_inode(struct super_block *sb)
 	if (!ci)
 		return NULL;
 	inode_init_once(&ci->vfs_inode);
+	ci->orphan = NULL;
+	ci->rmtree = false;
+	mutex_init(&ci->map_lock);
+	jbd2_journal_init_jbd_inode(&ci->jinode, &ci->vfs_inode);
+	ci->i_sync_tid = 0;
+	ci->i_datasync_tid = 0;
+	bitmap_zero(ci->cmap, OUICHEFS_MAX_CLUSTERS);
+	/* Only files written back in clusters reserve blocks */
+	ci->rmap = NULL;
+	if (ouichefs_has_compression(OUICHEFS_SB(sb)) ||
+	    ouichefs_is_zoned(OUICHEFS_SB(sb))) {
+		ci->rmap = bitmap_zalloc(OUICHEFS_NR_CLUSTERS(sb), GFP_KERNEL);
+		if (!ci->rmap) {
+			kmem_cache_free(ouichefs_inode_cache, ci);
+			return NULL;
+		}
+	}
 	return &ci->vfs_inode;
 }
 
-static void ouichefs_destroy_inode(struct inode *inode)
+/*
+ * Called after an RCU grace period, as path walks may still be following
+ * i_link.
+ */
+static void ouichefs_free_inode(struct inode *inode)
 {
 	struct ouichefs_inode_info *ci;
 
 	ci = OUICHEFS_INODE(inode);
+	if (S_ISLNK(inode->i_mode))
+		kfree(inode->i_link);
+	bitmap_free(ci->rmap);
 	kmem_cache_free(ouichefs_inode_cache, ci);
 }
 
+/*
+ * Called when the last reference to an inode is dropped. If the inode has
+ * been unlinked, its blocks are released in the background.
+ */
+static void ouichefs_evict_inode(struct inode *inode)
+{
+	journal_t *journal = OUICHEFS_SB(inode->i_sb)->journal;
+
+	truncate_inode_pages_final(&inode->i_data);
+	ouichefs_compress_unreserve(inode, 0);
+	clear_inode(inode);
+	if (journal)
+		jbd2_journal_release_jbd_inode(journal,
+					       &OUICHEFS_INODE(inode)->jinode);
+
+	if (!inode->i_nlink)
+		ouichefs_orphan_reclaim(inode);
+}
+
+/*
+ * Copy the attributes of inode to its inode-store record raw.
+ */
+static void fill_disk_inode(struct inode *inode, void *raw)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode di, *disk_inode = &di;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_inode_v2 *v2 = raw;
+
+	/* Keep the fields not mirrored by inode, i.e. i_next_orphan */
+	ouichefs_load_inode(sb, raw, disk_inode);
+
+	/* update the mode using what the generic inode has */
+	disk_inode->i_mode = inode->i_mode;
+	disk_inode->i_uid = i_uid_read(inode);
+	disk_inode->i_gid = i_gid_read(inode);
+	disk_inode->i_size = inode->i_size;
+	disk_inode->i_flags = ci->flags;
+	disk_inode->i_extent_len = ci->ext_len;
+	disk_inode->i_blocks = inode->i_blocks;
+	disk_inode->i_nlink = inode->i_nlink;
+	disk_inode->index_block = ci->index_block;
+	ouichefs_store_inode(sb, raw, disk_inode);
+	ouichefs_store_times(sb, raw, &inode->i_ctime, &inode->i_atime,
+			     &inode->i_mtime);
+	ouichefs_store_extent_start(sb, raw, ci->ext_start);
+
+	/* Short symlink targets are stored in compact records */
+	if (S_ISLNK(inode->i_mode) && !ci->index_block) {
+		memset(v2->i_inline, 0, sizeof(v2->i_inline));
+		memcpy(v2->i_inline, inode->i_link, inode->i_size);
+	}
+	/* So is the bitmap of compressed clusters */
+	if (S_ISREG(inode->i_mode) && (ci->flags & OUICHEFS_INODE_COMPRESS)) {
+		memset(v2->i_inline, 0, sizeof(v2->i_inline));
+		bitmap_to_arr32((u32 *)v2->i_inline, ci->cmap,
+				OUICHEFS_MAX_CLUSTERS);
+	}
+}
+
+/*
+ * With a journal, inode-store records are updated as soon as the inode is
+ * dirtied, in the handle of the operation that dirtied it (or in a handle of
+ * their own). write_inode then only has to wait for a commit.
+ */
+static void ouichefs_dirty_inode(struct inode *inode, int flags)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	handle_t *handle;
+	void *raw;
+
+	if (!sbi->journal || !(flags & I_DIRTY_INODE) ||
+	    inode->i_ino >= sbi->nr_inodes)
+		return;
+
+	handle = ouichefs_journal_start(sb, OUICHEFS_INODE_CREDITS, 0);
+	if (IS_ERR(handle))
+		return;
+
+	bh = ouichefs_bread_inode(sb, inode->i_ino, &raw);
+	if (!bh)
+		goto stop;
+	if (!ouichefs_journal_get_write_access(handle, bh)) {
+		fill_disk_inode(inode, raw);
+		ouichefs_journal_dirty(handle, bh);
+		ouichefs_journal_update_tid(handle, inode,
+					    flags & I_DIRTY_DATASYNC);
+	}
+	brelse(bh);
+stop:
+	ouichefs_journal_stop(handle);
+}
+
 static int ouichefs_write_inode(struct inode *inode,
 				struct writeback_control *wbc)
 {
-	struct ouichefs_inode *disk_inode;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct super_block *sb = inode->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh;
 	uint32_t ino = inode->i_ino;
-	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK) + 1;
-	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK;
+	void *raw;
 
 	if (ino >= sbi->nr_inodes)
 		return 0;
 
-	bh = sb_bread(sb, inode_block);
+	/* The record is already in the journal, sync_fs commits it */
+	if (sbi->journal) {
+		if (wbc->sync_mode != WB_SYNC_ALL || wbc->for_sync)
+			return 0;
+		return jbd2_journal_force_commit(sbi->journal);
+	}
+
+	bh = ouichefs_bread_inode(sb, ino, &raw);
 	if (!bh)
 		return -EIO;
-	disk_inode = (struct ouichefs_inode *)bh->b_data;
-	disk_inode += inode_shift;
-
-	/* update the mode using what the generic inode has */
-	disk_inode->i_mode = inode->i_mode;
-	disk_inode->i_uid = i_uid_read(inode);
-	disk_inode->i_gid = i_gid_read(inode);
-	disk_inode->i_size = inode->i_size;
-	disk_inode->i_ctime = inode->i_ctime.tv_sec;
-	disk_inode->i_nctime = inode->i_ctime.tv_nsec;
-	disk_inode->i_atime = inode->i_atime.tv_sec;
-	disk_inode->i_natime = inode->i_atime.tv_nsec;
-	disk_inode->i_mtime = inode->i_mtime.tv_sec;
-	disk_inode->i_nmtime = inode->i_mtime.tv_nsec;
-	disk_inode->i_blocks = inode->i_blocks;
-	disk_inode->i_nlink = inode->i_nlink;
-	disk_inode->index_block = ci->index_block;
+	fill_disk_inode(inode, raw);
 
 	mark_buffer_dirty(bh);
 	sync_dirty_buffer(bh);
@@ -102,18 +217,21 @@ static int sync_sb_info(struct super_block *sb, int wait)
 	struct buffer_head *bh;
 
 	/* Flush superblock */
-	bh = sb_bread(sb, 0);
+	bh = ouichefs_bread(sb, 0);
 	if (!bh)
 		return -EIO;
 	disk_sb = (struct ouichefs_sb_info *)bh->b_data;
 
-	disk_sb->nr_blocks = sbi->nr_blocks;
+	disk_sb->nr_blocks = lower_32_bits(sbi->blocks_count);
 	disk_sb->nr_inodes = sbi->nr_inodes;
 	disk_sb->nr_istore_blocks = sbi->nr_istore_blocks;
 	disk_sb->nr_ifree_blocks = sbi->nr_ifree_blocks;
 	disk_sb->nr_bfree_blocks = sbi->nr_bfree_blocks;
 	disk_sb->nr_free_inodes = sbi->nr_free_inodes;
-	disk_sb->nr_free_blocks = sbi->nr_free_blocks;
+	disk_sb->nr_free_blocks = lower_32_bits(sbi->free_blocks_count);
+	disk_sb->orphan_head = sbi->orphan_head;
+	disk_sb->nr_blocks_hi = upper_32_bits(sbi->blocks_count);
+	disk_sb->nr_free_blocks_hi = upper_32_bits(sbi->free_blocks_count);
 
 	mark_buffer_dirty(bh);
 	if (wait)
@@ -133,13 +251,17 @@ static int sync_ifree(struct super_block *sb, int wait)
 	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
 		idx = sbi->nr_istore_blocks + i + 1;
 
-		bh = sb_bread(sb, idx);
+		/* The whole block is overwritten, no need to read it */
+		bh = ouichefs_getblk(sb, idx);
 		if (!bh)
-			return -EIO;
+			return -ENOMEM;
 
+		lock_buffer(bh);
 		memcpy(bh->b_data,
-		       (void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
+		       (void *)sbi->ifree_bitmap + i * sb->s_blocksize,
+		       sb->s_blocksize);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
 
 		mark_buffer_dirty(bh);
 		if (wait)
@@ -160,13 +282,17 @@ static int sync_bfree(struct super_block *sb, int wait)
 	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
 		idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
 
-		bh = sb_bread(sb, idx);
+		/* The whole block is overwritten, no need to read it */
+		bh = ouichefs_getblk(sb, idx);
 		if (!bh)
-			return -EIO;
+			return -ENOMEM;
 
+		lock_buffer(bh);
 		memcpy(bh->b_data,
-		       (void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
+		       (void *)sbi->bfree_bitmap + i * sb->s_blocksize,
+		       sb->s_blocksize);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
 
 		mark_buffer_dirty(bh);
 		if (wait)
@@ -177,21 +303,46 @@ static int sync_bfree(struct super_block *sb, int wait)
 	return 0;
 }
 
+static int ouichefs_sync_fs(struct super_block *sb, int wait);
+
 static void ouichefs_put_super(struct super_block *sb)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 
 	if (sbi) {
-		kfree(sbi->ifree_bitmap);
-		kfree(sbi->bfree_bitmap);
+		/* Orphans released after the last sync must reach the disk */
+		ouichefs_orphan_destroy(sb);
+		if (!sb_rdonly(sb))
+			ouichefs_sync_fs(sb, 1);
+		if (ouichefs_journal_destroy(sb))
+			pr_err("failed to checkpoint journal\n");
+		ouichefs_zone_destroy(sb);
+		if (sbi->meta_bdev)
+			blkdev_put(sbi->meta_bdev, sb);
+
+		kvfree(sbi->ifree_bitmap);
+		kvfree(sbi->bfree_bitmap);
 		kfree(sbi);
 	}
 }
 
 static int ouichefs_sync_fs(struct super_block *sb, int wait)
 {
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	journal_t *journal = sbi->journal;
+	tid_t target;
 	int ret = 0;
 
+	/*
+	 * With a journal, all metadata is in the running transaction. Free
+	 * counts are not journaled, they are recomputed at mount.
+	 */
+	if (journal) {
+		if (jbd2_journal_start_commit(journal, &target) && wait)
+			ret = jbd2_log_wait_commit(journal, target);
+		return ret;
+	}
+
 	ret = sync_sb_info(sb, wait);
 	if (ret)
 		return ret;
@@ -202,6 +353,45 @@ static int ouichefs_sync_fs(struct super_block *sb, int wait)
 	if (ret)
 		return ret;
 
+	/* The VFS only writes back the buffers of the main device */
+	if (sbi->meta_bdev) {
+		if (wait)
+			return sync_blockdev(sbi->meta_bdev);
+		return sync_blockdev_nowait(sbi->meta_bdev);
+	}
+
+	return 0;
+}
+
+/*
+ * Called by freeze_super() once writers are stopped and dirty data written
+ * back. Take the pending snapshot, if any, then write everything back. The
+ * journal is emptied and kept locked until the partition is thawed.
+ */
+static int ouichefs_freeze_fs(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	journal_t *journal = sbi->journal;
+	int ret;
+
+	ouichefs_snapshot_freeze(sb);
+
+	if (!journal)
+		return sync_filesystem(sb);
+
+	jbd2_journal_lock_updates(journal);
+	ret = jbd2_journal_flush(journal, 0);
+	if (ret)
+		jbd2_journal_unlock_updates(journal);
+	return ret;
+}
+
+static int ouichefs_unfreeze_fs(struct super_block *sb)
+{
+	journal_t *journal = OUICHEFS_SB(sb)->journal;
+
+	if (journal)
+		jbd2_journal_unlock_updates(journal);
 	return 0;
 }
 
@@ -211,10 +401,10 @@ static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 
 	stat->f_type = OUICHEFS_MAGIC;
-	stat->f_bsize = OUICHEFS_BLOCK_SIZE;
-	stat->f_blocks = sbi->nr_blocks;
-	stat->f_bfree = sbi->nr_free_blocks;
-	stat->f_bavail = sbi->nr_free_blocks;
+	stat->f_bsize = sb->s_blocksize;
+	stat->f_blocks = sbi->blocks_count;
+	stat->f_bfree = ouichefs_avail_blocks(sbi);
+	stat->f_bavail = ouichefs_avail_blocks(sbi);
 	stat->f_files = sbi->nr_inodes;
 	stat->f_ffree = sbi->nr_free_inodes;
 	stat->f_namelen = OUICHEFS_FILENAME_LEN;
@@ -222,15 +412,176 @@ static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
 	return 0;
 }
 
+static int ouichefs_show_options(struct seq_file *seq, struct dentry *root)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(root->d_sb);
+
+	if (sbi->mount_opts & OUICHEFS_MOUNT_SCRUB)
+		seq_puts(seq, ",scrub");
+	else if (sbi->mount_opts & OUICHEFS_MOUNT_DISCARD)
+		seq_puts(seq, ",discard");
+	else
+		seq_puts(seq, ",nodiscard");
+	if (sbi->meta_bdev)
+		seq_printf(seq, ",metadev=/dev/%pg", sbi->meta_bdev);
+
+	return 0;
+}
+
 static struct super_operations ouichefs_super_ops = {
 	.put_super = ouichefs_put_super,
 	.alloc_inode = ouichefs_alloc_inode,
-	.destroy_inode = ouichefs_destroy_inode,
+	.free_inode = ouichefs_free_inode,
+	.evict_inode = ouichefs_evict_inode,
+	.dirty_inode = ouichefs_dirty_inode,
 	.write_inode = ouichefs_write_inode,
 	.sync_fs = ouichefs_sync_fs,
+	.freeze_fs = ouichefs_freeze_fs,
+	.unfreeze_fs = ouichefs_unfreeze_fs,
 	.statfs = ouichefs_statfs,
+	.show_options = ouichefs_show_options,
+};
+
+enum { Opt_discard, Opt_nodiscard, Opt_scrub, Opt_metadev, Opt_err };
+
+static const match_table_t tokens = {
+	{ Opt_discard, "discard" },
+	{ Opt_nodiscard, "nodiscard" },
+	{ Opt_scrub, "scrub" },
+	{ Opt_metadev, "metadev=%s" },
+	{ Opt_err, NULL },
 };
 
+/*
+ * Parse mount options. Freed blocks are discarded by default if the device
+ * supports it, except in zoned mode where blocks are only reused once their
+ * zone is reset, and scrubbing would rewrite them in place. The path of the
+ * metadata device, if given, is returned in *metadev, to be freed by the
+ * caller.
+ */
+static int parse_options(struct super_block *sb, char *options,
+			 char **metadev)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+
+	if (bdev_max_discard_sectors(sb->s_bdev) && !ouichefs_is_zoned(sbi))
+		sbi->mount_opts |= OUICHEFS_MOUNT_DISCARD;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, tokens, args)) {
+		case Opt_discard:
+			if (ouichefs_is_zoned(sbi))
+				goto zoned;
+			if (!bdev_max_discard_sectors(sb->s_bdev)) {
+				pr_warn("device does not support discard\n");
+				break;
+			}
+			sbi->mount_opts |= OUICHEFS_MOUNT_DISCARD;
+			break;
+		case Opt_nodiscard:
+			sbi->mount_opts &= ~OUICHEFS_MOUNT_DISCARD;
+			break;
+		case Opt_scrub:
+			if (ouichefs_is_zoned(sbi))
+				goto zoned;
+			sbi->mount_opts |= OUICHEFS_MOUNT_SCRUB;
+			break;
+		case Opt_metadev:
+			kfree(*metadev);
+			*metadev = match_strdup(&args[0]);
+			if (!*metadev)
+				return -ENOMEM;
+			break;
+		default:
+			pr_err("unknown mount option '%s'\n", p);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+
+zoned:
+	pr_err("'%s' is not supported on zoned devices\n", p);
+	return -EINVAL;
+}
+
+/*
+ * Open the metadata device at path, for partitions that have one, and check
+ * that it was formatted along with the main device. The superblock copy on
+ * the main device is not updated after mkfs, so the fields that change are
+ * read again from the metadata device.
+ */
+static int open_metadev(struct super_block *sb, const char *path)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_sb_info *csb;
+	struct block_device *bdev;
+	struct buffer_head *bh;
+	uint32_t meta_end = ouichefs_meta_end(sbi);
+	unsigned int shift = sb->s_blocksize_bits - SECTOR_SHIFT;
+	int ret;
+
+	if (!(sbi->features & OUICHEFS_FEATURE_METADEV)) {
+		if (!path)
+			return 0;
+		pr_err("partition has no metadata device\n");
+		return -EINVAL;
+	}
+	if (!path) {
+		pr_err("metadata device required (metadev=)\n");
+		return -EINVAL;
+	}
+	if (bdev_nr_sectors(sb->s_bdev) >> shift < sbi->blocks_count) {
+		pr_err("main device smaller than the partition\n");
+		return -EINVAL;
+	}
+
+	bdev = blkdev_get_by_path(path, sb_open_mode(sb->s_flags), sb, NULL);
+	if (IS_ERR(bdev)) {
+		pr_err("failed to open metadata device %s (%ld)\n", path,
+		       PTR_ERR(bdev));
+		return PTR_ERR(bdev);
+	}
+	ret = set_blocksize(bdev, sb->s_blocksize);
+	if (ret)
+		goto put;
+	if (bdev_nr_sectors(bdev) >> shift < meta_end) {
+		pr_err("metadata device too small (%u blocks needed)\n",
+		       meta_end);
+		ret = -EINVAL;
+		goto put;
+	}
+
+	bh = __bread(bdev, OUICHEFS_SB_BLOCK_NR, sb->s_blocksize);
+	if (!bh) {
+		ret = -EIO;
+		goto put;
+	}
+	csb = (struct ouichefs_sb_info *)bh->b_data;
+	if (csb->magic != OUICHEFS_MAGIC ||
+	    memcmp(csb->uuid, sbi->uuid, sizeof(sbi->uuid))) {
+		pr_err("%s is not the metadata device of this partition\n",
+		       path);
+		ret = -EINVAL;
+	}
+	sbi->orphan_head = csb->orphan_head;
+	brelse(bh);
+	if (ret)
+		goto put;
+
+	sbi->meta_bdev = bdev;
+	return 0;
+
+put:
+	blkdev_put(bdev, sb);
+	return ret;
+}
+
 /* Fill the struct superblock from partition superblock */
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 {
@@ -238,12 +589,13 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	struct ouichefs_sb_info *csb = NULL;
 	struct ouichefs_sb_info *sbi = NULL;
 	struct inode *root_inode = NULL;
+	char *metadev = NULL;
+	uint32_t block_size;
 	int ret = 0, i;
 
-	/* Init sb */
+	/* Init sb, with the smallest block size until the superblock is read */
 	sb->s_magic = OUICHEFS_MAGIC;
-	sb_set_blocksize(sb, OUICHEFS_BLOCK_SIZE);
-	sb->s_maxbytes = OUICHEFS_MAX_FILESIZE;
+	sb_set_blocksize(sb, OUICHEFS_MIN_BLOCK_SIZE);
 	sb->s_op = &ouichefs_super_ops;
 	sb->s_time_gran = 1;
 
@@ -259,6 +611,42 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		ret = -EPERM;
 		goto release;
 	}
+	if (csb->features & ~OUICHEFS_FEATURES_SUPPORTED) {
+		pr_err("unsupported features %#x\n",
+		       csb->features & ~OUICHEFS_FEATURES_SUPPORTED);
+		ret = -EINVAL;
+		goto release;
+	}
+
+	/*
+	 * The superblock starts block 0 whatever the block size, read it again
+	 * once the block size is set. The page cache cannot hold blocks larger
+	 * than a page; a page holds several smaller blocks.
+	 */
+	block_size = OUICHEFS_MIN_BLOCK_SIZE;
+	if (csb->features & OUICHEFS_FEATURE_BLOCK_SIZE)
+		block_size = csb->block_size;
+	if (block_size != OUICHEFS_MIN_BLOCK_SIZE &&
+	    (!is_power_of_2(block_size) ||
+	     block_size < OUICHEFS_MIN_BLOCK_SIZE ||
+	     block_size > 1 << OUICHEFS_MAX_BLOCK_SHIFT)) {
+		pr_err("invalid block size %u\n", block_size);
+		ret = -EUCLEAN;
+		goto release;
+	}
+	if (block_size != OUICHEFS_MIN_BLOCK_SIZE) {
+		brelse(bh);
+		bh = NULL;
+		if (!sb_set_blocksize(sb, block_size)) {
+			pr_err("unsupported block size %u (page size %lu)\n",
+			       block_size, PAGE_SIZE);
+			return -EINVAL;
+		}
+		bh = sb_bread(sb, OUICHEFS_SB_BLOCK_NR);
+		if (!bh)
+			return -EIO;
+		csb = (struct ouichefs_sb_info *)bh->b_data;
+	}
 
 	/* Alloc sb_info */
 	sbi = kzalloc(sizeof(struct ouichefs_sb_info), GFP_KERNEL);
@@ -266,42 +654,157 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		ret = -ENOMEM;
 		goto release;
 	}
-	sbi->nr_blocks = csb->nr_blocks;
 	sbi->nr_inodes = csb->nr_inodes;
 	sbi->nr_istore_blocks = csb->nr_istore_blocks;
 	sbi->nr_ifree_blocks = csb->nr_ifree_blocks;
 	sbi->nr_bfree_blocks = csb->nr_bfree_blocks;
 	sbi->nr_free_inodes = csb->nr_free_inodes;
-	sbi->nr_free_blocks = csb->nr_free_blocks;
+	sbi->orphan_head = csb->orphan_head;
+	sbi->blocks_count = csb->nr_blocks;
+	if (csb->features & OUICHEFS_FEATURE_64BIT)
+		sbi->blocks_count |= (uint64_t)csb->nr_blocks_hi << 32;
+	sbi->features = csb->features;
+	sbi->nr_journal_blocks = csb->nr_journal_blocks;
+	sbi->nr_refcount_blocks = csb->nr_refcount_blocks;
+	sbi->nr_meta_blocks = csb->nr_meta_blocks;
+	memcpy(sbi->uuid, csb->uuid, sizeof(sbi->uuid));
+	sbi->zone_blocks = csb->zone_blocks;
+	sbi->block_size = block_size;
+	spin_lock_init(&sbi->bitmap_lock);
+	spin_lock_init(&sbi->refcount_lock);
+	mutex_init(&sbi->snapshot_lock);
+	sbi->sb = sb;
 	sb->s_fs_info = sbi;
+	sb->s_maxbytes = OUICHEFS_MAX_FILESIZE(sb);
+	/* 32-bit seconds, or 64-bit nanoseconds in compact inodes */
+	sb->s_time_min = 0;
+	if (ouichefs_compact_inodes(sbi))
+		sb->s_time_max = div_u64(U64_MAX, NSEC_PER_SEC) - 1;
+	else
+		sb->s_time_max = U32_MAX;
 
 	brelse(bh);
+	bh = NULL;
+
+	/* Only compact records hold the high bits of extent starts */
+	if (ouichefs_has_64bit(sbi) && !ouichefs_compact_inodes(sbi)) {
+		pr_err("64-bit partition without compact inodes\n");
+		ret = -EUCLEAN;
+		goto free_sbi;
+	}
+	/* The bfree bitmap is indexed with unsigned longs */
+	if (BITS_PER_LONG < 64 && sbi->blocks_count > U32_MAX) {
+		pr_err("partitions above 2^32 blocks need a 64-bit kernel\n");
+		ret = -EINVAL;
+		goto free_sbi;
+	}
+	if ((uint64_t)sbi->nr_bfree_blocks << (sb->s_blocksize_bits + 3) <
+	    sbi->blocks_count) {
+		pr_err("bfree bitmap too small for %llu blocks\n",
+		       sbi->blocks_count);
+		ret = -EUCLEAN;
+		goto free_sbi;
+	}
+
+	/* The inode store must be large enough for the record layout in use */
+	if (!sbi->nr_inodes ||
+	    ouichefs_inode_block(sbi, sbi->nr_inodes - 1) >
+		    sbi->nr_istore_blocks) {
+		pr_err("inode store too small for %u inodes\n", sbi->nr_inodes);
+		ret = -EUCLEAN;
+		goto free_sbi;
+	}
+
+	/* The refcount table must have a counter for every block */
+	if (ouichefs_has_reflink(sbi) &&
+	    ((uint64_t)sbi->nr_refcount_blocks * OUICHEFS_REFS_PER_BLOCK(sb) <
+		     sbi->blocks_count ||
+	     ouichefs_refcount_start(sbi) + sbi->nr_refcount_blocks >
+		     sbi->blocks_count)) {
+		pr_err("invalid refcount table (%u blocks)\n",
+		       sbi->nr_refcount_blocks);
+		ret = -EUCLEAN;
+		goto free_sbi;
+	}
+	if (!ouichefs_has_reflink(sbi))
+		sbi->nr_refcount_blocks = 0;
+
+	if (ouichefs_meta_end(sbi) > sbi->blocks_count) {
+		pr_err("invalid metadata zone (%u blocks)\n",
+		       sbi->nr_meta_blocks);
+		ret = -EUCLEAN;
+		goto free_sbi;
+	}
+
+	/*
+	 * The bitmap of compressed clusters is stored in compact records, and
+	 * only covers the index block of 4 KiB blocks
+	 */
+	if (ouichefs_has_compression(sbi) &&
+	    (!ouichefs_compact_inodes(sbi) ||
+	     sb->s_blocksize != OUICHEFS_MIN_BLOCK_SIZE)) {
+		pr_err("compression requires compact inodes and 4 KiB blocks\n");
+		ret = -EUCLEAN;
+		goto free_sbi;
+	}
+	if (ouichefs_has_compression(sbi) && !ouichefs_clusters_fit(sb))
+		pr_warn("compressed files cannot be opened with %lu-byte pages\n",
+			PAGE_SIZE);
+
+	ret = parse_options(sb, data, &metadev);
+	if (!ret)
+		ret = open_metadev(sb, metadev);
+	kfree(metadev);
+	if (ret)
+		goto free_sbi;
+
+	ret = ouichefs_zone_init(sb);
+	if (ret)
+		goto put_metadev;
+
+	/* Replay the journal before reading any other metadata */
+	ret = ouichefs_journal_load(sb);
+	if (ret)
+		goto destroy_zones;
+	if (sbi->journal) {
+		/* The replay may have updated the superblock */
+		bh = ouichefs_bread(sb, OUICHEFS_SB_BLOCK_NR);
+		if (!bh) {
+			ret = -EIO;
+			goto destroy_journal;
+		}
+		csb = (struct ouichefs_sb_info *)bh->b_data;
+		sbi->orphan_head = csb->orphan_head;
+		brelse(bh);
+		bh = NULL;
+	}
 
 	/* Alloc and copy ifree_bitmap */
 	sbi->ifree_bitmap =
-		kzalloc(sbi->nr_ifree_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
+		kvzalloc(sbi->nr_ifree_blocks * sb->s_blocksize, GFP_KERNEL);
 	if (!sbi->ifree_bitmap) {
 		ret = -ENOMEM;
-		goto free_sbi;
+		goto destroy_journal;
 	}
 	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
 		int idx = sbi->nr_istore_blocks + i + 1;
 
-		bh = sb_bread(sb, idx);
+		bh = ouichefs_bread(sb, idx);
 		if (!bh) {
 			ret = -EIO;
 			goto free_ifree;
 		}
 
-		memcpy((void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       bh->b_data, OUICHEFS_BLOCK_SIZE);
+		memcpy((void *)sbi->ifree_bitmap + i * sb->s_blocksize,
+		       bh->b_data, sb->s_blocksize);
 
 		brelse(bh);
 	}
+	bh = NULL;
 
 	/* Alloc and copy bfree_bitmap */
 	sbi->bfree_bitmap =
-		kzalloc(sbi->nr_bfree_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
+		kvzalloc(sbi->nr_bfree_blocks * sb->s_blocksize, GFP_KERNEL);
 	if (!sbi->bfree_bitmap) {
 		ret = -ENOMEM;
 		goto free_ifree;
@@ -309,17 +812,26 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
 		int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
 
-		bh = sb_bread(sb, idx);
+		bh = ouichefs_bread(sb, idx);
 		if (!bh) {
 			ret = -EIO;
 			goto free_bfree;
 		}
 
-		memcpy((void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       bh->b_data, OUICHEFS_BLOCK_SIZE);
+		memcpy((void *)sbi->bfree_bitmap + i * sb->s_blocksize,
+		       bh->b_data, sb->s_blocksize);
 
 		brelse(bh);
 	}
+	bh = NULL;
+
+	/*
+	 * Free counts are not kept up to date on disk with a journal, and
+	 * may be stale after a crash without one: recount them.
+	 */
+	sbi->nr_free_inodes = bitmap_weight(sbi->ifree_bitmap, sbi->nr_inodes);
+	sbi->free_blocks_count =
+		ouichefs_bitmap_weight(sbi->bfree_bitmap, sbi->blocks_count);
 
 	/* Create root inode */
 	root_inode = ouichefs_iget(sb, 1);
@@ -328,20 +840,36 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		goto free_bfree;
 	}
 	inode_init_owner(&nop_mnt_idmap, root_inode, NULL, root_inode->i_mode);
+	jbd2_journal_init_jbd_inode(&sbi->data_jinode, root_inode);
 	sb->s_root = d_make_root(root_inode);
 	if (!sb->s_root) {
 		ret = -ENOMEM;
 		goto iput;
 	}
 
+	/* Finish releasing the blocks of orphans left on disk */
+	ret = ouichefs_orphan_init(sb);
+	if (ret) {
+		dput(sb->s_root);
+		sb->s_root = NULL;
+		goto free_bfree;
+	}
+
 	return 0;
 
 iput:
 	iput(root_inode);
 free_bfree:
-	kfree(sbi->bfree_bitmap);
+	kvfree(sbi->bfree_bitmap);
 free_ifree:
-	kfree(sbi->ifree_bitmap);
+	kvfree(sbi->ifree_bitmap);
+destroy_journal:
+	ouichefs_journal_destroy(sb);
+destroy_zones:
+	ouichefs_zone_destroy(sb);
+put_metadev:
+	if (sbi->meta_bdev)
+		blkdev_put(sbi->meta_bdev, sb);
 free_sbi:
 	kfree(sbi);
 release:
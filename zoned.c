@@ -0,0 +1,582 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/math64.h>
+#include <linux/xarray.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * Zoned block devices
+ *
+ * With OUICHEFS_FEATURE_ZONED, the data blocks are split in zones of
+ * zone_blocks blocks, which can only be written sequentially and must be
+ * reset before being written again. Only the first zone_cap[z] blocks of
+ * zone z can be written: the others stay free in the bitmap, and are counted
+ * in reserved_blocks so that nothing is promised on them. Metadata stays in
+ * the conventional zones at the start of the device (or on the metadata
+ * device), where it is updated in place, and the metadata zone does not
+ * spill over into the data zones.
+ *
+ * All regular files are written back in clusters, as compressed files are
+ * (see compress.c), whether they are compressed or not: their clusters are
+ * always written to new blocks at writeback, never overwritten. Blocks
+ * are allocated at the write pointer of the open zone, and a cluster is
+ * allocated and written under zone_lock, so that the device receives the
+ * writes in order. Once the open zone is full, an empty zone (one with no
+ * block in use) is reset and opened in its place. Zones partly written
+ * before the last mount are only reused once emptied.
+ *
+ * Blocks freed in a zone cannot be reused until the whole zone is free. The
+ * collector (gc_work) keeps OUICHEFS_ZONE_RESERVE zones empty: it picks the
+ * zone with the fewest blocks in use, finds the files using them by scanning
+ * the inode store, snapshots included, and copies each block to the open
+ * zone. A block shared by several files is copied once, and each of them is
+ * pointed to the copy in turn.
+ */
+
+static inline uint32_t nr_zones(struct ouichefs_sb_info *sbi)
+{
+	return div_u64(sbi->blocks_count, sbi->zone_blocks);
+}
+
+/* First zone holding data blocks */
+static inline uint32_t first_zone(struct ouichefs_sb_info *sbi)
+{
+	return DIV_ROUND_UP(ouichefs_meta_end(sbi), sbi->zone_blocks);
+}
+
+/* Zone being written, U32_MAX if none */
+static inline uint32_t open_zone_nr(struct ouichefs_sb_info *sbi)
+{
+	uint64_t end = READ_ONCE(sbi->zone_end);
+
+	return end ? div_u64(end - 1, sbi->zone_blocks) : U32_MAX;
+}
+
+/*
+ * Number of blocks in use in zone z. The bitmap is read without its lock:
+ * data blocks are only allocated under zone_lock, so a zone seen empty by
+ * its holder stays empty.
+ */
+static uint32_t zone_used(struct ouichefs_sb_info *sbi, uint32_t z)
+{
+	unsigned long bit = (unsigned long)z * sbi->zone_blocks;
+	unsigned long end = bit + sbi->zone_cap[z];
+	uint32_t nr_free = 0;
+
+	for_each_set_bit_from(bit, sbi->bfree_bitmap, end)
+		nr_free++;
+
+	return sbi->zone_cap[z] - nr_free;
+}
+
+static void queue_gc(struct ouichefs_sb_info *sbi)
+{
+	if (!READ_ONCE(sbi->gc_stopped))
+		queue_work(system_unbound_wq, &sbi->gc_work);
+}
+
+/*
+ * Reset the first empty zone after the open one and open it, and wake the
+ * collector up if few empty zones are left. Called with zone_lock held.
+ */
+static int open_zone(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	unsigned int shift = sb->s_blocksize_bits - SECTOR_SHIFT;
+	uint32_t first = first_zone(sbi), nr = nr_zones(sbi) - first;
+	uint32_t cur = open_zone_nr(sbi), z = U32_MAX, zi, i, nr_empty = 0;
+	int ret;
+
+	for (i = 1; i <= nr; i++) {
+		zi = first + ((cur == U32_MAX ? 0 : cur - first) + i) % nr;
+		if (zi == cur || !sbi->zone_cap[zi] || zone_used(sbi, zi))
+			continue;
+		if (z == U32_MAX)
+			z = zi;
+		else
+			nr_empty++;
+	}
+	if (nr_empty < OUICHEFS_ZONE_RESERVE)
+		queue_gc(sbi);
+	if (z == U32_MAX)
+		return -ENOSPC;
+
+	if (test_bit(z, sbi->seq_zones)) {
+		ret = blkdev_zone_mgmt(sb->s_bdev, REQ_OP_ZONE_RESET,
+				       (sector_t)z * sbi->zone_blocks << shift,
+				       (sector_t)sbi->zone_blocks << shift,
+				       GFP_NOFS);
+		if (ret) {
+			pr_err("failed to reset zone %u (%d)\n", z, ret);
+			return ret;
+		}
+	}
+	sbi->zone_wp = (uint64_t)z * sbi->zone_blocks;
+	WRITE_ONCE(sbi->zone_end, sbi->zone_wp + sbi->zone_cap[z]);
+
+	return 0;
+}
+
+/*
+ * Allocate n data blocks at the write pointer in handle and store them in
+ * blocks. Called with zone_lock held, which must be kept until they are
+ * written. On failure, none of them is left allocated.
+ */
+int ouichefs_zone_alloc(handle_t *handle, struct super_block *sb,
+			uint64_t *blocks, int n)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	int i, ret;
+
+	for (i = 0; i < n; i++) {
+		if (sbi->zone_wp == sbi->zone_end) {
+			ret = open_zone(sb);
+			if (ret)
+				goto release;
+		}
+		/* Blocks past the write pointer are never in use */
+		if (WARN_ON(!get_block_at(sbi, sbi->zone_wp))) {
+			ouichefs_zone_close(sb);
+			ret = -EUCLEAN;
+			goto release;
+		}
+		blocks[i] = sbi->zone_wp++;
+		ret = ouichefs_journal_bfree(handle, sb, blocks[i], 1, false);
+		if (ret) {
+			put_block(sbi, blocks[i]);
+			goto release;
+		}
+	}
+
+	return 0;
+
+release:
+	if (i)
+		ouichefs_release_blocks(handle, sb, blocks, i);
+	return ret;
+}
+
+/*
+ * Stop writing to the open zone, e.g. because a failed write left its write
+ * pointer unknown. Called with zone_lock held.
+ */
+void ouichefs_zone_close(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	sbi->zone_wp = sbi->zone_end;
+}
+
+/*
+ * Write a copy of block bno to a new block of the open zone, and store it in
+ * *copy. Called with zone_lock held.
+ */
+static int copy_block(handle_t *handle, struct super_block *sb, uint64_t bno,
+		      uint64_t *copy)
+{
+	struct buffer_head *bh, *bh_copy;
+	int ret;
+
+	bh = ouichefs_bread(sb, bno);
+	if (!bh)
+		return -EIO;
+	ret = ouichefs_zone_alloc(handle, sb, copy, 1);
+	if (ret)
+		goto brelse;
+
+	bh_copy = ouichefs_getblk(sb, *copy);
+	if (!bh_copy) {
+		ret = -ENOMEM;
+		goto release;
+	}
+	lock_buffer(bh_copy);
+	memcpy(bh_copy->b_data, bh->b_data, sb->s_blocksize);
+	set_buffer_uptodate(bh_copy);
+	unlock_buffer(bh_copy);
+	mark_buffer_dirty(bh_copy);
+	ret = sync_dirty_buffer(bh_copy);
+	brelse(bh_copy);
+	if (!ret)
+		goto brelse;
+
+release:
+	ouichefs_zone_close(sb);
+	ouichefs_release_blocks(handle, sb, copy, 1);
+brelse:
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Point entry i of the index block of inode, which mapped block bno of the
+ * zone being emptied, to a copy of bno. moved holds the copies of shared
+ * blocks already made for other files, each with a reference of its own
+ * until the zone is emptied.
+ */
+static int move_block(struct super_block *sb, struct inode *inode,
+		      uint32_t i, uint64_t bno, struct xarray *moved)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh;
+	handle_t *handle;
+	uint64_t copy;
+	void *entry;
+	int ret;
+
+	handle = ouichefs_journal_start(sb, OUICHEFS_MOVE_CREDITS, 0);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	entry = xa_load(moved, bno);
+	if (entry) {
+		copy = xa_to_value(entry);
+		ret = ouichefs_refcount_get(handle, sb, copy);
+		if (ret)
+			goto stop;
+	} else {
+		ret = ouichefs_block_shared(sb, bno, false);
+		if (ret < 0)
+			goto stop;
+		mutex_lock(&sbi->zone_lock);
+		ret = copy_block(handle, sb, bno, &copy) ?: ret;
+		mutex_unlock(&sbi->zone_lock);
+		if (ret < 0)
+			goto stop;
+		/* The other files sharing bno are pointed to copy later */
+		if (ret) {
+			ret = ouichefs_refcount_get(handle, sb, copy);
+			if (ret)
+				goto release;
+			ret = xa_err(xa_store(moved, bno, xa_mk_value(copy),
+					      GFP_NOFS));
+			if (ret) {
+				ouichefs_release_blocks(handle, sb, &copy, 1);
+				goto release;
+			}
+		}
+	}
+	ret = ouichefs_journal_data(handle, inode,
+				    (loff_t)i << sb->s_blocksize_bits,
+				    sb->s_blocksize);
+	if (ret)
+		goto release;
+
+	/* Writeback may have moved the block meanwhile */
+	mutex_lock(&ci->map_lock);
+	bh = ouichefs_bread(sb, ci->index_block);
+	if (!bh) {
+		ret = -EIO;
+		goto unlock;
+	}
+	index = (struct ouichefs_file_index_block *)bh->b_data;
+	if (ouichefs_index_get(sb, index, i) != bno) {
+		ret = -EAGAIN;
+		goto brelse;
+	}
+	ret = ouichefs_journal_get_write_access(handle, bh);
+	if (ret)
+		goto brelse;
+	ouichefs_index_set(sb, index, i, copy);
+	ret = ouichefs_journal_dirty(handle, bh);
+brelse:
+	brelse(bh);
+unlock:
+	mutex_unlock(&ci->map_lock);
+	if (!ret) {
+		ouichefs_release_blocks(handle, sb, &bno, 1);
+		goto stop;
+	}
+	if (ret == -EAGAIN)
+		ret = 0;
+release:
+	ouichefs_release_blocks(handle, sb, &copy, 1);
+stop:
+	return ouichefs_journal_stop(handle) ?: ret;
+}
+
+/*
+ * Move the blocks of inode in [start, end) out of their zone.
+ */
+static int evacuate_inode(struct super_block *sb, struct inode *inode,
+			  uint64_t start, uint64_t end, struct xarray *moved)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh;
+	uint64_t bno;
+	uint32_t i;
+	int ret = 0;
+
+	for (i = 0; i < OUICHEFS_INDEX_ENTRIES(sb) && !ret; i++) {
+		mutex_lock(&ci->map_lock);
+		bh = ouichefs_bread(sb, ci->index_block);
+		if (!bh) {
+			mutex_unlock(&ci->map_lock);
+			return -EIO;
+		}
+		index = (struct ouichefs_file_index_block *)bh->b_data;
+		bno = ouichefs_index_get(sb, index, i);
+		brelse(bh);
+		mutex_unlock(&ci->map_lock);
+		if (bno >= start && bno < end)
+			ret = move_block(sb, inode, i, bno, moved);
+		cond_resched();
+	}
+
+	return ret;
+}
+
+/*
+ * Move the blocks of zone z used by files, found by scanning the inode
+ * store, to the open zone.
+ */
+static int evacuate_zone(struct super_block *sb, uint32_t z)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint64_t start = (uint64_t)z * sbi->zone_blocks;
+	uint64_t end = start + sbi->zone_cap[z], bno;
+	struct ouichefs_file_index_block *index;
+	struct ouichefs_inode di;
+	struct buffer_head *bh;
+	struct inode *inode;
+	unsigned long old;
+	handle_t *handle;
+	uint32_t ino, i;
+	void *entry, *raw;
+	int ret = 0;
+	DEFINE_XARRAY(moved);
+
+	for (ino = 1; ino < sbi->nr_inodes && !ret; ino++) {
+		if (READ_ONCE(sbi->gc_stopped))
+			break;
+		if (test_bit(ino, sbi->ifree_bitmap))
+			continue;
+
+		bh = ouichefs_bread_inode(sb, ino, &raw);
+		if (!bh) {
+			ret = -EIO;
+			break;
+		}
+		ouichefs_load_inode(sb, raw, &di);
+		brelse(bh);
+		/* Skip files being created or released, and inline data */
+		if (!S_ISREG(di.i_mode) || !di.i_nlink || !di.index_block ||
+		    (di.i_flags & OUICHEFS_INODE_INLINE))
+			continue;
+
+		bh = ouichefs_bread(sb, di.index_block);
+		if (!bh) {
+			ret = -EIO;
+			break;
+		}
+		index = (struct ouichefs_file_index_block *)bh->b_data;
+		for (i = 0; i < OUICHEFS_INDEX_ENTRIES(sb); i++) {
+			bno = ouichefs_index_get(sb, index, i);
+			if (bno >= start && bno < end)
+				break;
+		}
+		brelse(bh);
+		if (i == OUICHEFS_INDEX_ENTRIES(sb))
+			continue;
+
+		inode = ouichefs_iget(sb, ino);
+		if (IS_ERR(inode))
+			continue;
+		/* Truncate must not release the blocks while they are moved */
+		inode_lock_shared(inode);
+		ret = evacuate_inode(sb, inode, start, end, &moved);
+		inode_unlock_shared(inode);
+		iput(inode);
+	}
+
+	/* Drop the references held by moved */
+	xa_for_each(&moved, old, entry) {
+		bno = xa_to_value(entry);
+		handle = ouichefs_journal_start(sb, OUICHEFS_MOVE_CREDITS, 0);
+		if (IS_ERR(handle)) {
+			ret = ret ?: PTR_ERR(handle);
+			continue;
+		}
+		ouichefs_release_blocks(handle, sb, &bno, 1);
+		ret = ouichefs_journal_stop(handle) ?: ret;
+	}
+	xa_destroy(&moved);
+
+	return ret;
+}
+
+/*
+ * Empty zones until OUICHEFS_ZONE_RESERVE of them are, each time evacuating
+ * the full zone with the fewest blocks in use. Each zone is tried once.
+ */
+static void ouichefs_zone_gc_work(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(work, struct ouichefs_sb_info, gc_work);
+	uint32_t first = first_zone(sbi), nr = nr_zones(sbi);
+	uint32_t z, used, victim, best, nr_empty;
+	unsigned long *tried;
+	int ret;
+
+	tried = bitmap_zalloc(nr, GFP_NOFS);
+	if (!tried)
+		return;
+
+	while (!READ_ONCE(sbi->gc_stopped)) {
+		nr_empty = 0;
+		victim = U32_MAX;
+		best = sbi->zone_blocks;
+		for (z = first; z < nr; z++) {
+			if (z == open_zone_nr(sbi))
+				continue;
+			if (!sbi->zone_cap[z])
+				continue;
+			used = zone_used(sbi, z);
+			if (!used)
+				nr_empty++;
+			else if (used < best && !test_bit(z, tried)) {
+				victim = z;
+				best = used;
+			}
+		}
+		if (nr_empty >= OUICHEFS_ZONE_RESERVE || victim == U32_MAX)
+			break;
+
+		__set_bit(victim, tried);
+		ret = evacuate_zone(sbi->sb, victim);
+		if (ret) {
+			pr_warn("failed to evacuate zone %u (%d)\n", victim,
+				ret);
+			break;
+		}
+	}
+
+	bitmap_free(tried);
+}
+
+/*
+ * Record sequential zones in seq_zones and the capacity of each zone in
+ * zone_cap, and fail if a sequential zone holds metadata.
+ */
+static int report_zone_cb(struct blk_zone *zone, unsigned int idx,
+			  void *data)
+{
+	struct super_block *sb = data;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	unsigned int shift = sb->s_blocksize_bits - SECTOR_SHIFT;
+	uint32_t z = div_u64(zone->start >> shift, sbi->zone_blocks);
+
+	if (z >= nr_zones(sbi))
+		return 0;
+	sbi->zone_cap[z] = min_t(uint64_t, zone->capacity >> shift,
+				 sbi->zone_blocks);
+	if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL)
+		return 0;
+	if (!sbi->meta_bdev &&
+	    (uint64_t)z * sbi->zone_blocks < ouichefs_meta_end(sbi)) {
+		pr_err("metadata in sequential zone %u\n", z);
+		return -EUCLEAN;
+	}
+	__set_bit(z, sbi->seq_zones);
+
+	return 0;
+}
+
+/*
+ * Check that the device of a zoned partition has the zones it was formatted
+ * with, and that the metadata only lies in conventional zones.
+ */
+int ouichefs_zone_init(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	unsigned int shift = sb->s_blocksize_bits - SECTOR_SHIFT;
+	uint32_t z;
+	int ret;
+
+	if (!ouichefs_is_zoned(sbi))
+		return 0;
+
+	if (!sbi->zone_blocks ||
+	    nr_zones(sbi) < first_zone(sbi) + OUICHEFS_ZONE_RESERVE + 1) {
+		pr_err("invalid zoned layout (%u blocks per zone)\n",
+		       sbi->zone_blocks);
+		return -EUCLEAN;
+	}
+	/* File data is written back a cluster at a time */
+	if (!ouichefs_clusters_fit(sb)) {
+		pr_err("zoned mode requires clusters of at least %lu bytes\n",
+		       PAGE_SIZE);
+		return -EINVAL;
+	}
+	if (!bdev_is_zoned(sb->s_bdev) ||
+	    bdev_zone_sectors(sb->s_bdev) != (sector_t)sbi->zone_blocks
+							<< shift) {
+		pr_err("device zones do not match the partition\n");
+		return -EINVAL;
+	}
+
+	sbi->seq_zones = bitmap_zalloc(nr_zones(sbi), GFP_KERNEL);
+	sbi->zone_cap = kcalloc(nr_zones(sbi), sizeof(*sbi->zone_cap),
+				GFP_KERNEL);
+	if (!sbi->seq_zones || !sbi->zone_cap) {
+		ret = -ENOMEM;
+		goto free;
+	}
+	ret = blkdev_report_zones(sb->s_bdev, 0, BLK_ALL_ZONES, report_zone_cb,
+				  sb);
+	if (ret < 0)
+		goto free;
+	/* Free blocks past the capacity of a zone can never be written */
+	for (z = first_zone(sbi); z < nr_zones(sbi); z++)
+		sbi->reserved_blocks += sbi->zone_blocks - sbi->zone_cap[z];
+
+	mutex_init(&sbi->zone_lock);
+	sbi->zone_wp = sbi->zone_end = 0;
+	INIT_WORK(&sbi->gc_work, ouichefs_zone_gc_work);
+	sbi->gc_stopped = false;
+
+	return 0;
+
+free:
+	kfree(sbi->zone_cap);
+	sbi->zone_cap = NULL;
+	bitmap_free(sbi->seq_zones);
+	sbi->seq_zones = NULL;
+	return ret;
+}
+
+/*
+ * Stop the collector, which holds inode references, before inodes are
+ * evicted at unmount.
+ */
+void ouichefs_zone_stop(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (!ouichefs_is_zoned(sbi))
+		return;
+	WRITE_ONCE(sbi->gc_stopped, true);
+	cancel_work_sync(&sbi->gc_work);
+}
+
+void ouichefs_zone_destroy(struct super_block *sb)
+{
+	kfree(OUICHEFS_SB(sb)->zone_cap);
+	bitmap_free(OUICHEFS_SB(sb)->seq_zones);
+}